@@ -0,0 +1,117 @@
+#ifndef BENCH_DATA_H
+#define BENCH_DATA_H
+
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <benchmark/benchmark.h>
+#include <pcl/io/pcd_io.h>
+#include <common_lib.h>
+
+/*
+ * Inputs shared by all benchmarks. Every benchmark takes the input as its first argument:
+ * SYNTHETIC is a fixed-seed scan of a box-shaped room, RECORDED is the scan stored in the
+ * .pcd file named by $FASTLIO_BENCH_SCAN (skipped when the variable is not set).
+ */
+enum BenchInput { SYNTHETIC = 0, RECORDED = 1 };
+
+const int    BENCH_SCAN_LINES = 16;
+const double BENCH_SCAN_PERIOD = 0.1;   // s
+
+/* offset time in ms from the azimuth, for scans recorded without per-point times */
+inline void stamp_by_azimuth(PointCloudXYZI &scan)
+{
+    for (PointType &p : scan.points)
+    {
+        double azimuth = atan2(p.y, p.x) + M_PI;
+        p.curvature = float(azimuth / (2 * M_PI) * BENCH_SCAN_PERIOD * 1000.0);
+    }
+}
+
+/* 16-line spinning lidar in the middle of a 20 x 12 x 4 m room, 1 cm range noise */
+inline PointCloudXYZI::Ptr synthetic_scan()
+{
+    static PointCloudXYZI::Ptr scan;
+    if (scan) return scan;
+    scan.reset(new PointCloudXYZI());
+    std::mt19937 rng(42);
+    std::normal_distribution<double> noise(0.0, 0.01);
+    const double half[3] = {10.0, 6.0, 2.0};
+    const int columns = 1800;
+    for (int c = 0; c < columns; c++)
+    {
+        double azimuth = 2 * M_PI * c / columns - M_PI;
+        for (int r = 0; r < BENCH_SCAN_LINES; r++)
+        {
+            double elevation = (-15.0 + 2.0 * r) * M_PI / 180.0;
+            V3D dir(cos(elevation) * cos(azimuth), cos(elevation) * sin(azimuth), sin(elevation));
+            double range = INFINITY;
+            for (int k = 0; k < 3; k++)
+                if (fabs(dir(k)) > 1e-9) range = min(range, half[k] / fabs(dir(k)));
+            range += noise(rng);
+            PointType p;
+            p.x = range * dir(0);
+            p.y = range * dir(1);
+            p.z = range * dir(2);
+            p.intensity = float(r);
+            p.curvature = float(double(c) / columns * BENCH_SCAN_PERIOD * 1000.0);
+            scan->push_back(p);
+        }
+    }
+    return scan;
+}
+
+/* nullptr when $FASTLIO_BENCH_SCAN is not set or cannot be read */
+inline PointCloudXYZI::Ptr recorded_scan()
+{
+    static bool loaded = false;
+    static PointCloudXYZI::Ptr scan;
+    if (loaded) return scan;
+    loaded = true;
+    const char *path = getenv("FASTLIO_BENCH_SCAN");
+    if (path == nullptr) return scan;
+    PointCloudXYZI::Ptr cloud(new PointCloudXYZI());
+    if (pcl::io::loadPCDFile<PointType>(path, *cloud) < 0 || cloud->empty()) return scan;
+    bool has_time = false;
+    for (const PointType &p : cloud->points) has_time |= p.curvature != 0.0f;
+    if (!has_time) stamp_by_azimuth(*cloud);
+    scan = cloud;
+    return scan;
+}
+
+/* the scan of the benchmark's input argument, or nullptr after marking the benchmark skipped */
+inline PointCloudXYZI::Ptr bench_scan(benchmark::State &state)
+{
+    if (state.range(0) == SYNTHETIC) return synthetic_scan();
+    PointCloudXYZI::Ptr scan = recorded_scan();
+    if (!scan) state.SkipWithError("set FASTLIO_BENCH_SCAN to a .pcd scan to run the recorded input");
+    return scan;
+}
+
+/* every step-th point moved by a small rigid motion, used as query against a map built from the scan */
+inline PointVector perturbed_points(const PointCloudXYZI &scan, int step, const M3D &R, const V3D &t)
+{
+    PointVector out;
+    out.reserve(scan.size() / step + 1);
+    for (size_t i = 0; i < scan.size(); i += step)
+    {
+        PointType p = scan.points[i];
+        V3D q(R * V3D(p.x, p.y, p.z) + t);
+        p.x = q(0);
+        p.y = q(1);
+        p.z = q(2);
+        out.push_back(p);
+    }
+    return out;
+}
+
+/* IMU samples at 200 Hz over [t0, t1], level and turning at yaw_rate */
+inline deque<ImuSample> synthetic_imu(double t0, double t1, double yaw_rate = 0.2)
+{
+    deque<ImuSample> imu;
+    for (double t = t0; t <= t1 + 1e-9; t += 0.005)
+        imu.push_back(ImuSample{t, V3D(0.0, 0.0, G_m_s2), V3D(0.0, 0.0, yaw_rate)});
+    return imu;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include <bench_data.h>
+#include <use-ikfom.hpp>
+#include <ikd-Tree/ikd_Tree.h>
+
+/*** point-to-plane problem of one scan, correspondences fixed so only the filter is measured ***/
+static PointVector   plane_points;     // body frame
+static vector<VF(4), Eigen::aligned_allocator<VF(4)>> plane_coeffs;
+static bool          reduced_en = true;
+
+/* same residual and Jacobian as the mapping node's h_share_model, extrinsic not estimated */
+static void h_planes(state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data)
+{
+    int n = plane_points.size();
+    ekfom_data.reduced = reduced_en;
+    if (reduced_en)
+    {
+        ekfom_data.HTH.setZero();
+        ekfom_data.HTh.setZero();
+        ekfom_data.h_x.resize(0, 12);
+        ekfom_data.h.resize(0);
+    }
+    else
+    {
+        ekfom_data.h_x = MatrixXd::Zero(n, 12);
+        ekfom_data.h.resize(n);
+    }
+    M3D R(s.rot.toRotationMatrix());
+    for (int i = 0; i < n; i++)
+    {
+        const PointType &p = plane_points[i];
+        V3D p_imu(s.offset_R_L_I * V3D(p.x, p.y, p.z) + s.offset_T_L_I);
+        V3D p_world(R * p_imu + s.pos);
+        V3D normal(plane_coeffs[i](0), plane_coeffs[i](1), plane_coeffs[i](2));
+        double pd2 = normal.dot(p_world) + plane_coeffs[i](3);
+        M3D point_crossmat;
+        point_crossmat << SKEW_SYM_MATRX(p_imu);
+        V3D A(point_crossmat * (R.transpose() * normal));
+        Matrix<double, 1, 12> h_row;
+        h_row << VEC_FROM_ARRAY(normal), VEC_FROM_ARRAY(A), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0;
+        if (reduced_en)
+        {
+            ekfom_data.HTH.noalias() += h_row.transpose() * h_row;
+            ekfom_data.HTh.noalias() += h_row.transpose() * (-pd2);
+        }
+        else
+        {
+            ekfom_data.h_x.block<1, 12>(i, 0) = h_row;
+            ekfom_data.h(i) = -pd2;
+        }
+    }
+}
+
+/* planes fitted around every 8th point of the scan, seen from a pose 5 cm / 0.6 deg off */
+static bool setup_planes(const PointCloudXYZI &scan)
+{
+    KD_TREE<PointType> tree;
+    tree.Build(scan.points);
+    PointVector queries = perturbed_points(scan, 8, Eye3d, Zero3d);
+    vector<PointVector> nearest;
+    vector<vector<float>> dists;
+    tree.Nearest_Search_Batch(queries, NUM_MATCH_POINTS, nearest, dists);
+    plane_points.clear();
+    plane_coeffs.clear();
+    M3D R_off(Exp(0.0, 0.0, 0.01));
+    V3D t_off(0.05, -0.03, 0.02);
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        VF(4) pabcd;
+        if (nearest[i].size() < NUM_MATCH_POINTS || !esti_plane(pabcd, nearest[i], 0.1f)) continue;
+        /* body point such that the true pose (R_off, t_off) maps it back onto the plane */
+        V3D q(R_off.transpose() * (V3D(queries[i].x, queries[i].y, queries[i].z) - t_off));
+        PointType p = queries[i];
+        p.x = q(0);
+        p.y = q(1);
+        p.z = q(2);
+        plane_points.push_back(p);
+        plane_coeffs.push_back(pabcd);
+    }
+    return !plane_points.empty();
+}
+
+static void init_filter(esekfom::esekf<state_ikfom, 12, input_ikfom> &kf)
+{
+    double epsi[23];
+    fill(epsi, epsi + 23, 0.001);
+    kf.init_dyn_share(get_f, df_dx, df_dw, h_planes, 4, epsi);
+    state_ikfom x = kf.get_x();
+    x.grav = S2(V3D(0.0, 0.0, -G_m_s2));
+    x.offset_R_L_I = SO3(Eye3d);
+    x.offset_T_L_I = Zero3d;
+    kf.change_x(x);
+    esekfom::esekf<state_ikfom, 12, input_ikfom>::cov P = kf.get_P();
+    P.setIdentity();
+    P *= 0.01;
+    kf.change_P(P);
+}
+
+static void BM_EsekfPredict(benchmark::State &state)
+{
+    esekfom::esekf<state_ikfom, 12, input_ikfom> kf;
+    init_filter(kf);
+    Eigen::Matrix<double, 12, 12> Q = process_noise_cov();
+    input_ikfom in;
+    in.acc = V3D(0.1, 0.0, G_m_s2);
+    in.gyro = V3D(0.0, 0.0, 0.2);
+    double dt = 0.005;
+    for (auto _ : state)
+    {
+        kf.predict(dt, Q, in);
+    }
+    benchmark::DoNotOptimize(kf.get_x().pos);
+}
+BENCHMARK(BM_EsekfPredict);
+
+/* full iterated update from the same prior each time, second argument: reduced (H^T H) path */
+static void BM_EsekfUpdate(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    if (!setup_planes(*scan))
+    {
+        state.SkipWithError("no planes in the scan");
+        return;
+    }
+    reduced_en = state.range(1) > 0;
+    esekfom::esekf<state_ikfom, 12, input_ikfom> kf;
+    init_filter(kf);
+    state_ikfom x0 = kf.get_x();
+    esekfom::esekf<state_ikfom, 12, input_ikfom>::cov P0 = kf.get_P();
+    double solve_time = 0;
+    for (auto _ : state)
+    {
+        kf.change_x(x0);
+        kf.change_P(P0);
+        kf.update_iterated_dyn_share_modified(0.001, solve_time);
+    }
+    state_ikfom x = kf.get_x();
+    state.SetItemsProcessed(state.iterations() * plane_points.size());
+    state.counters["points"] = plane_points.size();
+    state.counters["pos_err_mm"] = (x.pos - V3D(0.05, -0.03, 0.02)).norm() * 1000.0;
+}
+BENCHMARK(BM_EsekfUpdate)->ArgNames({"input", "reduced"})->Args({SYNTHETIC, 0})->Args({SYNTHETIC, 1})->Args({RECORDED, 0})->Args({RECORDED, 1})->Unit(benchmark::kMicrosecond);
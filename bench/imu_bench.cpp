@@ -0,0 +1,57 @@
+#include <bench_data.h>
+#include "IMU_Processing.hpp"
+
+static void h_unused(state_ikfom &, esekfom::dyn_share_datastruct<double> &) {}
+
+/*
+ * ImuProcess::Process after the IMU initialisation, i.e. forward propagation over the IMU
+ * samples of one scan and UndistortPcl. The scan is replayed with advancing stamps, the
+ * second argument selects the sort-free parallel undistortion.
+ */
+static void BM_UndistortPcl(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    esekfom::esekf<state_ikfom, 12, input_ikfom> kf;
+    double epsi[23];
+    fill(epsi, epsi + 23, 0.001);
+    kf.init_dyn_share(get_f, df_dx, df_dw, h_unused, 4, epsi);
+
+    ImuProcess imu;
+    imu.set_extrinsic(V3D(0.05, 0.0, 0.1), Eye3d);
+    imu.set_gyr_cov(V3D(0.1, 0.1, 0.1));
+    imu.set_acc_cov(V3D(0.1, 0.1, 0.1));
+    imu.set_gyr_bias_cov(V3D(0.0001, 0.0001, 0.0001));
+    imu.set_acc_bias_cov(V3D(0.0001, 0.0001, 0.0001));
+    imu.lidar_type = VELO16;
+    imu.parallel_undistort = state.range(1) > 0;
+
+    MeasureGroup meas;
+    meas.lidar = scan;
+    PointCloudXYZI::Ptr out(new PointCloudXYZI());
+    double t = 0.0;
+    auto next_scan = [&]()
+    {
+        meas.lidar_beg_time = t;
+        meas.lidar_end_time = t + BENCH_SCAN_PERIOD;
+        meas.imu = synthetic_imu(t, t + BENCH_SCAN_PERIOD);
+        t += BENCH_SCAN_PERIOD;
+    };
+    /* the first scans only initialise gravity and biases */
+    for (int i = 0; i <= MAX_INI_COUNT; i++)
+    {
+        next_scan();
+        imu.Process(meas, kf, out);
+    }
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        next_scan();
+        state.ResumeTiming();
+        imu.Process(meas, kf, out);
+        benchmark::DoNotOptimize(out->points.data());
+    }
+    state.SetItemsProcessed(state.iterations() * scan->size());
+}
+BENCHMARK(BM_UndistortPcl)->ArgNames({"input", "parallel"})->Args({SYNTHETIC, 0})->Args({SYNTHETIC, 1})->Args({RECORDED, 0})->Args({RECORDED, 1})->Unit(benchmark::kMicrosecond);
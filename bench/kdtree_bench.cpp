@@ -0,0 +1,115 @@
+#include <bench_data.h>
+#include <ikd-Tree/ikd_Tree.h>
+
+static const M3D  QUERY_R(Exp(0.0, 0.0, 0.01));
+static const V3D  QUERY_T(0.05, -0.03, 0.02);
+
+static void BM_KdTreeBuild(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    KD_TREE<PointType> tree;
+    for (auto _ : state)
+    {
+        tree.Build(scan->points);
+    }
+    state.SetItemsProcessed(state.iterations() * scan->size());
+}
+BENCHMARK(BM_KdTreeBuild)->Arg(SYNTHETIC)->Arg(RECORDED)->Unit(benchmark::kMicrosecond);
+
+static void BM_KdTreeNearestSearch(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    KD_TREE<PointType> tree;
+    tree.Build(scan->points);
+    PointVector queries = perturbed_points(*scan, 4, QUERY_R, QUERY_T);
+    PointVector nearest;
+    vector<float> dists;
+    for (auto _ : state)
+    {
+        for (const PointType &q : queries)
+        {
+            tree.Nearest_Search(q, NUM_MATCH_POINTS, nearest, dists);
+            benchmark::DoNotOptimize(nearest.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * queries.size());
+}
+BENCHMARK(BM_KdTreeNearestSearch)->Arg(SYNTHETIC)->Arg(RECORDED)->Unit(benchmark::kMicrosecond);
+
+/* the same queries in one call, as h_share_model issues them, on 1 and on 4 threads */
+static void BM_KdTreeNearestSearchBatch(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    KD_TREE<PointType> tree;
+    tree.Build(scan->points);
+    PointVector queries = perturbed_points(*scan, 4, QUERY_R, QUERY_T);
+    vector<PointVector> nearest;
+    vector<vector<float>> dists;
+    for (auto _ : state)
+    {
+        tree.Nearest_Search_Batch(queries, NUM_MATCH_POINTS, nearest, dists, INFINITY, state.range(1));
+        benchmark::DoNotOptimize(nearest.data());
+    }
+    state.SetItemsProcessed(state.iterations() * queries.size());
+}
+BENCHMARK(BM_KdTreeNearestSearchBatch)->ArgNames({"input", "threads"})->Args({SYNTHETIC, 1})->Args({SYNTHETIC, 4})->Args({RECORDED, 1})->Args({RECORDED, 4})->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+/*
+ * A tree per iteration: a large delete or add hands the root to the rebuild thread, and
+ * rebuilding the same tree under it is not safe. Destroying the tree joins that thread.
+ */
+static unique_ptr<KD_TREE<PointType>> fresh_tree(const PointCloudXYZI &scan, float downsample)
+{
+    unique_ptr<KD_TREE<PointType>> tree(new KD_TREE<PointType>());
+    tree->set_downsample_param(downsample);
+    tree->Build(scan.points);
+    return tree;
+}
+
+/* adds a moved copy of every other point to a map of the scan, with the downsampling of the mapping node */
+static void BM_KdTreeAddPoints(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    PointVector added = perturbed_points(*scan, 2, QUERY_R, QUERY_T);
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        unique_ptr<KD_TREE<PointType>> tree = fresh_tree(*scan, state.range(1) / 10.0f);
+        PointVector to_add = added;
+        state.ResumeTiming();
+        tree->Add_Points(to_add, state.range(1) > 0);
+        state.PauseTiming();
+        tree.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * added.size());
+}
+BENCHMARK(BM_KdTreeAddPoints)->ArgNames({"input", "downsample_dm"})->Args({SYNTHETIC, 0})->Args({SYNTHETIC, 5})->Args({RECORDED, 0})->Args({RECORDED, 5})->Unit(benchmark::kMicrosecond);
+
+/* removes the slab beyond x = 5 m, as lasermap_fov_segment does when the local map moves */
+static void BM_KdTreeDeletePointBoxes(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    vector<BoxPointType> boxes(1);
+    boxes[0].vertex_min[0] = 5.0f;   boxes[0].vertex_max[0] = 1000.0f;
+    boxes[0].vertex_min[1] = -1000.0f; boxes[0].vertex_max[1] = 1000.0f;
+    boxes[0].vertex_min[2] = -1000.0f; boxes[0].vertex_max[2] = 1000.0f;
+    int deleted = 0;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        unique_ptr<KD_TREE<PointType>> tree = fresh_tree(*scan, 0.0f);
+        state.ResumeTiming();
+        deleted = tree->Delete_Point_Boxes(boxes);
+        state.PauseTiming();
+        tree.reset();
+        state.ResumeTiming();
+    }
+    state.counters["deleted"] = deleted;
+}
+BENCHMARK(BM_KdTreeDeletePointBoxes)->Arg(SYNTHETIC)->Arg(RECORDED)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,54 @@
+#include <bench_data.h>
+#include <ikd-Tree/ikd_Tree.h>
+
+/* the NUM_MATCH_POINTS neighbourhoods a registration iteration fits planes to */
+static vector<PointVector> neighbourhoods(const PointCloudXYZI &scan)
+{
+    KD_TREE<PointType> tree;
+    tree.Build(scan.points);
+    PointVector queries = perturbed_points(scan, 4, Exp(0.0, 0.0, 0.01), V3D(0.05, -0.03, 0.02));
+    vector<PointVector> nearest;
+    vector<vector<float>> dists;
+    tree.Nearest_Search_Batch(queries, NUM_MATCH_POINTS, nearest, dists);
+    vector<PointVector> out;
+    for (PointVector &n : nearest)
+        if (n.size() == NUM_MATCH_POINTS) out.push_back(n);
+    return out;
+}
+
+static void BM_EstiPlane(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    vector<PointVector> points = neighbourhoods(*scan);
+    VF(4) pabcd;
+    int valid = 0;
+    for (auto _ : state)
+    {
+        valid = 0;
+        for (const PointVector &p : points) valid += esti_plane(pabcd, p, 0.1f);
+        benchmark::DoNotOptimize(valid);
+    }
+    state.SetItemsProcessed(state.iterations() * points.size());
+    state.counters["valid"] = valid;
+}
+BENCHMARK(BM_EstiPlane)->Arg(SYNTHETIC)->Arg(RECORDED)->Unit(benchmark::kMicrosecond);
+
+/* the QR fit esti_plane replaced, kept as reference */
+static void BM_EstiPlaneQr(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    vector<PointVector> points = neighbourhoods(*scan);
+    VF(4) pabcd;
+    int valid = 0;
+    for (auto _ : state)
+    {
+        valid = 0;
+        for (const PointVector &p : points) valid += esti_plane_qr(pabcd, p, 0.1f);
+        benchmark::DoNotOptimize(valid);
+    }
+    state.SetItemsProcessed(state.iterations() * points.size());
+    state.counters["valid"] = valid;
+}
+BENCHMARK(BM_EstiPlaneQr)->Arg(SYNTHETIC)->Arg(RECORDED)->Unit(benchmark::kMicrosecond);
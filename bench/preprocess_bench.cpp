@@ -0,0 +1,50 @@
+#include <bench_data.h>
+#include "preprocess.h"
+
+/* the scan as a Velodyne PointCloud2, the ring taken from the elevation of each point */
+static sensor_msgs::PointCloud2::ConstPtr velodyne_msg(const PointCloudXYZI &scan)
+{
+    pcl::PointCloud<velodyne_ros::Point> cloud;
+    cloud.reserve(scan.size());
+    for (const PointType &p : scan.points)
+    {
+        double elevation = atan2(p.z, sqrt(p.x * p.x + p.y * p.y)) * 180.0 / M_PI;
+        velodyne_ros::Point q;
+        q.x = p.x;
+        q.y = p.y;
+        q.z = p.z;
+        q.intensity = p.intensity;
+        q.time = p.curvature / 1000.0f;
+        q.ring = uint16_t(CONSTRAIN(int(round((elevation + 15.0) / 2.0)), 0, BENCH_SCAN_LINES - 1));
+        cloud.push_back(q);
+    }
+    cloud.width = cloud.size();
+    cloud.height = 1;
+    sensor_msgs::PointCloud2::Ptr msg(new sensor_msgs::PointCloud2());
+    pcl::toROSMsg(cloud, *msg);
+    return msg;
+}
+
+/*
+ * Velodyne preprocessing with and without feature extraction, the difference between the two
+ * is Preprocess::give_feature over all rings.
+ */
+static void BM_PreprocessVelodyne(benchmark::State &state)
+{
+    PointCloudXYZI::Ptr scan = bench_scan(state);
+    if (!scan) return;
+    sensor_msgs::PointCloud2::ConstPtr msg = velodyne_msg(*scan);
+    Preprocess pre;
+    pre.set(state.range(1) > 0, VELO16, 0.5, 1);
+    pre.N_SCANS = BENCH_SCAN_LINES;
+    pre.time_unit = SEC;
+    PointCloudXYZI::Ptr out(new PointCloudXYZI());
+    for (auto _ : state)
+    {
+        pre.process(msg, out);
+        benchmark::DoNotOptimize(out->points.data());
+    }
+    state.SetItemsProcessed(state.iterations() * scan->size());
+    state.counters["out_points"] = out->size();
+}
+BENCHMARK(BM_PreprocessVelodyne)->ArgNames({"input", "feature"})->Args({SYNTHETIC, 0})->Args({SYNTHETIC, 1})->Args({RECORDED, 0})->Args({RECORDED, 1})->Unit(benchmark::kMicrosecond);
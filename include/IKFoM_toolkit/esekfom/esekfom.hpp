@@ -38,6 +38,7 @@
 
 #include <vector>
 #include <cstdlib>
+#include <functional>
 
 #include <boost/bind.hpp>
 #include <Eigen/Core>
@@ -86,6 +87,11 @@ struct dyn_share_datastruct
 	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> h_v;
 	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> h_x;
 	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> R;
+	//reduced measurement, only read by update_iterated_dyn_share_modified: when set, h_x and h are left empty
+	//and the measurement model provides HTH = h_x^T * h_x and HTh = h_x^T * h over its first 12 state dimensions.
+	bool reduced;
+	Eigen::Matrix<T, 12, 12> HTH;
+	Eigen::Matrix<T, 12, 1> HTh;
 };
 
 //used for iterated error state EKF update
@@ -235,7 +241,7 @@ public:
 	//receive system-specific models and their differentions
 	//for measurement as an Eigen matrix whose dimension is changing.
 	//calculate  measurement (z), estimate measurement (h), partial differention matrices (h_x, h_v) and the noise covariance (R) at the same time, by only one function (h_dyn_share_in).
-	void init_dyn_share(processModel f_in, processMatrix1 f_x_in, processMatrix2 f_w_in, measurementModel_dyn_share h_dyn_share_in, int maximum_iteration, scalar_type limit_vector[n])
+	void init_dyn_share(processModel f_in, processMatrix1 f_x_in, processMatrix2 f_w_in, const std::function<measurementModel_dyn_share> &h_dyn_share_in, int maximum_iteration, scalar_type limit_vector[n])
 	{
 		f = f_in;
 		f_x = f_x_in;
@@ -287,22 +293,16 @@ public:
 		x_.oplus(f_, dt);
 
 		F_x1 = cov::Identity();
-		for (std::vector<std::pair<std::pair<int, int>, int> >::iterator it = x_.vect_state.begin(); it != x_.vect_state.end(); it++) {
+		for (auto it = x_.vect_state.begin(); it != x_.vect_state.end(); it++) {
 			int idx = (*it).first.first;
 			int dim = (*it).first.second;
 			int dof = (*it).second;
-			for(int i = 0; i < n; i++){
-				for(int j=0; j<dof; j++)
-				{f_x_final(idx+j, i) = f_x_(dim+j, i);}	
-			}
-			for(int i = 0; i < process_noise_dof; i++){
-				for(int j=0; j<dof; j++)
-				{f_w_final(idx+j, i) = f_w_(dim+j, i);}
-			}
+			f_x_final.middleRows(idx, dof) = f_x_.middleRows(dim, dof);
+			f_w_final.middleRows(idx, dof) = f_w_.middleRows(dim, dof);
 		}
 		Matrix<scalar_type, 3, 3> res_temp_SO3;
 		MTK::vect<3, scalar_type> seg_SO3;
-		for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+		for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 			int idx = (*it).first;
 			int dim = (*it).second;
 			for(int i = 0; i < 3; i++){
@@ -321,19 +321,15 @@ public:
 			F_x1.template block<3, 3>(idx, idx) = res.toRotationMatrix();
 		#endif			
 			res_temp_SO3 = MTK::A_matrix(seg_SO3);
-			for(int i = 0; i < n; i++){
-				f_x_final. template block<3, 1>(idx, i) = res_temp_SO3 * (f_x_. template block<3, 1>(dim, i));	
-			}
-			for(int i = 0; i < process_noise_dof; i++){
-				f_w_final. template block<3, 1>(idx, i) = res_temp_SO3 * (f_w_. template block<3, 1>(dim, i));
-			}
+			f_x_final. template block<3, n>(idx, 0).noalias() = res_temp_SO3 * f_x_. template block<3, n>(dim, 0);
+			f_w_final. template block<3, process_noise_dof>(idx, 0).noalias() = res_temp_SO3 * f_w_. template block<3, process_noise_dof>(dim, 0);
 		}
 		
 		
 		Matrix<scalar_type, 2, 3> res_temp_S2;
 		Matrix<scalar_type, 2, 2> res_temp_S2_;
 		MTK::vect<3, scalar_type> seg_S2;
-		for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+		for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 			int idx = (*it).first;
 			int dim = (*it).second;
 			for(int i = 0; i < 3; i++){
@@ -361,13 +357,8 @@ public:
 			x_before.S2_hat(x_before_hat, idx);
 			res_temp_S2 = -Nx * res.toRotationMatrix() * x_before_hat*MTK::A_matrix(seg_S2).transpose();
 			
-			for(int i = 0; i < n; i++){
-				f_x_final. template block<2, 1>(idx, i) = res_temp_S2 * (f_x_. template block<3, 1>(dim, i));
-				
-			}
-			for(int i = 0; i < process_noise_dof; i++){
-				f_w_final. template block<2, 1>(idx, i) = res_temp_S2 * (f_w_. template block<3, 1>(dim, i));
-			}
+			f_x_final. template block<2, n>(idx, 0).noalias() = res_temp_S2 * f_x_. template block<3, n>(dim, 0);
+			f_w_final. template block<2, process_noise_dof>(idx, 0).noalias() = res_temp_S2 * f_w_. template block<3, process_noise_dof>(dim, 0);
 		}
 	
 	#ifdef USE_sparse
@@ -417,7 +408,7 @@ public:
 			
 			Matrix<scalar_type, 3, 3> res_temp_SO3;
 			MTK::vect<3, scalar_type> seg_SO3;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+			for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 3; i++){
@@ -437,7 +428,7 @@ public:
 		
 			Matrix<scalar_type, 2, 2> res_temp_S2;
 			MTK::vect<2, scalar_type> seg_S2;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+			for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 2; i++){
@@ -512,7 +503,7 @@ public:
 		
 				Matrix<scalar_type, 3, 3> res_temp_SO3;
 				MTK::vect<3, scalar_type> seg_SO3;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				for(auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 					int idx = (*it).first;
 					for(int i = 0; i < 3; i++){
 						seg_SO3(i) = dx_(i + idx);
@@ -541,7 +532,7 @@ public:
 
 				Matrix<scalar_type, 2, 2> res_temp_S2;
 				MTK::vect<2, scalar_type> seg_S2;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				for(auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 					int idx = (*it).first;
 			
 					for(int i = 0; i < 2; i++){
@@ -628,7 +619,7 @@ public:
 			
 			Matrix<scalar_type, 3, 3> res_temp_SO3;
 			MTK::vect<3, scalar_type> seg_SO3;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+			for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 3; i++){
@@ -648,7 +639,7 @@ public:
 		
 			Matrix<scalar_type, 2, 2> res_temp_S2;
 			MTK::vect<2, scalar_type> seg_S2;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+			for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 2; i++){
@@ -723,7 +714,7 @@ public:
 		
 				Matrix<scalar_type, 3, 3> res_temp_SO3;
 				MTK::vect<3, scalar_type> seg_SO3;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				for(auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 					int idx = (*it).first;
 					for(int i = 0; i < 3; i++){
 						seg_SO3(i) = dx_(i + idx);
@@ -752,7 +743,7 @@ public:
 
 				Matrix<scalar_type, 2, 2> res_temp_S2;
 				MTK::vect<2, scalar_type> seg_S2;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				for(auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 					int idx = (*it).first;
 			
 					for(int i = 0; i < 2; i++){
@@ -832,7 +823,7 @@ public:
 			P_ = P_propagated;
 			Matrix<scalar_type, 3, 3> res_temp_SO3;
 			MTK::vect<3, scalar_type> seg_SO3;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+			for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 3; i++){
@@ -851,7 +842,7 @@ public:
 		
 			Matrix<scalar_type, 2, 2> res_temp_S2;
 			MTK::vect<2, scalar_type> seg_S2;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+			for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 2; i++){
@@ -922,7 +913,7 @@ public:
 		
 				Matrix<scalar_type, 3, 3> res_temp_SO3;
 				MTK::vect<3, scalar_type> seg_SO3;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				for(auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 					int idx = (*it).first;
 					for(int i = 0; i < 3; i++){
 						seg_SO3(i) = dx_(i + idx);
@@ -951,7 +942,7 @@ public:
 
 				Matrix<scalar_type, 2, 2> res_temp_S2;
 				MTK::vect<2, scalar_type> seg_S2;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				for(auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 					int idx = (*it).first;
 			
 					for(int i = 0; i < 2; i++){
@@ -1037,7 +1028,7 @@ public:
 			P_ = P_propagated;
 			Matrix<scalar_type, 3, 3> res_temp_SO3;
 			MTK::vect<3, scalar_type> seg_SO3;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+			for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 3; i++){
@@ -1056,7 +1047,7 @@ public:
 		
 			Matrix<scalar_type, 2, 2> res_temp_S2;
 			MTK::vect<2, scalar_type> seg_S2;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+			for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 2; i++){
@@ -1128,7 +1119,7 @@ public:
 		
 				Matrix<scalar_type, 3, 3> res_temp_SO3;
 				MTK::vect<3, scalar_type> seg_SO3;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				for(auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 					int idx = (*it).first;
 					for(int i = 0; i < 3; i++){
 						seg_SO3(i) = dx_(i + idx);
@@ -1157,7 +1148,7 @@ public:
 
 				Matrix<scalar_type, 2, 2> res_temp_S2;
 				MTK::vect<2, scalar_type> seg_S2;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				for(auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 					int idx = (*it).first;
 			
 					for(int i = 0; i < 2; i++){
@@ -1240,7 +1231,7 @@ public:
 			P_ = P_propagated;
 			Matrix<scalar_type, 3, 3> res_temp_SO3;
 			MTK::vect<3, scalar_type> seg_SO3;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+			for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 3; i++){
@@ -1259,7 +1250,7 @@ public:
 		
 			Matrix<scalar_type, 2, 2> res_temp_S2;
 			MTK::vect<2, scalar_type> seg_S2;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+			for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 2; i++){
@@ -1332,7 +1323,7 @@ public:
 		
 				Matrix<scalar_type, 3, 3> res_temp_SO3;
 				MTK::vect<3, scalar_type> seg_SO3;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				for(auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 					int idx = (*it).first;
 					for(int i = 0; i < 3; i++){
 						seg_SO3(i) = dx_(i + idx);
@@ -1361,7 +1352,7 @@ public:
 
 				Matrix<scalar_type, 2, 2> res_temp_S2;
 				MTK::vect<2, scalar_type> seg_S2;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				for(auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 					int idx = (*it).first;
 			
 					for(int i = 0; i < 2; i++){
@@ -1448,7 +1439,7 @@ public:
 			P_ = P_propagated;
 			Matrix<scalar_type, 3, 3> res_temp_SO3;
 			MTK::vect<3, scalar_type> seg_SO3;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+			for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 3; i++){
@@ -1467,7 +1458,7 @@ public:
 		
 			Matrix<scalar_type, 2, 2> res_temp_S2;
 			MTK::vect<2, scalar_type> seg_S2;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+			for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 2; i++){
@@ -1540,7 +1531,7 @@ public:
 		
 				Matrix<scalar_type, 3, 3> res_temp_SO3;
 				MTK::vect<3, scalar_type> seg_SO3;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				for(auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 					int idx = (*it).first;
 					for(int i = 0; i < 3; i++){
 						seg_SO3(i) = dx_(i + idx);
@@ -1569,7 +1560,7 @@ public:
 
 				Matrix<scalar_type, 2, 2> res_temp_S2;
 				MTK::vect<2, scalar_type> seg_S2;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				for(auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 					int idx = (*it).first;
 			
 					for(int i = 0; i < 2; i++){
@@ -1633,6 +1624,7 @@ public:
 		for(int i=-1; i<maximum_iter; i++)
 		{
 			dyn_share.valid = true;	
+			dyn_share.reduced = false;
 			h_dyn_share(x_, dyn_share);
 
 			if(! dyn_share.valid)
@@ -1644,7 +1636,7 @@ public:
 			#ifdef USE_sparse
 				spMt h_x_ = dyn_share.h_x.sparseView();
 			#else
-				Eigen::Matrix<scalar_type, Eigen::Dynamic, 12> h_x_ = dyn_share.h_x;
+				auto h_x_ = dyn_share.h_x.template leftCols<12>();
 			#endif
 			double solve_start = omp_get_wtime();
 			dof_Measurement = h_x_.rows();
@@ -1658,7 +1650,7 @@ public:
 			
 			Matrix<scalar_type, 3, 3> res_temp_SO3;
 			MTK::vect<3, scalar_type> seg_SO3;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+			for (auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 3; i++){
@@ -1667,17 +1659,13 @@ public:
 
 				res_temp_SO3 = MTK::A_matrix(seg_SO3).transpose();
 				dx_new.template block<3, 1>(idx, 0) = res_temp_SO3 * dx_new.template block<3, 1>(idx, 0);
-				for(int i = 0; i < n; i++){
-					P_. template block<3, 1>(idx, i) = res_temp_SO3 * (P_. template block<3, 1>(idx, i));	
-				}
-				for(int i = 0; i < n; i++){
-					P_. template block<1, 3>(i, idx) =(P_. template block<1, 3>(i, idx)) *  res_temp_SO3.transpose();	
-				}
+				P_. template block<3, n>(idx, 0) = res_temp_SO3 * P_. template block<3, n>(idx, 0);
+				P_. template block<n, 3>(0, idx) = P_. template block<n, 3>(0, idx) * res_temp_SO3.transpose();
 			}
 
 			Matrix<scalar_type, 2, 2> res_temp_S2;
 			MTK::vect<2, scalar_type> seg_S2;
-			for (std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+			for (auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 				int idx = (*it).first;
 				int dim = (*it).second;
 				for(int i = 0; i < 2; i++){
@@ -1690,12 +1678,8 @@ public:
 				x_propagated.S2_Mx(Mx, seg_S2, idx);
 				res_temp_S2 = Nx * Mx; 
 				dx_new.template block<2, 1>(idx, 0) = res_temp_S2 * dx_new.template block<2, 1>(idx, 0);
-				for(int i = 0; i < n; i++){
-					P_. template block<2, 1>(idx, i) = res_temp_S2 * (P_. template block<2, 1>(idx, i));	
-				}
-				for(int i = 0; i < n; i++){
-					P_. template block<1, 2>(i, idx) = (P_. template block<1, 2>(i, idx)) * res_temp_S2.transpose();
-				}
+				P_. template block<2, n>(idx, 0) = res_temp_S2 * P_. template block<2, n>(idx, 0);
+				P_. template block<n, 2>(0, idx) = P_. template block<n, 2>(0, idx) * res_temp_S2.transpose();
 			}
 			//Matrix<scalar_type, n, Eigen::Dynamic> K_;
 			//Matrix<scalar_type, n, 1> K_h;
@@ -1712,14 +1696,15 @@ public:
 			}
 			*/
 
-			if(n > dof_Measurement)
+			if(n > dof_Measurement && !dyn_share.reduced)
 			{
 			//#ifdef USE_sparse
 				//Matrix<scalar_type, Eigen::Dynamic, Eigen::Dynamic> K_temp = h_x * P_ * h_x.transpose();
 				//spMt R_temp = h_v * R_ * h_v.transpose();
 				//K_temp += R_temp;
-				Eigen::Matrix<scalar_type, Eigen::Dynamic, Eigen::Dynamic> h_x_cur = Eigen::Matrix<scalar_type, Eigen::Dynamic, Eigen::Dynamic>::Zero(dof_Measurement, n);
-				h_x_cur.topLeftCorner(dof_Measurement, 12) = h_x_;
+				//fewer measurements than states here, so the sizes are bounded by n and stay on the stack
+				Eigen::Matrix<scalar_type, Eigen::Dynamic, n, 0, n, n> h_x_cur = Eigen::Matrix<scalar_type, Eigen::Dynamic, n, 0, n, n>::Zero(dof_Measurement, n);
+				h_x_cur.leftCols(12) = h_x_;
 				/*
 				h_x_cur.col(0) = h_x_.col(0);
 				h_x_cur.col(1) = h_x_.col(1);
@@ -1735,7 +1720,9 @@ public:
 				h_x_cur.col(11) = h_x_.col(11);
 				*/
 				
-				Matrix<scalar_type, Eigen::Dynamic, Eigen::Dynamic> K_ = P_ * h_x_cur.transpose() * (h_x_cur * P_ * h_x_cur.transpose()/R + Eigen::Matrix<double, Dynamic, Dynamic>::Identity(dof_Measurement, dof_Measurement)).inverse()/R;
+				Eigen::Matrix<scalar_type, Eigen::Dynamic, Eigen::Dynamic, 0, n, n> S_ = h_x_cur * P_ * h_x_cur.transpose() / R;
+				S_.diagonal().array() += 1.0;
+				Matrix<scalar_type, n, Eigen::Dynamic, 0, n, n> K_ = P_ * h_x_cur.transpose() * S_.inverse() / R;
 				K_h = K_ * dyn_share.h;
 				K_x = K_ * h_x_cur;
 			//#else
@@ -1779,34 +1766,22 @@ public:
 				K_ = P_temp.inverse() * h_x.transpose() * R_in;
 				*/
 			#else
-				cov P_temp = (P_/R).inverse();
-				//Eigen::Matrix<scalar_type, 12, Eigen::Dynamic> h_T = h_x_.transpose();
-				Eigen::Matrix<scalar_type, 12, 12> HTH = h_x_.transpose() * h_x_; 
-				P_temp. template block<12, 12>(0, 0) += HTH;
-				/*
-				Eigen::Matrix<scalar_type, Eigen::Dynamic, Eigen::Dynamic> h_x_cur = Eigen::Matrix<scalar_type, Eigen::Dynamic, Eigen::Dynamic>::Zero(dof_Measurement, n);
-				//std::cout << "line 1767" << std::endl;
-				h_x_cur.col(0) = h_x_.col(0);
-				h_x_cur.col(1) = h_x_.col(1);
-				h_x_cur.col(2) = h_x_.col(2);
-				h_x_cur.col(3) = h_x_.col(3);
-				h_x_cur.col(4) = h_x_.col(4);
-				h_x_cur.col(5) = h_x_.col(5);
-				h_x_cur.col(6) = h_x_.col(6);
-				h_x_cur.col(7) = h_x_.col(7);
-				h_x_cur.col(8) = h_x_.col(8);
-				h_x_cur.col(9) = h_x_.col(9);
-				h_x_cur.col(10) = h_x_.col(10);
-				h_x_cur.col(11) = h_x_.col(11);
-				*/
-				cov P_inv = P_temp.inverse();
-				//std::cout << "line 1781" << std::endl;
-				K_h = P_inv. template block<n, 12>(0, 0) * h_x_.transpose() * dyn_share.h;
-				//std::cout << "line 1780" << std::endl;
-				//cov HTH_cur = cov::Zero();
-				//HTH_cur. template block<12, 12>(0, 0) = HTH;
+				Eigen::Matrix<scalar_type, 12, 12> HTH;
+				if(dyn_share.reduced) HTH = dyn_share.HTH;
+				else HTH.noalias() = h_x_.transpose() * h_x_;
+				//first 12 columns of ((P_/R)^-1 + H^T H)^-1, the only part the gain needs
+				Matrix<scalar_type, n, 12> P_inv_12;
+				if(!(schur_update && schur_gain(HTH, R, P_inv_12)))
+				{
+					cov P_temp = (P_/R).inverse();
+					P_temp. template block<12, 12>(0, 0) += HTH;
+					cov P_inv = P_temp.inverse();
+					P_inv_12 = P_inv. template block<n, 12>(0, 0);
+				}
+				if(dyn_share.reduced) K_h = P_inv_12 * dyn_share.HTh;
+				else K_h = P_inv_12 * (h_x_.transpose() * dyn_share.h);
 				K_x.setZero(); // = cov::Zero();
-				K_x. template block<n, 12>(0, 0) = P_inv. template block<n, 12>(0, 0) * HTH;
+				K_x. template block<n, 12>(0, 0) = P_inv_12 * HTH;
 				//K_= (h_x_.transpose() * h_x_ + (P_/R).inverse()).inverse()*h_x_.transpose();
 			#endif 
 			}
@@ -1837,15 +1812,13 @@ public:
 				//std::cout << "iteration time" << t << "," << i << std::endl; 
 				Matrix<scalar_type, 3, 3> res_temp_SO3;
 				MTK::vect<3, scalar_type> seg_SO3;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
+				for(auto it = x_.SO3_state.begin(); it != x_.SO3_state.end(); it++) {
 					int idx = (*it).first;
 					for(int i = 0; i < 3; i++){
 						seg_SO3(i) = dx_(i + idx);
 					}
 					res_temp_SO3 = MTK::A_matrix(seg_SO3).transpose();
-					for(int i = 0; i < n; i++){
-						L_. template block<3, 1>(idx, i) = res_temp_SO3 * (P_. template block<3, 1>(idx, i)); 
-					}
+					L_. template block<3, n>(idx, 0).noalias() = res_temp_SO3 * P_. template block<3, n>(idx, 0);
 					// if(n > dof_Measurement)
 					// {
 					// 	for(int i = 0; i < dof_Measurement; i++){
@@ -1854,19 +1827,15 @@ public:
 					// }
 					// else
 					// {
-						for(int i = 0; i < 12; i++){
-							K_x. template block<3, 1>(idx, i) = res_temp_SO3 * (K_x. template block<3, 1>(idx, i));
-						}
+						K_x. template block<3, 12>(idx, 0) = res_temp_SO3 * K_x. template block<3, 12>(idx, 0);
 					//}
-					for(int i = 0; i < n; i++){
-						L_. template block<1, 3>(i, idx) = (L_. template block<1, 3>(i, idx)) * res_temp_SO3.transpose();
-						P_. template block<1, 3>(i, idx) = (P_. template block<1, 3>(i, idx)) * res_temp_SO3.transpose();
-					}
+					L_. template block<n, 3>(0, idx) = L_. template block<n, 3>(0, idx) * res_temp_SO3.transpose();
+					P_. template block<n, 3>(0, idx) = P_. template block<n, 3>(0, idx) * res_temp_SO3.transpose();
 				}
 
 				Matrix<scalar_type, 2, 2> res_temp_S2;
 				MTK::vect<2, scalar_type> seg_S2;
-				for(typename std::vector<std::pair<int, int> >::iterator it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
+				for(auto it = x_.S2_state.begin(); it != x_.S2_state.end(); it++) {
 					int idx = (*it).first;
 
 					for(int i = 0; i < 2; i++){
@@ -1878,9 +1847,7 @@ public:
 					x_.S2_Nx_yy(Nx, idx);
 					x_propagated.S2_Mx(Mx, seg_S2, idx);
 					res_temp_S2 = Nx * Mx; 
-					for(int i = 0; i < n; i++){
-						L_. template block<2, 1>(idx, i) = res_temp_S2 * (P_. template block<2, 1>(idx, i)); 
-					}
+					L_. template block<2, n>(idx, 0).noalias() = res_temp_S2 * P_. template block<2, n>(idx, 0);
 					// if(n > dof_Measurement)
 					// {
 					// 	for(int i = 0; i < dof_Measurement; i++){
@@ -1889,14 +1856,10 @@ public:
 					// }
 					// else
 					// {
-						for(int i = 0; i < 12; i++){
-							K_x. template block<2, 1>(idx, i) = res_temp_S2 * (K_x. template block<2, 1>(idx, i));
-						}
+						K_x. template block<2, 12>(idx, 0) = res_temp_S2 * K_x. template block<2, 12>(idx, 0);
 					//}
-					for(int i = 0; i < n; i++){
-						L_. template block<1, 2>(i, idx) = (L_. template block<1, 2>(i, idx)) * res_temp_S2.transpose();
-						P_. template block<1, 2>(i, idx) = (P_. template block<1, 2>(i, idx)) * res_temp_S2.transpose();
-					}
+					L_. template block<n, 2>(0, idx) = L_. template block<n, 2>(0, idx) * res_temp_S2.transpose();
+					P_. template block<n, 2>(0, idx) = P_. template block<n, 2>(0, idx) * res_temp_S2.transpose();
 				}
 
 				// if(n > dof_Measurement)
@@ -1922,6 +1885,7 @@ public:
 				// else
 				//{
 					P_ = L_ - K_x.template block<n, 12>(0, 0) * P_.template block<12, n>(0, 0);
+					if(schur_update) P_ = (0.5 * (P_ + P_.transpose())).eval();
 				//}
 				solve_time += omp_get_wtime() - solve_start;
 				return;
@@ -1952,7 +1916,30 @@ public:
 	const cov& get_P() const {
 		return P_;
 	}
+
+	//update_iterated_dyn_share_modified: take the gain from the Schur complement of the observed 12x12 block
+	//instead of inverting the full covariance twice per iteration
+	void set_schur_update(bool enable)
+	{
+		schur_update = enable;
+	}
 private:
+	//first 12 columns of ((P_/R)^-1 + H^T H)^-1 = [I; P21 * P11^-1] * (R * P11^-1 + H^T H)^-1, built from two
+	//12x12 Cholesky factorizations. Returns false when either block is not positive definite.
+	bool schur_gain(const Matrix<scalar_type, 12, 12> &HTH, double R, Matrix<scalar_type, n, 12> &P_inv_12)
+	{
+		Eigen::LLT<Matrix<scalar_type, 12, 12> > P11_llt(P_. template block<12, 12>(0, 0));
+		if(P11_llt.info() != Eigen::Success) return false;
+		Matrix<scalar_type, 12, 12> info = P11_llt.solve(Matrix<scalar_type, 12, 12>::Identity()) * R + HTH;
+		info = (0.5 * (info + info.transpose())).eval();
+		Eigen::LLT<Matrix<scalar_type, 12, 12> > info_llt(info);
+		if(info_llt.info() != Eigen::Success) return false;
+		Matrix<scalar_type, 12, 12> P11_post = info_llt.solve(Matrix<scalar_type, 12, 12>::Identity());
+		P_inv_12. template topRows<12>() = 0.5 * (P11_post + P11_post.transpose());
+		P_inv_12. template bottomRows<n - 12>().noalias() = P11_llt.solve(P_. template block<12, n - 12>(0, 12)).transpose() * P_inv_12. template topRows<12>();
+		return true;
+	}
+
 	state x_;
 	measurement m_;
 	cov P_;
@@ -1976,10 +1963,11 @@ private:
 	measurementMatrix2_dyn *h_v_dyn;
 
 	measurementModel_share *h_share;
-	measurementModel_dyn_share *h_dyn_share;
+	std::function<measurementModel_dyn_share> h_dyn_share;	//may carry its own context, e.g. a lambda bound to the caller
 
 	int maximum_iter = 0;
 	scalar_type limit[n];
+	bool schur_update = false;
 	
 	template <typename T>
     T check_safe_update( T _temp_vec )
@@ -79,6 +79,7 @@
 #define MTK_AUTOCONSTRUCT_HPP_
 
 #include <vector>
+#include <cassert>
 
 #include <boost/preprocessor/seq.hpp>
 #include <boost/preprocessor/cat.hpp>
@@ -87,6 +88,34 @@
 #include "src/SubManifold.hpp"
 #include "startIdx.hpp"
 
+namespace MTK {
+
+/**
+ * Fixed-capacity list holding the layout (S2_state, SO3_state, vect_state) of a
+ * compound manifold. The storage lives inside the manifold, so copying a state
+ * does not touch the heap. The capacity is the number of entries of the manifold;
+ * the build_*_state() functions clear the list first, so calling them again is safe.
+ */
+template<typename T, int Capacity>
+struct layout_list {
+	typedef T* iterator;
+	typedef const T* const_iterator;
+	T items[Capacity];
+	int num;
+
+	layout_list() : num(0) {}
+	void push_back(const T &item) { assert(num < Capacity && "layout_list is full"); items[num++] = item; }
+	void clear() { num = 0; }
+	size_t size() const { return num; }
+	iterator begin() { return items; }
+	iterator end() { return items + num; }
+	const_iterator begin() const { return items; }
+	const_iterator end() const { return items + num; }
+	const T& operator[](int i) const { return items[i]; }
+};
+
+} // namespace MTK
+
 #ifndef PARSED_BY_DOXYGEN
 //////// internals //////
 
@@ -180,9 +209,9 @@ BOOST_PP_FOR_1( \
 #define MTK_BUILD_MANIFOLD(name, entries) \
 struct name { \
 	typedef name self; \
-	std::vector<std::pair<int, int> > S2_state;\
-	std::vector<std::pair<int, int> > SO3_state;\
-	std::vector<std::pair<std::pair<int, int>, int> > vect_state;\
+	MTK::layout_list<std::pair<int, int>, BOOST_PP_SEQ_SIZE(entries)> S2_state;\
+	MTK::layout_list<std::pair<int, int>, BOOST_PP_SEQ_SIZE(entries)> SO3_state;\
+	MTK::layout_list<std::pair<std::pair<int, int>, int>, BOOST_PP_SEQ_SIZE(entries)> vect_state;\
 	MTK_SUBVARLIST(entries, S2_state, SO3_state) \
 	name ( \
 		MTK_TRANSFORM_COMMA(MTK_CONSTRUCTOR_ARG, entries) \
@@ -202,12 +231,15 @@ struct name { \
 		return __os MTK_TRANSFORM(MTK_OSTREAM, entries); \
 	} \
 	void build_S2_state(){\
+		S2_state.clear();\
 		MTK_TRANSFORM(MTK_S2_state, entries)\
 	}\
 	void build_vect_state(){\
+		vect_state.clear();\
 		MTK_TRANSFORM(MTK_vect_state, entries)\
 	}\
 	void build_SO3_state(){\
+		SO3_state.clear();\
 		MTK_TRANSFORM(MTK_SO3_state, entries)\
 	}\
 	void S2_hat(Eigen::Matrix<scalar, 3, 3> &res, int idx) {\
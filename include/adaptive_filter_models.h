@@ -0,0 +1,153 @@
+//================================================ADAPTIVE FILTER=========================================================
+//Description: Process and lidar measurement models of the adaptive filter with their analytic Jacobians. They depend
+//             on the state only, so they are kept apart from the node and tested against finite differences.
+//========================================================================================================================
+#ifndef ADAPTIVE_FILTER_MODELS_H
+#define ADAPTIVE_FILTER_MODELS_H
+
+#include <cmath>
+#include <eigen3/Eigen/Dense>
+#include <eigen3/Eigen/Geometry>
+
+typedef Eigen::Matrix<double,6,1> Vector6d;
+typedef Eigen::Matrix<double,9,1> Vector9d;
+typedef Eigen::Matrix<double,12,1> Vector12d;
+typedef Eigen::Matrix<double,6,6> Matrix6d;
+typedef Eigen::Matrix<double,9,9> Matrix9d;
+typedef Eigen::Matrix<double,12,12> Matrix12d;
+
+//---------
+// Models
+//---------
+// R = Rz(yaw)*Ry(pitch)*Rx(roll)
+inline Eigen::Matrix3d rotation_rpy(double roll, double pitch, double yaw){
+    const double cr = cos(roll), sr = sin(roll);
+    const double cp = cos(pitch), sp = sin(pitch);
+    const double cy = cos(yaw), sy = sin(yaw);
+    Eigen::Matrix3d R;
+    R << cy*cp, cy*sp*sr - sy*cr, cy*sp*cr + sy*sr,
+         sy*cp, sy*sp*sr + cy*cr, sy*sp*cr - cy*sr,
+           -sp,            cp*sr,            cp*cr;
+    return R;
+}
+
+inline Vector12d f_prediction_model(const Vector12d& x, double dt){ 
+    // state: {x, y, z, roll, pitch, yaw, vx, vy, vz, wx, wy, wz}
+    //        {         (world)         }{        (body)        }
+    // teste para corredor de 500 m: vy, vz, wx and wy are forced to zero, so only
+    // the first column of R and the last column of the euler rate matrix are used
+    const double cr = cos(x(3)), sr = sin(x(3));
+    const double cp = cos(x(4)), sp = sin(x(4));
+    const double cy = cos(x(5)), sy = sin(x(5));
+    Vector12d xp;
+
+    xp.segment<3>(0) = x.segment<3>(0) + Eigen::Vector3d(cy*cp, sy*cp, -sp)*x(6)*dt;
+    xp.segment<3>(3) = x.segment<3>(3) + Eigen::Vector3d(cr*sp/cp, -sr, cr/cp)*x(11)*dt;
+    xp.segment<6>(6) << x(6), 0.0, 0.0, 0.0, 0.0, x(11);
+
+    return xp;
+}
+
+inline Vector6d indirect_lidar_measurement(const Vector6d& u, const Vector6d& ul, double dt){
+    Vector6d up;
+
+    const double cr = cos(ul(3)), sr = sin(ul(3));
+    const double cp = cos(ul(4)), sp = sin(ul(4));
+    const Eigen::Matrix3d R = rotation_rpy(ul(3), ul(4), ul(5));
+
+    // inverse of the euler rate matrix (body rates from euler rates)
+    Eigen::Matrix3d Jinv;
+    Jinv << 1.0, 0.0,   -sp,
+            0.0,  cr, sr*cp,
+            0.0, -sr, cr*cp;
+
+    // model
+    Eigen::Vector3d dp = u.segment<3>(0) - ul.segment<3>(0);
+    Eigen::Vector3d da;
+    da(0) = atan2(sin(u(3) - ul(3)),cos(u(3) - ul(3)));
+    da(1) = atan2(sin(u(4) - ul(4)),cos(u(4) - ul(4)));
+    da(2) = atan2(sin(u(5) - ul(5)),cos(u(5) - ul(5)));
+
+    up.segment<3>(0) = R.transpose()*dp/dt;
+    up.segment<3>(3) = Jinv*da/dt;
+
+    return up;
+}
+
+//----------
+// Jacobians
+//----------
+inline Matrix12d jacobian_state(const Vector12d& x, double dt){
+    const double cr = cos(x(3)), sr = sin(x(3));
+    const double cp = cos(x(4)), sp = sin(x(4)), tp = sp/cp;
+    const double cy = cos(x(5)), sy = sin(x(5));
+    const double vdt = x(6)*dt, wdt = x(11)*dt;
+    Matrix12d J = Matrix12d::Zero();
+
+    // position: p + R.col(0)*vx*dt
+    J.block<3,3>(0,0).setIdentity();
+    J.block<3,1>(0,4) << -cy*sp*vdt, -sy*sp*vdt, -cp*vdt;
+    J.block<3,1>(0,5) << -sy*cp*vdt,  cy*cp*vdt,  0.0;
+    J.block<3,1>(0,6) << cy*cp*dt, sy*cp*dt, -sp*dt;
+
+    // attitude: rpy + [cr*tp, -sr, cr/cp]*wz*dt
+    J.block<3,3>(3,3).setIdentity();
+    J.block<3,1>(3,3) += Eigen::Vector3d(-sr*tp, -cr, -sr/cp)*wdt;
+    J.block<3,1>(3,4) += Eigen::Vector3d(cr/(cp*cp), 0.0, cr*sp/(cp*cp))*wdt;
+    J.block<3,1>(3,11) << cr*tp*dt, -sr*dt, cr/cp*dt;
+
+    // velocities: vx and wz are kept, the others are reset
+    J(6,6) = 1.0;
+    J(11,11) = 1.0;
+
+    return J;
+}
+
+inline Matrix6d jacobian_lidar_measurement(const Vector6d& /*u*/, const Vector6d& ul, double dt){ 
+    const double cr = cos(ul(3)), sr = sin(ul(3));
+    const double cp = cos(ul(4)), sp = sin(ul(4));
+    Matrix6d J = Matrix6d::Zero();
+
+    J.block<3,3>(0,0) = rotation_rpy(ul(3), ul(4), ul(5)).transpose()/dt;
+    J.block<3,3>(3,3) << 1.0, 0.0,   -sp,
+                         0.0,  cr, sr*cp,
+                         0.0, -sr, cr*cp;
+    J.block<3,3>(3,3) /= dt;
+
+    return J;
+}
+
+inline Matrix6d jacobian_lidar_measurementL(const Vector6d& u, const Vector6d& ul, double dt){ 
+    const double cr = cos(ul(3)), sr = sin(ul(3));
+    const double cp = cos(ul(4)), sp = sin(ul(4));
+    const Eigen::Matrix3d R = rotation_rpy(ul(3), ul(4), ul(5));
+    const Eigen::Vector3d dp = u.segment<3>(0) - ul.segment<3>(0);
+    Eigen::Vector3d da;
+    da(0) = atan2(sin(u(3) - ul(3)),cos(u(3) - ul(3)));
+    da(1) = atan2(sin(u(4) - ul(4)),cos(u(4) - ul(4)));
+    da(2) = atan2(sin(u(5) - ul(5)),cos(u(5) - ul(5)));
+    Matrix6d J = Matrix6d::Zero();
+
+    // d(R^T*dp)/d(rpy) with dR/droll = R*[ex]^, dR/dpitch = Rz*[ey]^*Ry*Rx, dR/dyaw = [ez]^*R
+    const Eigen::Matrix3d Rz = Eigen::AngleAxisd(ul(5), Eigen::Vector3d::UnitZ()).toRotationMatrix();
+    const Eigen::Matrix3d RyRx = Rz.transpose()*R;
+    const Eigen::Vector3d q = R.transpose()*dp;
+    const Eigen::Vector3d qz = Rz.transpose()*dp;
+    J.block<3,3>(0,0) = -R.transpose();
+    J.block<3,1>(0,3) = -Eigen::Vector3d::UnitX().cross(q);
+    J.block<3,1>(0,4) = -RyRx.transpose()*Eigen::Vector3d::UnitY().cross(qz);
+    J.block<3,1>(0,5) = -R.transpose()*Eigen::Vector3d::UnitZ().cross(dp);
+
+    // d(Jinv*da)/d(rpy), da depends on -rpy
+    Eigen::Matrix3d Jinv;
+    Jinv << 1.0, 0.0,   -sp,
+            0.0,  cr, sr*cp,
+            0.0, -sr, cr*cp;
+    J.block<3,3>(3,3) = -Jinv;
+    J.block<3,1>(3,3) += Eigen::Vector3d(0.0, -sr*da(1) + cr*cp*da(2), -cr*da(1) - sr*cp*da(2));
+    J.block<3,1>(3,4) += Eigen::Vector3d(-cp*da(2), -sr*sp*da(2), -cr*sp*da(2));
+
+    return J/dt;
+}
+
+#endif
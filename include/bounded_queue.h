@@ -0,0 +1,78 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * Blocking FIFO between two pipeline stages. push() waits while the queue is full,
+ * pop() waits for an item and returns false once the queue is closed and drained.
+ * An item counts as in flight until the consumer calls task_done(), so the producer
+ * can wait_idle() before touching state the consumer works on.
+ */
+template <typename T>
+class BoundedQueue
+{
+  public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  bool push(T item)
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_not_full.wait(lock, [this]{ return closed || items.size() < capacity; });
+    if (closed) return false;
+    items.push_back(std::move(item));
+    in_flight ++;
+    cv_not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T &item)
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_not_empty.wait(lock, [this]{ return closed || !items.empty(); });
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    cv_not_full.notify_one();
+    return true;
+  }
+
+  void task_done()
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    in_flight --;
+    if (in_flight == 0) cv_idle.notify_all();
+  }
+
+  void wait_idle()
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_idle.wait(lock, [this]{ return in_flight == 0; });
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    closed = true;
+    cv_not_empty.notify_all();
+    cv_not_full.notify_all();
+  }
+
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    return items.size();
+  }
+
+  private:
+  std::mutex mtx;
+  std::condition_variable cv_not_empty, cv_not_full, cv_idle;
+  std::deque<T> items;
+  size_t capacity;
+  size_t in_flight = 0;
+  bool closed = false;
+};
+
+#endif
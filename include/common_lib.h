@@ -1,15 +1,12 @@
 #ifndef COMMON_LIB_H
 #define COMMON_LIB_H
 
+#include <deque>
+#include <vector>
 #include <so3_math.h>
 #include <Eigen/Eigen>
 #include <pcl/point_types.h>
 #include <pcl/point_cloud.h>
-#include <ekf_fast_lio2/Pose6D.h>
-#include <sensor_msgs/Imu.h>
-#include <nav_msgs/Odometry.h>
-#include <tf/transform_broadcaster.h>
-#include <eigen_conversions/eigen_msg.h>
 
 using namespace std;
 using namespace Eigen;
@@ -33,7 +30,8 @@ using namespace Eigen;
 #define STD_VEC_FROM_EIGEN(mat)  vector<decltype(mat)::Scalar> (mat.data(), mat.data() + mat.rows() * mat.cols())
 #define DEBUG_FILE_DIR(name)     (string(string(ROOT_DIR) + "Log/"+ name))
 
-typedef ekf_fast_lio2::Pose6D Pose6D;
+enum LID_TYPE{AVIA = 1, VELO16, OUST64, MARSIM}; //{1, 2, 3}
+
 typedef pcl::PointXYZINormal PointType;
 typedef pcl::PointCloud<PointType> PointCloudXYZI;
 typedef vector<PointType, Eigen::aligned_allocator<PointType>>  PointVector;
@@ -47,10 +45,29 @@ typedef Matrix3f M3F;
 #define MF(a,b)  Matrix<float, (a), (b)>
 #define VF(a)    Matrix<float, (a), 1>
 
-M3D Eye3d(M3D::Identity());
-M3F Eye3f(M3F::Identity());
-V3D Zero3d(0, 0, 0);
-V3F Zero3f(0, 0, 0);
+const M3D Eye3d(M3D::Identity());
+const M3F Eye3f(M3F::Identity());
+const V3D Zero3d(0, 0, 0);
+const V3F Zero3f(0, 0, 0);
+
+/// the preintegrated Lidar states at the time of IMU measurements in a frame
+struct Pose6D
+{
+    double offset_time;  // the offset time of IMU measurement w.r.t the first lidar point
+    double acc[3];       // the preintegrated total acceleration (global frame) at the Lidar origin
+    double gyr[3];       // the unbiased angular velocity (body frame) at the Lidar origin
+    double vel[3];       // the preintegrated velocity (global frame) at the Lidar origin
+    double pos[3];       // the preintegrated position (global frame) at the Lidar origin
+    double rot[9];       // the preintegrated rotation (global frame) at the Lidar origin
+};
+
+/// IMU sample with its stamp in seconds, already shifted to the lidar clock
+struct ImuSample
+{
+    double time;
+    V3D acc;
+    V3D gyr;
+};
 
 struct MeasureGroup     // Lidar data and imu dates for the curent process
 {
@@ -62,7 +79,7 @@ struct MeasureGroup     // Lidar data and imu dates for the curent process
     double lidar_beg_time;
     double lidar_end_time;
     PointCloudXYZI::Ptr lidar;
-    deque<sensor_msgs::Imu::ConstPtr> imu;
+    deque<ImuSample> imu;
 };
 
 struct StatesGroup
@@ -217,13 +234,13 @@ bool esti_normvector(Matrix<T, 3, 1> &normvec, const PointVector &point, const T
     return true;
 }
 
-float calc_dist(PointType p1, PointType p2){
+inline float calc_dist(PointType p1, PointType p2){
     float d = (p1.x - p2.x) * (p1.x - p2.x) + (p1.y - p2.y) * (p1.y - p2.y) + (p1.z - p2.z) * (p1.z - p2.z);
     return d;
 }
 
 template<typename T>
-bool esti_plane(Matrix<T, 4, 1> &pca_result, const PointVector &point, const T &threshold)
+bool esti_plane_qr(Matrix<T, 4, 1> &pca_result, const PointVector &point, const T &threshold)
 {
     Matrix<T, NUM_MATCH_POINTS, 3> A;
     Matrix<T, NUM_MATCH_POINTS, 1> b;
@@ -256,4 +273,65 @@ bool esti_plane(Matrix<T, 4, 1> &pca_result, const PointVector &point, const T &
     return true;
 }
 
+/*
+ * Same plane as esti_plane_qr (n^T p + 1 = 0 in the least-squares sense), solved through the
+ * 3x3 normal equations with the adjugate in double precision. Since only the direction of n is
+ * kept, n = -adj(A^T A) A^T 1 / det and the division by det reduces to its sign. Falls back to
+ * the QR path only when A^T A has rank < 2 (e.g. collinear neighbours).
+ */
+template<typename T>
+bool esti_plane(Matrix<T, 4, 1> &pca_result, const PointVector &point, const T &threshold)
+{
+    double sxx = 0, sxy = 0, sxz = 0, syy = 0, syz = 0, szz = 0, sx = 0, sy = 0, sz = 0;
+    for (int j = 0; j < NUM_MATCH_POINTS; j++)
+    {
+        double x = point[j].x, y = point[j].y, z = point[j].z;
+        sxx += x * x; sxy += x * y; sxz += x * z;
+        syy += y * y; syz += y * z; szz += z * z;
+        sx  += x;     sy  += y;     sz  += z;
+    }
+
+    double c00 = syy * szz - syz * syz, c01 = sxz * syz - sxy * szz, c02 = sxy * syz - sxz * syy;
+    double c11 = sxx * szz - sxz * sxz, c12 = sxy * sxz - sxx * syz, c22 = sxx * syy - sxy * sxy;
+    double det = sxx * c00 + sxy * c01 + sxz * c02;
+    double nx = c00 * sx + c01 * sy + c02 * sz;
+    double ny = c01 * sx + c11 * sy + c12 * sz;
+    double nz = c02 * sx + c12 * sy + c22 * sz;
+    double n = sqrt(nx * nx + ny * ny + nz * nz);
+    double trace = sxx + syy + szz;
+    if (!(n > 1e-12 * trace * trace * sqrt(sx * sx + sy * sy + sz * sz)))
+        return esti_plane_qr(pca_result, point, threshold);
+
+    double sign = det > 0 ? -1.0 : 1.0;
+    pca_result(0) = sign * nx / n;
+    pca_result(1) = sign * ny / n;
+    pca_result(2) = sign * nz / n;
+    pca_result(3) = fabs(det) / n;
+
+    for (int j = 0; j < NUM_MATCH_POINTS; j++)
+    {
+        if (fabs(pca_result(0) * point[j].x + pca_result(1) * point[j].y + pca_result(2) * point[j].z + pca_result(3)) > threshold)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Fits the planes of num neighbourhoods at once, skipping those with selected[i] == false.
+ * plane_valid[i] is false for skipped neighbourhoods and for those failing the threshold.
+ */
+template<typename T>
+void esti_plane_batch(Matrix<T, 4, 1> *pca_result, bool *plane_valid, const vector<PointVector> &points, const bool *selected, int num, const T &threshold)
+{
+    #ifdef MP_EN
+        #pragma omp parallel for num_threads(MP_PROC_NUM)
+    #endif
+    for (int i = 0; i < num; i++)
+    {
+        plane_valid[i] = selected[i] && esti_plane(pca_result[i], points[i], threshold);
+    }
+}
+
 #endif
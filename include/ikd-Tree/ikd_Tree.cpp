@@ -62,8 +62,38 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
     root->need_push_down_to_left = false;
     root->need_push_down_to_right = false;
     root->point_downsample_deleted = false;
+    root->tree_downsample_deleted = false;
     root->working_flag = false;
-    pthread_mutex_init(&(root->push_down_mutex_lock), NULL);
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::KD_TREE_NODE *KD_TREE<PointType>::new_tree_node()
+{
+    KD_TREE_NODE *node = Node_Pool.alloc();
+    InitTreeNode(node);
+    return node;
+}
+
+template <typename PointType>
+pthread_mutex_t *KD_TREE<PointType>::push_down_lock(KD_TREE_NODE *root)
+{
+    // Nodes live in contiguous slabs, so the slot index hashes neighbouring nodes to different stripes
+    uintptr_t slot = reinterpret_cast<uintptr_t>(root) / sizeof(KD_TREE_NODE);
+    return &push_down_mutex_lock[slot % Push_Down_Lock_Num];
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::rebuild_logger_stats(int &high_water, int &chunks)
+{
+    high_water = Rebuild_Logger.max_size();
+    chunks = Rebuild_Logger.chunk_count();
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::node_pool_stats(int &allocated, int &in_use)
+{
+    allocated = Node_Pool.capacity();
+    in_use = Node_Pool.used();
 }
 
 template <typename PointType>
@@ -194,10 +224,11 @@ void KD_TREE<PointType>::start_thread()
 {
     pthread_mutex_init(&termination_flag_mutex_lock, NULL);
     pthread_mutex_init(&rebuild_ptr_mutex_lock, NULL);
-    pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
     pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL);
     pthread_mutex_init(&working_flag_mutex, NULL);
     pthread_mutex_init(&search_flag_mutex, NULL);
+    for (int i = 0; i < Push_Down_Lock_Num; i++)
+        pthread_mutex_init(&push_down_mutex_lock[i], NULL);
     pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void *)this);
     printf("Multi thread started \n");
 }
@@ -211,11 +242,12 @@ void KD_TREE<PointType>::stop_thread()
     if (rebuild_thread)
         pthread_join(rebuild_thread, NULL);
     pthread_mutex_destroy(&termination_flag_mutex_lock);
-    pthread_mutex_destroy(&rebuild_logger_mutex_lock);
     pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
     pthread_mutex_destroy(&working_flag_mutex);
     pthread_mutex_destroy(&search_flag_mutex);
+    for (int i = 0; i < Push_Down_Lock_Num; i++)
+        pthread_mutex_destroy(&push_down_mutex_lock[i]);
 }
 
 template <typename PointType>
@@ -283,24 +315,21 @@ void KD_TREE<PointType>::multi_thread_rebuild()
             {
                 BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size() - 1, Rebuild_PCL_Storage);
                 // Rebuild has been done. Updates the blocked operations into the new tree
+                // The rebuild thread is the only consumer; working_flag_mutex keeps pushes out while it pops
                 pthread_mutex_lock(&working_flag_mutex);
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 int tmp_counter = 0;
                 while (!Rebuild_Logger.empty())
                 {
                     Operation = Rebuild_Logger.front();
-                    max_queue_size = max(max_queue_size, Rebuild_Logger.size());
                     Rebuild_Logger.pop();
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
                     pthread_mutex_unlock(&working_flag_mutex);
                     run_operation(&new_root_node, Operation);
                     tmp_counter++;
                     if (tmp_counter % 10 == 0)
                         usleep(1);
                     pthread_mutex_lock(&working_flag_mutex);
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 }
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                max_queue_size = max(max_queue_size, Rebuild_Logger.max_size());
             }
             /* Replace to original tree*/
             // pthread_mutex_lock(&working_flag_mutex);
@@ -414,8 +443,9 @@ void KD_TREE<PointType>::Build(PointVector point_cloud)
     }
     if (point_cloud.size() == 0)
         return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
-    InitTreeNode(STATIC_ROOT_NODE);
+    if (STATIC_ROOT_NODE != nullptr)
+        Node_Pool.free(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE = new_tree_node();
     BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud);
     Update(STATIC_ROOT_NODE);
     STATIC_ROOT_NODE->TreeSize = 0;
@@ -460,6 +490,88 @@ void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVec
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Nearest_Search_Batch(const PointVector &Query_Points, int k_nearest, vector<PointVector> &Nearest_Points, vector<vector<float>> &Point_Distance, float max_dist, int num_threads)
+{
+    int query_num = Query_Points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    if (query_num == 0)
+        return;
+    // Visit the queries in Morton order so that consecutive searches walk the same branches of the tree
+    float min_corner[3] = {INFINITY, INFINITY, INFINITY}, max_corner[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < query_num; i++)
+    {
+        min_corner[0] = min(min_corner[0], Query_Points[i].x);
+        min_corner[1] = min(min_corner[1], Query_Points[i].y);
+        min_corner[2] = min(min_corner[2], Query_Points[i].z);
+        max_corner[0] = max(max_corner[0], Query_Points[i].x);
+        max_corner[1] = max(max_corner[1], Query_Points[i].y);
+        max_corner[2] = max(max_corner[2], Query_Points[i].z);
+    }
+    float inv_cell[3];
+    for (int j = 0; j < 3; j++)
+        inv_cell[j] = (max_corner[j] > min_corner[j]) ? 1023.0f / (max_corner[j] - min_corner[j]) : 0.0f;
+    vector<pair<uint32_t, int>> query_order(query_num);
+    for (int i = 0; i < query_num; i++)
+        query_order[i] = make_pair(calc_morton_code(Query_Points[i], min_corner, inv_cell), i);
+    sort(query_order.begin(), query_order.end());
+    if (num_threads < 1)
+        num_threads = 1;
+    int chunk_num = (query_num + Batch_Search_Chunk - 1) / Batch_Search_Chunk;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(num_threads)
+#endif
+    {
+        MANUAL_HEAP q(2 * k_nearest);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+        for (int c = 0; c < chunk_num; c++)
+        {
+            // Like Nearest_Search, hold off a rebuild of the root only for a few queries at a time
+            bool root_rebuilding = Rebuild_Ptr != nullptr && *Rebuild_Ptr == Root_Node;
+            if (root_rebuilding)
+            {
+                pthread_mutex_lock(&search_flag_mutex);
+                while (search_mutex_counter == -1)
+                {
+                    pthread_mutex_unlock(&search_flag_mutex);
+                    usleep(1);
+                    pthread_mutex_lock(&search_flag_mutex);
+                }
+                search_mutex_counter += 1;
+                pthread_mutex_unlock(&search_flag_mutex);
+            }
+            int end = min(query_num, (c + 1) * Batch_Search_Chunk);
+            for (int i = c * Batch_Search_Chunk; i < end; i++)
+            {
+                int index = query_order[i].second;
+                q.clear();
+                Search(Root_Node, k_nearest, Query_Points[index], q, max_dist);
+                int k_found = min(k_nearest, int(q.size()));
+                PointVector &points_near = Nearest_Points[index];
+                vector<float> &points_dist = Point_Distance[index];
+                points_near.resize(k_found);
+                points_dist.resize(k_found);
+                for (int j = k_found - 1; j >= 0; j--)
+                {
+                    points_near[j] = q.top().point;
+                    points_dist[j] = q.top().dist;
+                    q.pop();
+                }
+            }
+            if (root_rebuilding)
+            {
+                pthread_mutex_lock(&search_flag_mutex);
+                search_mutex_counter -= 1;
+                pthread_mutex_unlock(&search_flag_mutex);
+            }
+        }
+    }
+    return;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
 {
@@ -536,11 +648,9 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
                     tmp_counter++;
                     if (rebuild_flag)
                     {
-                        pthread_mutex_lock(&rebuild_logger_mutex_lock);
                         if (Downsample_Storage.size() > 0)
                             Rebuild_Logger.push(operation_delete);
                         Rebuild_Logger.push(operation);
-                        pthread_mutex_unlock(&rebuild_logger_mutex_lock);
                     }
                     pthread_mutex_unlock(&working_flag_mutex);
                 };
@@ -561,9 +671,7 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
                 Add_by_point(&Root_Node, PointToAdd[i], false, Root_Node->division_axis);
                 if (rebuild_flag)
                 {
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
                     Rebuild_Logger.push(operation);
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
                 }
                 pthread_mutex_unlock(&working_flag_mutex);
             }
@@ -590,9 +698,7 @@ void KD_TREE<PointType>::Add_Point_Boxes(vector<BoxPointType> &BoxPoints)
             Add_by_range(&Root_Node, BoxPoints[i], false);
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -618,9 +724,7 @@ void KD_TREE<PointType>::Delete_Points(PointVector &PointToDel)
             Delete_by_point(&Root_Node, PointToDel[i], false);
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -647,9 +751,7 @@ int KD_TREE<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints)
             tmp_counter += Delete_by_range(&Root_Node, BoxPoints[i], false, false);
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -680,7 +782,19 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVecto
 {
     if (l > r)
         return;
-    *root = new KD_TREE_NODE;
+    // Take all nodes of the subtree at once so they are laid out in pre-order
+    vector<KD_TREE_NODE *> nodes;
+    Node_Pool.alloc_batch(r - l + 1, nodes);
+    KD_TREE_NODE **node_cursor = nodes.data();
+    BuildTree(root, l, r, Storage, node_cursor);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, KD_TREE_NODE **&node_cursor)
+{
+    if (l > r)
+        return;
+    *root = *(node_cursor++);
     InitTreeNode(*root);
     int mid = (l + r) >> 1;
     int div_axis = 0;
@@ -724,8 +838,8 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVecto
     }
     (*root)->point = Storage[mid];
     KD_TREE_NODE *left_son = nullptr, *right_son = nullptr;
-    BuildTree(&left_son, l, mid - 1, Storage);
-    BuildTree(&right_son, mid + 1, r, Storage);
+    BuildTree(&left_son, l, mid - 1, Storage, node_cursor);
+    BuildTree(&right_son, mid + 1, r, Storage, node_cursor);
     (*root)->left_son_ptr = left_son;
     (*root)->right_son_ptr = right_son;
     Update((*root));
@@ -817,9 +931,7 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoi
         tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, false, is_downsample);
         if (rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
             Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
@@ -833,9 +945,7 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoi
         tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
         if (rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
             Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
@@ -881,9 +991,7 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, PointType point, b
             Delete_by_point(&(*root)->left_son_ptr, point, false);
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(delete_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -900,9 +1008,7 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, PointType point, b
             Delete_by_point(&(*root)->right_son_ptr, point, false);
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(delete_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -958,9 +1064,7 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint
         Add_by_range(&((*root)->left_son_ptr), boxpoint, false);
         if (rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
             Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
@@ -974,9 +1078,7 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint
         Add_by_range(&((*root)->right_son_ptr), boxpoint, false);
         if (rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
             Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
@@ -996,8 +1098,7 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
 {
     if (*root == nullptr)
     {
-        *root = new KD_TREE_NODE;
-        InitTreeNode(*root);
+        *root = new_tree_node();
         (*root)->point = point;
         (*root)->division_axis = (father_axis + 1) % 3;
         Update(*root);
@@ -1021,9 +1122,7 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
             Add_by_point(&(*root)->left_son_ptr, point, false, (*root)->division_axis);
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(add_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -1040,9 +1139,7 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
             Add_by_point(&(*root)->right_son_ptr, point, false, (*root)->division_axis);
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(add_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -1067,20 +1164,14 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE *root, int k_nearest, PointType poi
     float max_dist_sqr = max_dist * max_dist;
     if (cur_dist > max_dist_sqr)
         return;
-    int retval;
     if (root->need_push_down_to_left || root->need_push_down_to_right)
     {
-        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
-        if (retval == 0)
-        {
+        // Locks are striped across nodes, so the holder may be working on another node: re-check under the lock
+        pthread_mutex_t *lock = push_down_lock(root);
+        pthread_mutex_lock(lock);
+        if (root->need_push_down_to_left || root->need_push_down_to_right)
             Push_Down(root);
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-        else
-        {
-            pthread_mutex_lock(&(root->push_down_mutex_lock));
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
+        pthread_mutex_unlock(lock);
     }
     if (!root->point_deleted)
     {
@@ -1400,9 +1491,7 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
             root->left_son_ptr->need_push_down_to_right = true;
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             root->need_push_down_to_left = false;
             pthread_mutex_unlock(&working_flag_mutex);
@@ -1443,9 +1532,7 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
             root->right_son_ptr->need_push_down_to_right = true;
             if (rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
             root->need_push_down_to_right = false;
             pthread_mutex_unlock(&working_flag_mutex);
@@ -1666,8 +1753,7 @@ void KD_TREE<PointType>::delete_tree_nodes(KD_TREE_NODE **root)
     delete_tree_nodes(&(*root)->left_son_ptr);
     delete_tree_nodes(&(*root)->right_son_ptr);
 
-    pthread_mutex_destroy(&(*root)->push_down_mutex_lock);
-    delete *root;
+    Node_Pool.free(*root);
     *root = nullptr;
 
     return;
@@ -1687,6 +1773,27 @@ float KD_TREE<PointType>::calc_dist(PointType a, PointType b)
     return dist;
 }
 
+template <typename PointType>
+uint32_t KD_TREE<PointType>::calc_morton_code(const PointType &point, const float min_corner[3], const float inv_cell[3])
+{
+    uint32_t code = 0;
+    uint32_t cell[3];
+    cell[0] = uint32_t((point.x - min_corner[0]) * inv_cell[0]);
+    cell[1] = uint32_t((point.y - min_corner[1]) * inv_cell[1]);
+    cell[2] = uint32_t((point.z - min_corner[2]) * inv_cell[2]);
+    for (int j = 0; j < 3; j++)
+    {
+        // Spread the 10 cell bits so that two zero bits separate each of them
+        uint32_t v = cell[j] & 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        code |= v << j;
+    }
+    return code;
+}
+
 template <typename PointType>
 float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE *node, PointType point)
 {
@@ -7,15 +7,23 @@
 #include <unistd.h>
 #include <math.h>
 #include <algorithm>
+#include <atomic>
 #include <memory.h>
+#include <stdint.h>
 #include <pcl/point_types.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define EPSS 1e-6
 #define Minimal_Unbalanced_Tree_Size 10
 #define Multi_Thread_Rebuild_Point_Num 1500
 #define DOWNSAMPLE_SWITCH true
 #define ForceRebuildPercentage 0.2
-#define Q_LEN 1000000
+#define Q_CHUNK_LEN 4096
+#define Node_Pool_Chunk_Size 4096
+#define Push_Down_Lock_Num 64
+#define Batch_Search_Chunk 64
 
 using namespace std;
 
@@ -70,7 +78,6 @@ public:
         bool need_push_down_to_left = false;
         bool need_push_down_to_right = false;
         bool working_flag = false;
-        pthread_mutex_t push_down_mutex_lock;
         float node_range_x[2], node_range_y[2], node_range_z[2];
         float radius_sq;
         KD_TREE_NODE *left_son_ptr = nullptr;
@@ -200,57 +207,207 @@ public:
         int cap = 0;
     };
 
+    class MANUAL_POOL
+    {
+        // Slab allocator for tree nodes: nodes are carved out of contiguous chunks
+        // and recycled through an intrusive freelist (linked by left_son_ptr).
+    public:
+        MANUAL_POOL()
+        {
+            pthread_mutex_init(&pool_mutex_lock, NULL);
+        }
+        ~MANUAL_POOL()
+        {
+            for (int i = 0; i < chunks.size(); i++)
+                delete[] chunks[i];
+            chunks.clear();
+            pthread_mutex_destroy(&pool_mutex_lock);
+        }
+        KD_TREE_NODE *alloc()
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            if (free_list == nullptr)
+                grow();
+            KD_TREE_NODE *node = free_list;
+            free_list = node->left_son_ptr;
+            used_num++;
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return node;
+        }
+        void alloc_batch(int n, vector<KD_TREE_NODE *> &nodes)
+        {
+            nodes.resize(n);
+            pthread_mutex_lock(&pool_mutex_lock);
+            for (int i = 0; i < n; i++)
+            {
+                if (free_list == nullptr)
+                    grow();
+                nodes[i] = free_list;
+                free_list = free_list->left_son_ptr;
+            }
+            used_num += n;
+            pthread_mutex_unlock(&pool_mutex_lock);
+            // Recycled nodes come back in arbitrary order, hand them out by address to keep subtrees contiguous
+            sort(nodes.begin(), nodes.end());
+        }
+        void free(KD_TREE_NODE *node)
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            node->left_son_ptr = free_list;
+            free_list = node;
+            used_num--;
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+        int capacity()
+        {
+            return chunks.size() * Node_Pool_Chunk_Size;
+        }
+        int used()
+        {
+            return used_num;
+        }
+
+    private:
+        void grow()
+        {
+            KD_TREE_NODE *chunk = new KD_TREE_NODE[Node_Pool_Chunk_Size];
+            chunks.push_back(chunk);
+            // Thread the chunk back to front so that consecutive allocations are adjacent in memory
+            for (int i = Node_Pool_Chunk_Size - 1; i >= 0; i--)
+            {
+                chunk[i].left_son_ptr = free_list;
+                free_list = &chunk[i];
+            }
+        }
+        vector<KD_TREE_NODE *> chunks;
+        KD_TREE_NODE *free_list = nullptr;
+        int used_num = 0;
+        pthread_mutex_t pool_mutex_lock;
+    };
+
     class MANUAL_Q
     {
+        // Chunked queue of logged operations. It has no lock of its own: every push happens while the producer
+        // holds working_flag_mutex for the tree update it logs, and the rebuild thread, the only consumer, pops
+        // under the same mutex. The atomics only publish chunk hand-over and sizes to the lock-free readers
+        // (empty(), size(), stats). A drained chunk is kept as a spare, further chunks are allocated on demand.
     private:
-        int head = 0, tail = 0, counter = 0;
-        Operation_Logger_Type q[Q_LEN];
-        bool is_empty;
+        struct Q_CHUNK
+        {
+            Operation_Logger_Type q[Q_CHUNK_LEN];
+            atomic<Q_CHUNK *> next;
+        };
+        Q_CHUNK *head_chunk = nullptr, *tail_chunk = nullptr;
+        int head = 0, tail = 0;
+        atomic<int> counter;
+        atomic<Q_CHUNK *> spare_chunk;
+        atomic<int> high_water, chunk_num;
+
+        Q_CHUNK *new_chunk()
+        {
+            Q_CHUNK *chunk = spare_chunk.exchange(nullptr, memory_order_acquire);
+            if (chunk == nullptr)
+            {
+                chunk = new Q_CHUNK;
+                chunk_num++;
+            }
+            chunk->next.store(nullptr, memory_order_relaxed);
+            return chunk;
+        }
+        void settle_head()
+        {
+            if (head < Q_CHUNK_LEN)
+                return;
+            Q_CHUNK *drained = head_chunk;
+            head_chunk = drained->next.load(memory_order_acquire);
+            head = 0;
+            Q_CHUNK *expected = nullptr;
+            if (!spare_chunk.compare_exchange_strong(expected, drained, memory_order_release))
+            {
+                delete drained;
+                chunk_num--;
+            }
+        }
+        void release()
+        {
+            while (head_chunk != nullptr)
+            {
+                Q_CHUNK *next = head_chunk->next.load(memory_order_relaxed);
+                delete head_chunk;
+                head_chunk = next;
+            }
+            delete spare_chunk.exchange(nullptr);
+            tail_chunk = nullptr;
+            chunk_num.store(0);
+        }
 
     public:
+        MANUAL_Q()
+        {
+            counter.store(0);
+            high_water.store(0);
+            chunk_num.store(0);
+            spare_chunk.store(nullptr);
+            clear();
+        }
+        ~MANUAL_Q()
+        {
+            release();
+        }
         void pop()
         {
-            if (counter == 0)
+            if (counter.load(memory_order_acquire) == 0)
                 return;
+            settle_head();
             head++;
-            head %= Q_LEN;
-            counter--;
-            if (counter == 0)
-                is_empty = true;
+            counter.fetch_sub(1, memory_order_release);
             return;
         }
         Operation_Logger_Type front()
         {
-            return q[head];
-        }
-        Operation_Logger_Type back()
-        {
-            return q[tail];
+            settle_head();
+            return head_chunk->q[head];
         }
         void clear()
         {
+            // Only called while no rebuild is running
+            release();
+            head_chunk = tail_chunk = new_chunk();
             head = 0;
             tail = 0;
-            counter = 0;
-            is_empty = true;
+            counter.store(0);
+            high_water.store(0);
             return;
         }
         void push(Operation_Logger_Type op)
         {
-            q[tail] = op;
-            counter++;
-            if (is_empty)
-                is_empty = false;
-            tail++;
-            tail %= Q_LEN;
+            if (tail == Q_CHUNK_LEN)
+            {
+                Q_CHUNK *chunk = new_chunk();
+                tail_chunk->next.store(chunk, memory_order_release);
+                tail_chunk = chunk;
+                tail = 0;
+            }
+            tail_chunk->q[tail++] = op;
+            int num = counter.fetch_add(1, memory_order_release) + 1;
+            if (num > high_water.load(memory_order_relaxed))
+                high_water.store(num, memory_order_relaxed);
         }
         bool empty()
         {
-            return is_empty;
+            return counter.load(memory_order_acquire) == 0;
         }
         int size()
         {
-            return counter;
+            return counter.load(memory_order_acquire);
+        }
+        int max_size()
+        {
+            return high_water.load(memory_order_relaxed);
+        }
+        int chunk_count()
+        {
+            return chunk_num.load(memory_order_relaxed);
         }
     };
 
@@ -260,7 +417,8 @@ private:
     bool rebuild_flag = false;
     pthread_t rebuild_thread;
     pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
-    pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
+    pthread_mutex_t points_deleted_rebuild_mutex_lock;
+    pthread_mutex_t push_down_mutex_lock[Push_Down_Lock_Num];
     // queue<Operation_Logger_Type> Rebuild_Logger;
     MANUAL_Q Rebuild_Logger;
     PointVector Rebuild_PCL_Storage;
@@ -279,12 +437,16 @@ private:
     float downsample_size = 0.2f;
     bool Delete_Storage_Disabled = false;
     KD_TREE_NODE *STATIC_ROOT_NODE = nullptr;
+    MANUAL_POOL Node_Pool;
     PointVector Points_deleted;
     PointVector Downsample_Storage;
     PointVector Multithread_Points_deleted;
     void InitTreeNode(KD_TREE_NODE *root);
+    KD_TREE_NODE *new_tree_node();
+    pthread_mutex_t *push_down_lock(KD_TREE_NODE *root);
     void Test_Lock_States(KD_TREE_NODE *root);
     void BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage);
+    void BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, KD_TREE_NODE **&node_cursor);
     void Rebuild(KD_TREE_NODE **root);
     int Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample);
     void Delete_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild);
@@ -301,6 +463,7 @@ private:
     bool same_point(PointType a, PointType b);
     float calc_dist(PointType a, PointType b);
     float calc_box_dist(KD_TREE_NODE *node, PointType point);
+    uint32_t calc_morton_code(const PointType &point, const float min_corner[3], const float inv_cell[3]);
     static bool point_cmp_x(PointType a, PointType b);
     static bool point_cmp_y(PointType a, PointType b);
     static bool point_cmp_z(PointType a, PointType b);
@@ -323,9 +486,12 @@ public:
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2);
     int size();
     int validnum();
+    void node_pool_stats(int &allocated, int &in_use);
+    void rebuild_logger_stats(int &high_water, int &chunks);
     void root_alpha(float &alpha_bal, float &alpha_del);
     void Build(PointVector point_cloud);
     void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY);
+    void Nearest_Search_Batch(const PointVector &Query_Points, int k_nearest, vector<PointVector> &Nearest_Points, vector<vector<float>> &Point_Distance, float max_dist = INFINITY, int num_threads = 1);
     void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
     void Radius_Search(PointType point, const float radius, PointVector &Storage);
     int Add_Points(PointVector &PointToAdd, bool downsample_on);
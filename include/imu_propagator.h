@@ -0,0 +1,96 @@
+#ifndef IMU_PROPAGATOR_H
+#define IMU_PROPAGATOR_H
+
+#include <deque>
+#include <mutex>
+#include <so3_math.h>
+#include <common_lib.h>
+#include <use-ikfom.hpp>
+#include <trajectory_buffer.h>
+
+/*
+ * Dead reckoning from the latest posterior, one step per IMU sample as it arrives. The filter
+ * only propagates when a scan is processed; this gives the pose at the newest IMU stamp
+ * instead. A new posterior re-integrates the retained samples newer than its time, so the
+ * output never lags behind the filter. Same midpoint integration as the IMU propagation of
+ * the filter, without covariance.
+ */
+class ImuPropagator
+{
+  public:
+  explicit ImuPropagator(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {}
+
+  /* restarts the integration from the posterior s at time, called after every update */
+  void reset(const state_ikfom &s, double time, double acc_scale)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    rot = s.rot;
+    pos = s.pos;
+    vel = s.vel;
+    bg = s.bg;
+    ba = s.ba;
+    grav = s.grav.get_vect();
+    scale = acc_scale;
+    last_time = time;
+    inited = true;
+    while (samples.size() > 1 && samples[1].time <= time) samples.pop_front();
+    has_head = !samples.empty() && samples.front().time <= time;
+    if (has_head) head = samples.front();
+    for (const ImuSample &sample : samples)
+      if (sample.time > time) integrate(sample);
+  }
+
+  /* drops the retained samples and the posterior, e.g. after the IMU stamps jumped back */
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    samples.clear();
+    has_head = false;
+    inited = false;
+  }
+
+  /* integrates one sample, out is the state at its stamp; false before the first posterior */
+  bool add(const ImuSample &sample, TrajectoryPoint &out)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!samples.empty() && sample.time <= samples.back().time) return false;
+    samples.push_back(sample);
+    if (samples.size() > capacity) samples.pop_front();
+    if (!inited || sample.time <= last_time) return false;
+    integrate(sample);
+    out.time = last_time;
+    out.rot = rot;
+    out.pos = pos;
+    out.vel = vel;
+    out.gyr = angvel;
+    return true;
+  }
+
+  private:
+  void integrate(const ImuSample &tail)
+  {
+    if (!has_head) head = tail;
+    const double dt = tail.time - last_time;
+    const V3D acc = 0.5 * (head.acc + tail.acc) * scale - ba;
+    angvel = 0.5 * (head.gyr + tail.gyr) - bg;
+    pos += vel * dt;
+    vel += (rot * acc + grav) * dt;
+    rot = (rot * Eigen::Quaterniond(Exp(angvel, dt))).normalized();
+    head = tail;
+    has_head = true;
+    last_time = tail.time;
+  }
+
+  std::mutex mtx;
+  std::deque<ImuSample> samples;   // newest last, the first one may be older than the posterior
+  size_t capacity;
+  bool   inited = false;
+  bool   has_head = false;
+  ImuSample head;                  // previous sample of the integration
+  double last_time = 0.0;
+  double scale = 1.0;
+  Eigen::Quaterniond rot = Eigen::Quaterniond::Identity();
+  V3D pos = Zero3d, vel = Zero3d, bg = Zero3d, ba = Zero3d, grav = Zero3d, angvel = Zero3d;
+};
+
+#endif
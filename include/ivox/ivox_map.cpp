@@ -0,0 +1,255 @@
+#include "ivox_map.h"
+
+template <typename PointType>
+IVOX_MAP<PointType>::IVOX_MAP(float voxel_size, int nearby_type, int voxel_capacity)
+{
+    set_param(voxel_size, nearby_type, voxel_capacity, max_points_per_voxel);
+}
+
+template <typename PointType>
+IVOX_MAP<PointType>::~IVOX_MAP()
+{
+    voxel_map.clear();
+    voxel_list.clear();
+}
+
+template <typename PointType>
+void IVOX_MAP<PointType>::set_param(float voxel_size, int nearby_type, int voxel_capacity, int max_voxel_points)
+{
+    resolution = voxel_size;
+    inv_resolution = 1.0f / voxel_size;
+    capacity = voxel_capacity;
+    max_points_per_voxel = max_voxel_points;
+    nearby_offsets.clear();
+    nearby_offsets.push_back({0, 0, 0});
+    for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dz = -1; dz <= 1; dz++)
+            {
+                int manhattan = abs(dx) + abs(dy) + abs(dz);
+                if (manhattan == 0)
+                    continue;
+                // 6: face neighbours, 18: plus edge neighbours, 26: plus corner neighbours
+                if ((nearby_type >= NEARBY6 && manhattan == 1) || (nearby_type >= NEARBY18 && manhattan == 2) || (nearby_type >= NEARBY26 && manhattan == 3))
+                    nearby_offsets.push_back({dx, dy, dz});
+            }
+    evict_voxels();
+}
+
+template <typename PointType>
+void IVOX_MAP<PointType>::set_downsample_param(float box_length)
+{
+    downsample_size = box_length;
+}
+
+template <typename PointType>
+void IVOX_MAP<PointType>::Build(const PointVector &point_cloud)
+{
+    voxel_map.clear();
+    voxel_list.clear();
+    point_num = 0;
+    evicted_point_num = 0;
+    Add_Points(point_cloud, true);
+}
+
+template <typename PointType>
+void IVOX_MAP<PointType>::Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+{
+    PointType k_points[IVOX_MAX_K];
+    float k_dists[IVOX_MAX_K];
+    int k_found = Search(point, k_nearest, k_points, k_dists, max_dist * max_dist);
+    Nearest_Points.assign(k_points, k_points + k_found);
+    Point_Distance.assign(k_dists, k_dists + k_found);
+}
+
+template <typename PointType>
+void IVOX_MAP<PointType>::Nearest_Search_Batch(const PointVector &Query_Points, int k_nearest, vector<PointVector> &Nearest_Points, vector<vector<float>> &Point_Distance, float max_dist, int num_threads)
+{
+    int query_num = Query_Points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    if (num_threads < 1)
+        num_threads = 1;
+    float max_dist_sqr = max_dist * max_dist;
+    // Lookups only read the hash map, so queries can run in parallel as long as no points are added meanwhile
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 64)
+#endif
+    for (int i = 0; i < query_num; i++)
+    {
+        PointType k_points[IVOX_MAX_K];
+        float k_dists[IVOX_MAX_K];
+        int k_found = Search(Query_Points[i], k_nearest, k_points, k_dists, max_dist_sqr);
+        Nearest_Points[i].assign(k_points, k_points + k_found);
+        Point_Distance[i].assign(k_dists, k_dists + k_found);
+    }
+}
+
+template <typename PointType>
+int IVOX_MAP<PointType>::Search(const PointType &point, int k_nearest, PointType *k_points, float *k_dists, float max_dist_sqr)
+{
+    k_nearest = min(k_nearest, IVOX_MAX_K);
+    int k_found = 0;
+    VoxelKey center = point_to_key(point, inv_resolution);
+    for (int n = 0; n < nearby_offsets.size(); n++)
+    {
+        VoxelKey key = {center.x + nearby_offsets[n].x, center.y + nearby_offsets[n].y, center.z + nearby_offsets[n].z};
+        auto iter = voxel_map.find(key);
+        if (iter == voxel_map.end())
+            continue;
+        const PointVector &points = iter->second->points;
+        for (int i = 0; i < points.size(); i++)
+        {
+            float dist = calc_dist(point, points[i]);
+            if (dist > max_dist_sqr || (k_found == k_nearest && dist >= k_dists[k_found - 1]))
+                continue;
+            // Insertion into the sorted k-best list, k is small
+            int j = (k_found < k_nearest) ? k_found++ : k_found - 1;
+            while (j > 0 && k_dists[j - 1] > dist)
+            {
+                k_dists[j] = k_dists[j - 1];
+                k_points[j] = k_points[j - 1];
+                j--;
+            }
+            k_dists[j] = dist;
+            k_points[j] = points[i];
+        }
+    }
+    return k_found;
+}
+
+template <typename PointType>
+int IVOX_MAP<PointType>::Add_Points(const PointVector &PointToAdd, bool downsample_on)
+{
+    int added_num = 0;
+    float inv_downsample = 1.0f / downsample_size;
+    for (int i = 0; i < PointToAdd.size(); i++)
+    {
+        const PointType &point = PointToAdd[i];
+        VoxelKey key = point_to_key(point, inv_resolution);
+        auto iter = voxel_map.find(key);
+        if (iter == voxel_map.end())
+        {
+            voxel_list.push_front(Voxel());
+            voxel_list.front().key = key;
+            voxel_list.front().points.reserve(8);
+            iter = voxel_map.insert(make_pair(key, voxel_list.begin())).first;
+        }
+        else
+        {
+            // Most recently updated voxels live at the front of the list
+            voxel_list.splice(voxel_list.begin(), voxel_list, iter->second);
+        }
+        PointVector &points = iter->second->points;
+        if (downsample_on)
+        {
+            // Keep a single point per downsample box, the one closest to the box centre
+            VoxelKey box = point_to_key(point, inv_downsample);
+            PointType mid_point;
+            mid_point.x = (box.x + 0.5f) * downsample_size;
+            mid_point.y = (box.y + 0.5f) * downsample_size;
+            mid_point.z = (box.z + 0.5f) * downsample_size;
+            int same_box = -1;
+            for (int j = 0; j < points.size(); j++)
+            {
+                if (point_to_key(points[j], inv_downsample) == box)
+                {
+                    same_box = j;
+                    break;
+                }
+            }
+            if (same_box >= 0)
+            {
+                if (calc_dist(point, mid_point) < calc_dist(points[same_box], mid_point))
+                {
+                    points[same_box] = point;
+                    added_num++;
+                }
+                continue;
+            }
+        }
+        if (points.size() >= max_points_per_voxel)
+            continue;
+        points.push_back(point);
+        point_num++;
+        added_num++;
+    }
+    evict_voxels();
+    return added_num;
+}
+
+template <typename PointType>
+void IVOX_MAP<PointType>::evict_voxels()
+{
+    while (voxel_list.size() > capacity)
+    {
+        Voxel &voxel = voxel_list.back();
+        point_num -= voxel.points.size();
+        evicted_point_num += voxel.points.size();
+        voxel_map.erase(voxel.key);
+        voxel_list.pop_back();
+    }
+}
+
+template <typename PointType>
+void IVOX_MAP<PointType>::flatten(PointVector &Storage)
+{
+    Storage.clear();
+    Storage.reserve(point_num);
+    for (auto iter = voxel_list.begin(); iter != voxel_list.end(); iter++)
+        Storage.insert(Storage.end(), iter->points.begin(), iter->points.end());
+}
+
+template <typename PointType>
+int IVOX_MAP<PointType>::acquire_evicted_num()
+{
+    int num = evicted_point_num;
+    evicted_point_num = 0;
+    return num;
+}
+
+template <typename PointType>
+int IVOX_MAP<PointType>::size()
+{
+    return point_num;
+}
+
+template <typename PointType>
+int IVOX_MAP<PointType>::validnum()
+{
+    return point_num;
+}
+
+template <typename PointType>
+int IVOX_MAP<PointType>::voxel_num()
+{
+    return voxel_list.size();
+}
+
+template <typename PointType>
+bool IVOX_MAP<PointType>::empty()
+{
+    return point_num == 0;
+}
+
+template <typename PointType>
+VoxelKey IVOX_MAP<PointType>::point_to_key(const PointType &point, float inv_size)
+{
+    VoxelKey key;
+    key.x = int(floor(point.x * inv_size));
+    key.y = int(floor(point.y * inv_size));
+    key.z = int(floor(point.z * inv_size));
+    return key;
+}
+
+template <typename PointType>
+float IVOX_MAP<PointType>::calc_dist(const PointType &a, const PointType &b)
+{
+    float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// Manual Instatiations
+template class IVOX_MAP<pcl::PointXYZ>;
+template class IVOX_MAP<pcl::PointXYZI>;
+template class IVOX_MAP<pcl::PointXYZINormal>;
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdio.h>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <Eigen/Core>
+#include <pcl/point_types.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define IVOX_MAX_K 32
+
+using namespace std;
+
+enum ivox_nearby_type
+{
+    NEARBY_CENTER = 0,
+    NEARBY6 = 6,
+    NEARBY18 = 18,
+    NEARBY26 = 26
+};
+
+struct VoxelKey
+{
+    int x, y, z;
+    bool operator==(const VoxelKey &other) const
+    {
+        return x == other.x && y == other.y && z == other.z;
+    }
+};
+
+struct VoxelKeyHash
+{
+    size_t operator()(const VoxelKey &key) const
+    {
+        // unsigned arithmetic wraps, signed products overflow a few metres from the origin
+        return size_t((uint64_t(key.x) * 73856093u) ^ (uint64_t(key.y) * 471943u) ^ (uint64_t(key.z) * 83492791u));
+    }
+};
+
+// Voxel-hashed incremental map (iVox): points are bucketed into cubic voxels kept in a hash map,
+// the least recently updated voxels are evicted once the capacity is exceeded.
+template <typename PointType>
+class IVOX_MAP
+{
+public:
+    using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+
+private:
+    struct Voxel
+    {
+        VoxelKey key;
+        PointVector points;
+    };
+    using VoxelList = std::list<Voxel>;
+
+    float resolution = 0.5f;
+    float inv_resolution = 2.0f;
+    float downsample_size = 0.5f;
+    int capacity = 1000000;
+    int max_points_per_voxel = 50;
+    int point_num = 0;
+    int evicted_point_num = 0;
+    VoxelList voxel_list;
+    unordered_map<VoxelKey, typename VoxelList::iterator, VoxelKeyHash> voxel_map;
+    vector<VoxelKey> nearby_offsets;
+
+    VoxelKey point_to_key(const PointType &point, float inv_size);
+    float calc_dist(const PointType &a, const PointType &b);
+    void evict_voxels();
+    int Search(const PointType &point, int k_nearest, PointType *k_points, float *k_dists, float max_dist_sqr);
+
+public:
+    IVOX_MAP(float voxel_size = 0.5, int nearby_type = NEARBY18, int voxel_capacity = 1000000);
+    ~IVOX_MAP();
+    void set_param(float voxel_size, int nearby_type, int voxel_capacity, int max_voxel_points);
+    void set_downsample_param(float box_length);
+    void Build(const PointVector &point_cloud);
+    void Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY);
+    void Nearest_Search_Batch(const PointVector &Query_Points, int k_nearest, vector<PointVector> &Nearest_Points, vector<vector<float>> &Point_Distance, float max_dist = INFINITY, int num_threads = 1);
+    int Add_Points(const PointVector &PointToAdd, bool downsample_on);
+    void flatten(PointVector &Storage);
+    int acquire_evicted_num();
+    int size();
+    int validnum();
+    int voxel_num();
+    bool empty();
+};
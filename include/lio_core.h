@@ -0,0 +1,215 @@
+#ifndef LIO_CORE_H
+#define LIO_CORE_H
+
+#include <memory>
+#include <thread>
+#include <functional>
+#include <pcl/filters/voxel_grid.h>
+#include <common_lib.h>
+#include <use-ikfom.hpp>
+#include <ikd-Tree/ikd_Tree.h>
+#include <ivox/ivox_map.h>
+#include <bounded_queue.h>
+#include <point_transform.h>
+#include <trajectory_buffer.h>
+#include <map_file.h>
+
+#define INIT_TIME           (0.1)
+#define LASER_POINT_COV     (0.001)
+
+enum MAP_TYPE{IKDTREE = 1, IVOX}; //{1, 2}
+
+class ImuProcess;
+
+/* lidar -> world of state s, composed once per scan so batches run a single 3x4 kernel */
+inline PointTransform body_to_world_transform(const state_ikfom &s)
+{
+    M3D R_WI(s.rot.toRotationMatrix());
+    return PointTransform(R_WI * s.offset_R_L_I.toRotationMatrix(), R_WI * s.offset_T_L_I + s.pos);
+}
+
+inline PointTransform lidar_to_imu_transform(const state_ikfom &s)
+{
+    return PointTransform(s.offset_R_L_I.toRotationMatrix(), s.offset_T_L_I);
+}
+
+/* everything the estimator needs, filled by the ROS node from its parameters */
+struct LioParams
+{
+    int    max_iteration = 4;
+    double filter_size_surf = 0.5;
+    double filter_size_map = 0.5;
+    double cube_len = 200;
+    float  det_range = 300.0f;
+    double gyr_cov = 0.1, acc_cov = 0.1, b_gyr_cov = 0.0001, b_acc_cov = 0.0001;
+    int    lidar_type = AVIA;
+    bool   extrinsic_est_en = true;
+    bool   reduced_update_en = true;
+    bool   schur_update_en = false;
+    bool   parallel_undistort_en = true;
+    bool   map_points_en = false;   // flatten the map into every LioOutput, costly
+    int    match_thread_num = 0;    // <= 0: all cores
+    int    map_type = IKDTREE;
+    double ivox_resolution = 0.5;
+    int    ivox_nearby_type = NEARBY18, ivox_capacity = 1000000, ivox_max_points = 50;
+    int    trajectory_size = 4000;
+    V3D    extrinsic_T = Zero3d;
+    M3D    extrinsic_R = Eye3d;
+    bool   localization_only = false;   // the map is not updated, use with load_map()
+    V3D    init_pos = Zero3d;           // pose of the first IMU frame in the map frame
+    M3D    init_rot = Eye3d;
+    std::string map_save_path;          // non-empty: the map is kept for save_map()
+    float  map_chunk_size = 20.0f;      // edge of the chunks of the saved map, unit: m
+};
+
+enum LioStatus
+{
+    LIO_FIRST_SCAN,   // only used as time reference
+    LIO_NO_POINTS,    // scan skipped, nothing left after undistortion or downsampling
+    LIO_MAP_INIT,     // scan used to build the map
+    LIO_NO_MAP,       // localization only: the loaded map has no points in the local map, scan skipped
+    LIO_UPDATED       // state updated, the scan is queued for the map
+};
+
+/* timings of the registration of one scan */
+struct LioStats
+{
+    double preprocess_time = 0;   // IMU propagation + undistortion + downsampling + map segmentation
+    double match_time = 0;
+    double solve_time = 0;        // construction of H
+    double solve_H_time = 0;      // gain and state update
+    double update_time = 0;       // whole iterated update
+    double icp_time = 0;          // from the segmented map to the queued map update
+    double map_incre_time_last = 0;
+    double total_time = 0;
+    double kdtree_search_time = 0;
+    int    kdtree_delete_counter = 0;
+    double kdtree_delete_time = 0;
+    int    map_size_st = 0;
+    int    effective_points = 0;
+    double res_mean = 0;
+};
+
+/* what the map update stage did with one scan, reported from its own thread */
+struct MapUpdateStats
+{
+    double incremental_time = 0;
+    int    map_size = 0;
+    int    add_point_size = 0;
+    int    evicted_num = 0;
+};
+
+struct LioOutput
+{
+    LioStatus           status;
+    double              lidar_end_time;
+    state_ikfom         prior;             // after IMU propagation
+    state_ikfom         state;             // after the update
+    PointCloudXYZI::Ptr feats_undistort;
+    PointCloudXYZI::Ptr feats_down_body;
+    PointCloudXYZI::Ptr map_points;        // only with map_points_en
+    LioStats            stats;
+};
+
+/*
+ * The LIO pipeline without any ROS dependency: IMU propagation and undistortion, downsampling,
+ * registration against the local map with the iterated ESEKF, and the map update, which runs on
+ * an internal thread and overlaps with the caller's next scan. Input is one synced lidar + IMU
+ * package at a time, all output is plain PCL/Eigen data.
+ */
+class LioCore
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    explicit LioCore(const LioParams &params);
+    ~LioCore();
+
+    /* registers one package; tag is passed back to the map update callback of this scan */
+    LioStatus process(const MeasureGroup &meas, LioOutput &out, int tag = -1);
+
+    /* finishes the pending map update and stops the map thread, process() must not be called afterwards */
+    void stop();
+
+    /*
+     * Uses a saved map, ikd-Tree only, call before the first scan. Only the chunks around the
+     * local map are read, and read again when it moves.
+     */
+    bool load_map(const std::string &path);
+
+    /* writes the map to params.map_save_path, after stop() */
+    bool save_map();
+
+    void set_map_update_callback(std::function<void(int, const MapUpdateStats &)> cbk) { map_update_cbk = cbk; }
+    const esekfom::esekf<state_ikfom, 12, input_ikfom>::cov &covariance() const { return kf.get_P(); }
+    std::shared_ptr<TrajectoryBuffer> trajectory() const { return trajectory_buffer; }
+    double first_lidar_time() const { return first_lidar_time_; }
+    /* factor from the raw accelerometer readings to m/s^2, known once the first scan is processed */
+    double acc_scale() const;
+
+  private:
+    struct MapUpdateTask
+    {
+        PointCloudXYZI::Ptr  feats_down_body;
+        PointCloudXYZI::Ptr  feats_down_world;
+        vector<PointVector>  nearest_points;
+        state_ikfom          state;
+        bool                 ekf_inited;
+        int                  tag;
+    };
+
+    void h_share_model(state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data);
+    void calc_h_row(const state_ikfom &s, int i, Matrix<double, 1, 12> &h_row, double &h_i) const;
+    void lasermap_fov_segment(LioStats &stats);
+    void load_map_chunks();
+    void map_incremental(MapUpdateTask &task);
+    void map_update_loop();
+
+    LioParams params;
+    esekfom::esekf<state_ikfom, 12, input_ikfom> kf;
+    state_ikfom state_point;
+    vect3 pos_lid;
+    std::shared_ptr<ImuProcess> p_imu;
+    std::shared_ptr<TrajectoryBuffer> trajectory_buffer;
+    std::function<void(int, const MapUpdateStats &)> map_update_cbk;
+
+    KD_TREE<PointType> ikdtree;
+    IVOX_MAP<PointType> ivox;
+    pcl::VoxelGrid<PointType> downSizeFilterSurf;
+    BoxPointType LocalMap_Points;
+    bool Localmap_Initialized = false;
+    vector<BoxPointType> cub_needrm;
+
+    /*** saved map: chunks read into the local map, points leaving the local map ***/
+    std::unique_ptr<MapFile> prior_map;
+    vector<bool> chunk_loaded;          // every point of the chunk is in the local map
+    std::unique_ptr<MapFileWriter> map_writer;
+
+    bool   flg_first_scan = true;
+    double first_lidar_time_ = 0.0;
+
+    /*** registration buffers, sized for the largest scan once ***/
+    PointCloudXYZI::Ptr feats_undistort;
+    PointCloudXYZI::Ptr feats_down_body;
+    PointCloudXYZI::Ptr feats_down_world;
+    PointCloudXYZI::Ptr normvec;
+    PointCloudXYZI::Ptr laserCloudOri;
+    PointCloudXYZI::Ptr corr_normvect;
+    int feats_down_size = 0;
+    int effct_feat_num = 0;
+    double res_mean_last = 0.05;
+    double match_time = 0, solve_time = 0;
+    vector<float> res_last;
+    std::unique_ptr<bool[]> point_selected_surf;
+    std::unique_ptr<bool[]> plane_valid;
+    vector<VF(4), Eigen::aligned_allocator<VF(4)>> plane_coeffs;
+    vector<PointVector>   Nearest_Points;
+    vector<vector<float>> Nearest_Dists;
+
+    /*** map update stage ***/
+    BoundedQueue<MapUpdateTask> map_update_queue;
+    std::thread map_update_thread;
+    double kdtree_incremental_time = 0.0;
+};
+
+#endif
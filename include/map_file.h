@@ -0,0 +1,107 @@
+#ifndef MAP_FILE_H
+#define MAP_FILE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <common_lib.h>
+#include <ikd-Tree/ikd_Tree.h>
+
+/*
+ * Point map on disk, laid out to be memory mapped:
+ *   MapFileHeader | MapChunk[chunk_num] | padding to a page | MapPoint[point_num]
+ * The points are grouped by chunk, a cube of chunk_size on a grid anchored at the origin,
+ * and thinned to one point per downsample_size voxel, the grid of the ikd-Tree downsampling.
+ * Fields are stored in the byte order of the machine that wrote the file.
+ */
+const char     MAP_FILE_MAGIC[8] = {'F', 'L', 'I', 'O', 'M', 'A', 'P', '\0'};
+const uint32_t MAP_FILE_VERSION = 1;
+
+struct MapFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t chunk_num;
+    uint64_t point_num;
+    float    downsample_size;   // unit: m
+    float    chunk_size;        // unit: m
+    float    bounds_min[3];     // of all points
+    float    bounds_max[3];
+    uint8_t  reserved[16];
+};
+
+struct MapChunk
+{
+    float    vertex_min[3];     // of the points in the chunk
+    float    vertex_max[3];
+    uint64_t offset;            // of the first point, from the start of the file, unit: byte
+    uint64_t count;
+};
+
+struct MapPoint
+{
+    float x, y, z, intensity;
+};
+
+/* read-only view of a map file, the pages of a chunk are only resident while it is read */
+class MapFile
+{
+  public:
+    MapFile() = default;
+    ~MapFile();
+    MapFile(const MapFile &) = delete;
+    MapFile &operator=(const MapFile &) = delete;
+
+    bool open(const std::string &path);
+
+    const MapFileHeader &header() const { return *header_; }
+    int chunk_num() const { return header_->chunk_num; }
+    const MapChunk &chunk(int i) const { return chunks_[i]; }
+
+    /* appends the points of chunk i that lie in box */
+    void read_chunk(int i, const BoxPointType &box, PointVector &out) const;
+
+  private:
+    uint8_t *data = nullptr;
+    size_t   size = 0;
+    const MapFileHeader *header_ = nullptr;
+    const MapChunk      *chunks_ = nullptr;
+};
+
+/*
+ * Builds a map file from points streamed in while mapping. append() only writes to a spill
+ * file next to the map; finish() sorts the spilled points into chunks and thins every chunk
+ * to the voxel grid, one chunk in memory at a time.
+ */
+class MapFileWriter
+{
+  public:
+    MapFileWriter(const std::string &path, float chunk_size);
+    ~MapFileWriter();
+
+    void append(const PointVector &points);
+    bool finish(float downsample_size);
+
+  private:
+    std::string path;
+    std::string spill_path;
+    float chunk_size;
+    FILE *spill = nullptr;
+    uint64_t spill_num = 0;
+};
+
+inline bool box_intersects(const float min_a[3], const float max_a[3], const BoxPointType &b)
+{
+    for (int i = 0; i < 3; i++)
+        if (max_a[i] < b.vertex_min[i] || min_a[i] > b.vertex_max[i]) return false;
+    return true;
+}
+
+inline bool box_contains(const BoxPointType &b, const float min_a[3], const float max_a[3])
+{
+    for (int i = 0; i < 3; i++)
+        if (min_a[i] < b.vertex_min[i] || max_a[i] > b.vertex_max[i]) return false;
+    return true;
+}
+
+#endif
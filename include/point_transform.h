@@ -0,0 +1,96 @@
+#ifndef POINT_TRANSFORM_H
+#define POINT_TRANSFORM_H
+
+#include <Eigen/Core>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Rigid transform p' = R * p + t, composed once in double and stored as four float
+ * columns (R.col(0), R.col(1), R.col(2), t) so that each column fills one SSE register.
+ */
+struct EIGEN_ALIGN16 PointTransform
+{
+    float col[4][4];
+
+    PointTransform()
+    {
+        set(Eigen::Matrix3d::Identity(), Eigen::Vector3d::Zero());
+    }
+
+    PointTransform(const Eigen::Matrix3d &R, const Eigen::Vector3d &t)
+    {
+        set(R, t);
+    }
+
+    void set(const Eigen::Matrix3d &R, const Eigen::Vector3d &t)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            for (int i = 0; i < 3; i++) col[j][i] = float(R(i, j));
+            col[j][3] = 0.0f;
+        }
+        for (int i = 0; i < 3; i++) col[3][i] = float(t(i));
+        col[3][3] = 1.0f;
+    }
+
+};
+
+/*
+ * Transforms n points of any PCL type with a padded xyz (PCL_ADD_POINT4D). All other
+ * fields (intensity, normal, curvature, ...) are copied unchanged; in and out may alias.
+ */
+template <typename PointT>
+inline void transform_points(const PointTransform &T, const PointT *in, PointT *out, int n)
+{
+    int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256 c0 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(T.col[0]));
+    const __m256 c1 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(T.col[1]));
+    const __m256 c2 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(T.col[2]));
+    const __m256 c3 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(T.col[3]));
+    for (; i + 1 < n; i += 2)
+    {
+        // two points per iteration, one per 128-bit lane
+        __m256 p = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(in[i].data)), _mm_load_ps(in[i + 1].data), 1);
+        __m256 r = _mm256_fmadd_ps(c0, _mm256_permute_ps(p, 0x00), c3);
+        r = _mm256_fmadd_ps(c1, _mm256_permute_ps(p, 0x55), r);
+        r = _mm256_fmadd_ps(c2, _mm256_permute_ps(p, 0xAA), r);
+        if (in != out)
+        {
+            out[i] = in[i];
+            out[i + 1] = in[i + 1];
+        }
+        _mm_store_ps(out[i].data, _mm256_castps256_ps128(r));
+        _mm_store_ps(out[i + 1].data, _mm256_extractf128_ps(r, 1));
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128 s0 = _mm_load_ps(T.col[0]);
+    const __m128 s1 = _mm_load_ps(T.col[1]);
+    const __m128 s2 = _mm_load_ps(T.col[2]);
+    const __m128 s3 = _mm_load_ps(T.col[3]);
+    for (; i < n; i++)
+    {
+        __m128 p = _mm_load_ps(in[i].data);
+        __m128 r = _mm_add_ps(_mm_mul_ps(s0, _mm_shuffle_ps(p, p, 0x00)), s3);
+        r = _mm_add_ps(_mm_mul_ps(s1, _mm_shuffle_ps(p, p, 0x55)), r);
+        r = _mm_add_ps(_mm_mul_ps(s2, _mm_shuffle_ps(p, p, 0xAA)), r);
+        if (in != out) out[i] = in[i];
+        _mm_store_ps(out[i].data, r);
+    }
+#else
+    for (; i < n; i++)
+    {
+        float x = in[i].x, y = in[i].y, z = in[i].z;
+        if (in != out) out[i] = in[i];
+        out[i].x = T.col[0][0] * x + T.col[1][0] * y + T.col[2][0] * z + T.col[3][0];
+        out[i].y = T.col[0][1] * x + T.col[1][1] * y + T.col[2][1] * z + T.col[3][1];
+        out[i].z = T.col[0][2] * x + T.col[1][2] * y + T.col[2][2] * z + T.col[3][2];
+        out[i].data[3] = 1.0f;
+    }
+#endif
+}
+
+#endif
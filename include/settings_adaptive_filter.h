@@ -41,6 +41,7 @@
 #include <array>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <time.h>
 #include <stdint.h>
 
@@ -0,0 +1,98 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+/*
+ * Lock-free ring between exactly one producer thread and one consumer thread. push() fails
+ * when the ring is full instead of waiting. The producer can reset() the queue: items pushed
+ * before the reset are skipped by the consumer, so neither side ever takes a lock.
+ */
+template <typename T>
+class SpscQueue
+{
+  public:
+  explicit SpscQueue(size_t capacity) : slots(round_up(capacity)), mask(slots.size() - 1) {}
+
+  /* producer side */
+  bool push(T item)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head_cache == slots.size())
+    {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache == slots.size()) return false;
+    }
+    Slot &slot = slots[t & mask];
+    slot.item = std::move(item);
+    slot.epoch = epoch.load(std::memory_order_relaxed);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  void reset()
+  {
+    epoch.fetch_add(1, std::memory_order_release);
+  }
+
+  /* consumer side: oldest item still valid, nullptr when there is none */
+  T *front()
+  {
+    const unsigned cur = epoch.load(std::memory_order_acquire);
+    size_t h = head.load(std::memory_order_relaxed);
+    const size_t t = tail.load(std::memory_order_acquire);
+    while (h != t && int(slots[h & mask].epoch - cur) < 0)
+    {
+      slots[h & mask].item = T();
+      h ++;
+    }
+    head.store(h, std::memory_order_release);
+    return h == t ? nullptr : &slots[h & mask].item;
+  }
+
+  /* drops the item returned by front() */
+  void pop()
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    slots[h & mask].item = T();
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  /* exact for the consumer (up to reset items), a hint for any other thread */
+  bool empty() const
+  {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  /* items not yet popped, including reset ones until the consumer skips them; a hint like empty() */
+  size_t size() const
+  {
+    const size_t h = head.load(std::memory_order_acquire);
+    return tail.load(std::memory_order_acquire) - h;
+  }
+
+  private:
+  struct Slot
+  {
+    T item;
+    unsigned epoch = 0;
+  };
+
+  static size_t round_up(size_t n)
+  {
+    size_t size = 2;
+    while (size < n) size <<= 1;
+    return size;
+  }
+
+  std::vector<Slot> slots;
+  const size_t mask;
+  std::atomic<unsigned> epoch{0};
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+  size_t head_cache = 0;     // producer's last view of head
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*** pipeline stages with a latency histogram, in pipeline order ***/
+enum TelemetryStage
+{
+    TS_PREPROCESS,        // preprocessing worker, one scan
+    TS_UNDISTORT,         // IMU propagation and undistortion
+    TS_DOWNSAMPLE,
+    TS_MAP_WAIT,          // registration waiting for the previous map update
+    TS_MAP_SEGMENT,       // removal of the map outside the local cube
+    TS_MATCH,             // nearest search and plane fit, all iterations
+    TS_BUILD_H,
+    TS_SOLVE,
+    TS_UPDATE,            // whole iterated update
+    TS_REGISTRATION,      // LioCore::process of one scan
+    TS_MAP_INCREMENTAL,   // map update thread
+    TS_NUM
+};
+
+/*** last-value quantities reported with the latencies ***/
+enum TelemetryGauge
+{
+    TG_SCAN_POINTS,
+    TG_DOWNSAMPLED_POINTS,
+    TG_EFFECTIVE_POINTS,
+    TG_MAP_SIZE,
+    TG_DELETED_POINTS,
+    TG_NUM
+};
+
+struct StageSummary
+{
+    const char *name;
+    uint64_t    count;    // samples in the period
+    double      p50, p99, max, mean;   // unit: s
+};
+
+struct TelemetrySnapshot
+{
+    double               period;   // unit: s, since the previous snapshot
+    StageSummary         stages[TS_NUM];
+    const char          *gauge_names[TG_NUM];
+    double               gauges[TG_NUM];
+};
+
+/*
+ * Per-stage latency histograms for the whole process. Every thread records into its own
+ * slot with plain relaxed stores, so recording takes no lock and no shared cache line; a
+ * snapshot sums the slots and reports the samples since the previous snapshot. While
+ * disabled, record() is a single branch on a relaxed load.
+ */
+class Telemetry
+{
+  public:
+    static void enable(bool en) { enabled_.store(en, std::memory_order_relaxed); }
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    static void record(TelemetryStage stage, double seconds)
+    {
+        if (enabled()) record_ns(stage, seconds > 0.0 ? uint64_t(seconds * 1e9) : 0);
+    }
+
+    static void set_gauge(TelemetryGauge gauge, double value)
+    {
+        if (enabled()) gauges_[gauge].store(value, std::memory_order_relaxed);
+    }
+
+    /* the samples recorded since the previous call, one caller at a time */
+    static void snapshot(TelemetrySnapshot &out);
+
+    static const char *stage_name(TelemetryStage stage);
+    static const char *gauge_name(TelemetryGauge gauge);
+
+  private:
+    static void record_ns(TelemetryStage stage, uint64_t ns);
+
+    static std::atomic<bool>   enabled_;
+    static std::atomic<double> gauges_[TG_NUM];
+};
+
+/* times the enclosing scope, reads no clock while telemetry is disabled */
+class TelemetryScope
+{
+  public:
+    explicit TelemetryScope(TelemetryStage stage) : stage(stage), active(Telemetry::enabled())
+    {
+        if (active) start = std::chrono::steady_clock::now();
+    }
+
+    ~TelemetryScope()
+    {
+        if (active) Telemetry::record(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+  private:
+    TelemetryStage stage;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+/*
+ * Appends snapshots to a CSV file, one row per stage and gauge. Once the file grows beyond
+ * max_bytes it is moved to <path>.1, replacing the previous one, and a new file is started.
+ */
+class TelemetryLog
+{
+  public:
+    TelemetryLog(const std::string &path, size_t max_bytes);
+    ~TelemetryLog();
+
+    void write(const TelemetrySnapshot &snap, double stamp);
+
+  private:
+    void open();
+
+    std::string path;
+    size_t max_bytes;
+    FILE *fp = nullptr;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef TRAJECTORY_BUFFER_H
+#define TRAJECTORY_BUFFER_H
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+
+struct TrajectoryPoint
+{
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  double time;
+  Eigen::Quaterniond rot;
+  Eigen::Vector3d pos;
+  Eigen::Vector3d vel;
+  Eigen::Vector3d gyr;   // unbiased angular velocity in the body frame
+};
+
+/*
+ * Fixed-capacity ring of propagated states in increasing time order, shared between the
+ * filter (writer) and pose consumers (readers). Samples not newer than the last one are
+ * dropped, the oldest sample is overwritten once the ring is full. It holds at least one sample.
+ */
+class TrajectoryBuffer
+{
+  public:
+  explicit TrajectoryBuffer(size_t capacity) : points(std::max<size_t>(capacity, 1)), capacity(points.size()) {}
+
+  void push(const TrajectoryPoint &point)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (count > 0 && point.time <= at(count - 1).time) return;
+    points[(head + count) % capacity] = point;
+    if (count < capacity) count ++;
+    else head = (head + 1) % capacity;
+  }
+
+  /* state at time t, interpolated between the two enclosing samples (slerp on rotation) */
+  bool query(double t, TrajectoryPoint &out)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (count == 0 || t < at(0).time || t > at(count - 1).time) return false;
+    size_t lo = 0, hi = count - 1;
+    while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (at(mid).time <= t) lo = mid;
+      else hi = mid;
+    }
+    const TrajectoryPoint &a = at(lo), &b = at(hi);
+    double span = b.time - a.time;
+    double s = span > 0 ? (t - a.time) / span : 0.0;
+    out.time = t;
+    out.rot = a.rot.slerp(s, b.rot);
+    out.pos = a.pos + s * (b.pos - a.pos);
+    out.vel = a.vel + s * (b.vel - a.vel);
+    out.gyr = a.gyr + s * (b.gyr - a.gyr);
+    return true;
+  }
+
+  /* appends all samples newer than t to out, returns how many */
+  int newer_than(double t, std::vector<TrajectoryPoint, Eigen::aligned_allocator<TrajectoryPoint>> &out)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    size_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (at(mid).time <= t) lo = mid + 1;
+      else hi = mid;
+    }
+    int num = count - lo;
+    for (size_t i = lo; i < count; i++) out.push_back(at(i));
+    return num;
+  }
+
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    return count;
+  }
+
+  private:
+  const TrajectoryPoint &at(size_t i) const { return points[(head + i) % capacity]; }
+
+  std::mutex mtx;
+  std::vector<TrajectoryPoint, Eigen::aligned_allocator<TrajectoryPoint>> points;
+  size_t capacity;
+  size_t head = 0;
+  size_t count = 0;
+};
+
+#endif
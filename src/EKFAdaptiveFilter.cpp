@@ -14,10 +14,42 @@
 //=======================================================================================================================================
 
 #include "settings_adaptive_filter.h"
+#include "adaptive_filter_models.h"
 
 using namespace Eigen;
 using namespace std;
 
+//-----------------------------
+// Measurement queue
+//-----------------------------
+struct Measurement{
+    char sensor;                // 'i': imu, 'w': wheel, 'l': lidar
+    double time;                // header stamp
+    std_msgs::Header header;
+    Vector9d z;                 // imu: acc, gyro, rpy | wheel: vx, wz | lidar: xyz, rpy
+    Matrix9d E;                 // covariance of z
+};
+
+struct MeasurementLater{
+    bool operator()(const Measurement& a, const Measurement& b) const { return a.time > b.time; }
+};
+
+//-----------------------------
+// Filter history
+//-----------------------------
+struct FilterStep{
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    char sensor;                // 'i': imu, 'w': wheel, 'l': lidar
+    double time;
+    bool corrected;             // false when the sensor is disabled, only the prediction is kept
+    Vector6d y;                 // resolved measurement: imu rpy | wheel vx, wz | lidar velocities
+    Matrix6d R;                 // covariance of y
+    double dt;                  // prediction from the previous step
+    Matrix12d F;                // jacobian of that prediction, reused on replay
+    Vector12d X;                // state and covariance after the step
+    Matrix12d P;
+};
+
 //-----------------------------
 // Global variables
 //-----------------------------
@@ -30,6 +62,9 @@ float lidarG;
 float wheelG;
 float imuG;
 
+// length of the state history kept for delayed measurements (s)
+float historyTime;
+
 // adaptive wheel odometry covariance
 float gamma_vx;
 float gamma_omegaz;
@@ -76,18 +111,34 @@ private:
     nav_msgs::Odometry indLiDAROdometry;
 
     // Measure
-    Eigen::VectorXd imuMeasure, wheelMeasure, lidarMeasure, lidarMeasureL;
+    Vector9d imuMeasure;
+    Eigen::Vector2d wheelMeasure;
+    Vector6d lidarMeasure, lidarMeasureL;
 
     // Measure Covariance
-    Eigen::MatrixXd E_imu, E_wheel, E_lidar, E_lidarL, E_pred;
+    Matrix9d E_imu;
+    Eigen::Matrix2d E_wheel;
+    Matrix6d E_lidar, E_lidarL;
+    Matrix12d E_pred;
 
     // States and covariances
-    Eigen::VectorXd X, V;
-    Eigen::MatrixXd P, PV;
+    Vector12d X, V;
+    Matrix12d P, PV;
 
     // pose and velocities
     Eigen::VectorXd pose, velocities;
 
+    // measurements ordered by stamp, filled by the callbacks
+    std::priority_queue<Measurement, std::vector<Measurement>, MeasurementLater> measurementQueue;
+    std::condition_variable measurementCond;
+
+    // stamp of the state X
+    double filterTime;
+    bool filterInitialized;
+
+    // processed steps of the last historyTime seconds, in time order
+    std::deque<FilterStep, Eigen::aligned_allocator<FilterStep>> history;
+
     // Times
     double imuTimeLast;
     double wheelTimeLast;
@@ -106,21 +157,24 @@ private:
     struct bias bias_angular_velocity;
 
     // number of state or measure vectors
-    int N_STATES = 12;
-    int N_IMU = 9; 
-    int N_WHEEL = 2; 
-    int N_LIDAR = 6;
+    static const int N_STATES = 12;
+    static const int N_IMU = 9; 
+    static const int N_WHEEL = 2; 
+    static const int N_LIDAR = 6;
+
+    // E_pred is the process noise of one step of 1/200 s
+    static constexpr double PREDICTION_PERIOD = 1/200.0;
+    static const int HISTORY_MAX_SIZE = 2000;
     
     // boolean
     bool imuActivated;
     bool wheelActivated;
     bool lidarActivated;
-    bool imuNew;
-    bool wheelNew;
-    bool lidarNew;
     bool velComp;
 
 public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
     AdaptiveFilter():
         nh("~")
     {
@@ -133,32 +187,12 @@ public:
         pubFilteredOdometry = nh.advertise<nav_msgs::Odometry> (filterTopic, 5);
         
         // Initialization
-        allocateMemory();
         initialization();
     }
 
     //------------------
     // Auxliar functions
     //------------------
-    void allocateMemory(){
-        imuMeasure.resize(N_IMU);
-        wheelMeasure.resize(N_WHEEL);
-        lidarMeasure.resize(N_LIDAR);
-        lidarMeasureL.resize(N_LIDAR);
-
-        E_imu.resize(N_IMU,N_IMU);
-        E_wheel.resize(N_WHEEL,N_WHEEL);
-        E_lidar.resize(N_LIDAR,N_LIDAR);
-        E_lidarL.resize(N_LIDAR,N_LIDAR);
-        E_pred.resize(N_STATES,N_STATES);
-
-        X.resize(N_STATES);
-        P.resize(N_STATES,N_STATES);
-
-        V.resize(N_STATES);
-        PV.resize(N_STATES,N_STATES);
-    }
-
     void initialization(){
         // times
         imuTimeLast = 0;
@@ -178,36 +212,37 @@ public:
         bias_angular_velocity.y = 0.00000001;
         bias_angular_velocity.z = 0.00000001;
 
+        imu_dt = 0.01;
         wheel_dt = 0.05;
         lidar_dt = 0.1;
 
+        filterTime = 0;
+        filterInitialized = false;
+
         // boolean
         imuActivated = false;
         lidarActivated = false;
         wheelActivated = false;
 
-        imuNew = false;
-        wheelNew = false;
-        lidarNew = false;
-
         velComp = false;
 
         // matrices and vectors
-        imuMeasure = Eigen::VectorXd::Zero(N_IMU);
-        wheelMeasure = Eigen::VectorXd::Zero(N_WHEEL);
-        lidarMeasure = Eigen::VectorXd::Zero(N_LIDAR);
-        lidarMeasureL = Eigen::VectorXd::Zero(N_LIDAR);
+        imuMeasure.setZero();
+        wheelMeasure.setZero();
+        lidarMeasure.setZero();
+        lidarMeasureL.setZero();
         
-        E_imu = Eigen::MatrixXd::Zero(N_IMU,N_IMU);
-        E_lidar = Eigen::MatrixXd::Zero(N_LIDAR,N_LIDAR);
-        E_lidarL = Eigen::MatrixXd::Zero(N_LIDAR,N_LIDAR);
-        E_wheel = Eigen::MatrixXd::Zero(N_WHEEL,N_WHEEL);
-        E_pred = Eigen::MatrixXd::Zero(N_STATES,N_STATES);
+        E_imu.setZero();
+        E_lidar.setZero();
+        E_lidarL.setZero();
+        E_wheel.setZero();
+        E_pred.setZero();
 
         // state initial
-        X = Eigen::VectorXd::Zero(N_STATES);
-        P = Eigen::MatrixXd::Zero(N_STATES,N_STATES);
-        V = Eigen::VectorXd::Zero(N_STATES);
+        X.setZero();
+        P.setZero();
+        V.setZero();
+        PV.setZero();
 
         // covariance initial
         P(0,0) = 0.1;   // x
@@ -224,15 +259,13 @@ public:
         P(11,11) = 0.1;   // wz
 
         // Fixed prediction covariance
-        E_pred.block(6,6,6,6) = 0.01*P.block(6,6,6,6);
+        E_pred.block<6,6>(6,6) = 0.01*P.block<6,6>(6,6);
     }
 
     //-----------------
     // predict function
     //-----------------
-    void prediction_stage(double dt){
-        Eigen::MatrixXd F(N_STATES,N_STATES);
-
+    void prediction_stage(double dt, Matrix12d& F){
         // jacobian's computation
         F = jacobian_state(X, dt);
 
@@ -240,31 +273,33 @@ public:
         X = f_prediction_model(X, dt);
 
         // Priori covariance
-        P = F*P*F.transpose() + E_pred;
+        P = F*P*F.transpose() + (dt/PREDICTION_PERIOD)*E_pred;
+    }
+
+    // replay of a stored prediction, the jacobian is kept from the first pass
+    void repropagation_stage(double dt, const Matrix12d& F){
+        X = f_prediction_model(X, dt);
+        P = F*P*F.transpose() + (dt/PREDICTION_PERIOD)*E_pred;
     }
 
     //-----------------
     // correction stage
     //-----------------
-    void correction_wheel_stage(double dt){
-        Eigen::VectorXd Y(N_WHEEL), hx(N_WHEEL);
-        Eigen::MatrixXd H(N_WHEEL,N_STATES), K(N_STATES,N_WHEEL), E(N_WHEEL,N_WHEEL), S(N_WHEEL,N_WHEEL);
+    void correction_wheel_stage(const Eigen::Vector2d& Y, const Eigen::Matrix2d& E){
+        Eigen::Vector2d hx;
+        Eigen::Matrix<double,2,N_STATES> H;
+        Eigen::Matrix<double,N_STATES,2> K;
+        Eigen::Matrix2d S;
 
         // measure model of wheel odometry (only forward linear velocity)
         hx(0) = X(6);
         hx(1) = X(11);
 
-        // measurement
-        Y = wheelMeasure;
-
         // Jacobian of hx with respect to the states
-        H = Eigen::MatrixXd::Zero(N_WHEEL,N_STATES);
+        H.setZero();
         H(0,6) = 1; 
         H(1,11) = 1;
 
-        // covariance matrices
-        E << E_wheel;
-
         // Kalman's gain
         S = H*P*H.transpose() + E;
         K = P*H.transpose()*S.inverse();
@@ -274,69 +309,54 @@ public:
         P = P - K*H*P;
     }
 
-    void correction_imu_stage(double dt){
-        Eigen::Matrix3d S, E;
-        Eigen::Vector3d Y, hx;
-        Eigen::MatrixXd H(3,N_STATES), K(N_STATES,3);
+    void correction_imu_stage(const Eigen::Vector3d& Y, const Eigen::Matrix3d& E){
+        Eigen::Matrix3d S;
+        Eigen::Vector3d hx;
+        Eigen::Matrix<double,3,N_STATES> H;
+        Eigen::Matrix<double,N_STATES,3> K;
 
-        // measure model
-        hx = X.block(3,0,3,1);
-
-        // IMU measurement
-        Y = imuMeasure.block(6,0,3,1); // roll pitch yaw
+        // measure model (Y: roll pitch yaw)
+        hx = X.segment<3>(3);
 
         // Jacobian of hx with respect to the states
-        H = Eigen::MatrixXd::Zero(3,N_STATES);
-        H.block(0,3,3,3) = Eigen::MatrixXd::Identity(3,3);
-
-        // covariance matrices
-        E = E_imu.block(6,6,3,3);
+        H.setZero();
+        H.block<3,3>(0,3) = Eigen::Matrix3d::Identity();
 
         // Kalman's gain
         S = H*P*H.transpose() + E;
         K = P*H.transpose()*S.inverse();
 
         // correction - state
-        Eigen::VectorXd residues(3), KR(N_STATES);
+        Eigen::Vector3d residues;
+        Vector12d KR;
         residues(0) = atan2(sin(Y(0) - hx(0)), cos(Y(0) - hx(0)));
         residues(1) = atan2(sin(Y(1) - hx(1)), cos(Y(1) - hx(1)));
         residues(2) = atan2(sin(Y(2) - hx(2)), cos(Y(2) - hx(2)));
         KR = K*residues;
 
-        X.block(0,0,3,1) = X.block(0,0,3,1) + KR.block(0,0,3,1);
+        X.segment<3>(0) = X.segment<3>(0) + KR.segment<3>(0);
         X(3) = atan2(sin(X(3) + KR(3)), cos(X(3) + KR(3)));
         X(4) = atan2(sin(X(4) + KR(4)), cos(X(4) + KR(4)));
         X(5) = atan2(sin(X(5) + KR(5)), cos(X(5) + KR(5)));
-        X.block(6,0,6,1) = X.block(6,0,6,1) + KR.block(6,0,6,1);
+        X.segment<6>(6) = X.segment<6>(6) + KR.segment<6>(6);
 
         // X = X + K*(Y - hx); 
         // correction - covariance
         P = P - K*H*P;
     }
 
-    void correction_lidar_stage(double dt){
-        Eigen::MatrixXd K(N_STATES,N_LIDAR), S(N_LIDAR,N_LIDAR), G(N_LIDAR,N_LIDAR), Gl(N_LIDAR,N_LIDAR), Q(N_LIDAR,N_LIDAR);
-        Eigen::VectorXd Y(N_LIDAR), hx(N_LIDAR);
-        Eigen::MatrixXd H(N_LIDAR,N_STATES); 
+    void correction_lidar_stage(const Vector6d& Y, const Matrix6d& Q){
+        Eigen::Matrix<double,N_STATES,N_LIDAR> K;
+        Matrix6d S;
+        Vector6d hx;
+        Eigen::Matrix<double,N_LIDAR,N_STATES> H; 
 
-        // measure model
-        hx = X.block(6,0,6,1);
-        // wheel measurement
-        Y = indirect_lidar_measurement(lidarMeasure, lidarMeasureL, dt);
+        // measure model (Y: indirect lidar velocities)
+        hx = X.segment<6>(6);
 
         // Jacobian of hx with respect to the states
-        H = Eigen::MatrixXd::Zero(N_LIDAR,N_STATES);
-        H.block(0,6,6,6) = Eigen::MatrixXd::Identity(N_LIDAR,N_LIDAR);
-
-        // Error propagation     
-        G = jacobian_lidar_measurement(lidarMeasure, lidarMeasureL, dt);
-        Gl = jacobian_lidar_measurementL(lidarMeasure, lidarMeasureL, dt);
-
-        Q =  G*E_lidar*G.transpose() + Gl*E_lidarL*Gl.transpose();
-        // Q =  G*E_lidar*G.transpose();
-
-        // data save 
-        //publish_indirect_lidar_measurement(Y, Q);        
+        H.setZero();
+        H.block<6,6>(0,6) = Matrix6d::Identity();
 
         // Kalman's gain
         S = H*P*H.transpose() + Q;
@@ -345,149 +365,21 @@ public:
         // correction
         X = X + K*(Y - hx);
         P = P - K*H*P;
-
-        // last measurement
-        lidarMeasureL = lidarMeasure;
-        E_lidarL = E_lidar;
-    }
-    
-    //---------
-    // Models
-    //---------
-    VectorXd f_prediction_model(VectorXd x, double dt){ 
-        // state: {x, y, z, roll, pitch, yaw, vx, vy, vz, wx, wy, wz}
-        //        {         (world)         }{        (body)        }
-        Eigen::Matrix3d R, Rx, Ry, Rz, J;
-        Eigen::VectorXd xp(N_STATES), x2;
-        Eigen::MatrixXd A(6,6);    
-
-        // Rotation matrix
-        Rx = Eigen::AngleAxisd(x(3), Eigen::Vector3d::UnitX());
-        Ry = Eigen::AngleAxisd(x(4), Eigen::Vector3d::UnitY());
-        Rz = Eigen::AngleAxisd(x(5), Eigen::Vector3d::UnitZ());
-        R = Rz*Ry*Rx;
-        
-        // Jacobian matrix
-        J << 1.0, sin(x(3))*tan(x(4)), cos(x(3))*tan(x(4)),
-             0.0, cos(x(3)), -sin(x(3)),
-             0.0, sin(x(3))/cos(x(4)), cos(x(3))/cos(x(4));
-        
-        // model
-        A = Eigen::MatrixXd::Identity(6,6);
-        A.block(0,0,3,3) = R;
-        A.block(3,3,3,3) = J;
-
-        // teste para corredor de 500 m
-        //x2 = Eigen::VectorXd(N_STATES);
-        x2 = x;
-        x2.block(7,0,4,1) << 0.0, 0.0, 0.0, 0.0;
-
-        xp.block(0,0,6,1) = x2.block(0,0,6,1) + A*x2.block(6,0,6,1)*dt;
-        xp.block(6,0,6,1) = x2.block(6,0,6,1);
-
-        return xp;
     }
 
-    VectorXd indirect_lidar_measurement(VectorXd u, VectorXd ul, double dt){
-        Eigen::Matrix3d R, Rx, Ry, Rz, J;
-        Eigen::VectorXd up(N_LIDAR), u_diff(N_LIDAR);  
-        Eigen::MatrixXd A(N_LIDAR,N_LIDAR);  
-
-        // Rotation matrix
-        Rx = Eigen::AngleAxisd(ul(3), Eigen::Vector3d::UnitX());
-        Ry = Eigen::AngleAxisd(ul(4), Eigen::Vector3d::UnitY());
-        Rz = Eigen::AngleAxisd(ul(5), Eigen::Vector3d::UnitZ());
-        R = Rz*Ry*Rx;
-        
-        // Jacobian matrix
-        J << 1.0, sin(ul(3))*tan(ul(4)), cos(ul(3))*tan(ul(4)),
-             0.0, cos(ul(3)), -sin(ul(3)),
-             0.0, sin(ul(3))/cos(ul(4)), cos(ul(3))/cos(ul(4));
-        
-        // model
-        u_diff.block(0,0,3,1) = (u.block(0,0,3,1) - ul.block(0,0,3,1));
-        u_diff(3) = atan2(sin(u(3) - ul(3)),cos(u(3) - ul(3)));
-        u_diff(4) = atan2(sin(u(4) - ul(4)),cos(u(4) - ul(4)));
-        u_diff(5) = atan2(sin(u(5) - ul(5)),cos(u(5) - ul(5)));
-
-        A = Eigen::MatrixXd::Zero(N_LIDAR,N_LIDAR);
-        A.block(0,0,3,3) = R.transpose();
-        A.block(3,3,3,3) = J.inverse();
-
-        up = A*u_diff/dt;
-
-        return up;
-    }
-
-    //----------
-    // Jacobians
-    //----------
-    MatrixXd jacobian_state(VectorXd x, double dt){
-        Eigen::MatrixXd J(N_STATES,N_STATES);
-        Eigen::VectorXd f0(N_STATES), f1(N_STATES), x_plus(N_STATES);
-
-        f0 = f_prediction_model(x, dt);
-
-        double delta = 0.0001;
-        for (size_t i = 0; i < N_STATES; i++){
-            x_plus = x;
-            x_plus(i) = x_plus(i) + delta;
-
-            f1 = f_prediction_model(x_plus, dt);
-           
-            J.block(0,i,N_STATES,1) = (f1 - f0)/delta;       
-            J(3,i) = sin(f1(3) - f0(3))/delta;
-            J(4,i) = sin(f1(4) - f0(4))/delta;
-            J(5,i) = sin(f1(5) - f0(5))/delta; 
-        }
-
-        return J;
-    }
-
-    MatrixXd jacobian_lidar_measurement(VectorXd u, VectorXd ul, double dt){ 
-        Eigen::MatrixXd J(N_LIDAR,N_LIDAR);
-        Eigen::VectorXd f0(N_LIDAR), f1(N_LIDAR), u_plus(N_LIDAR);
-
-        f0 = indirect_lidar_measurement(u, ul, dt);
-
-        double delta = 0.0000001;
-        for (size_t i = 0; i < N_LIDAR; i++){
-            u_plus = u;
-            u_plus(i) = u_plus(i) + delta;
-
-            f1 = indirect_lidar_measurement(u_plus, ul, dt);
-           
-            J.block(0,i,N_LIDAR,1) = (f1 - f0)/delta;       
-            J(3,i) = sin(f1(3) - f0(3))/delta;
-            J(4,i) = sin(f1(4) - f0(4))/delta;
-            J(5,i) = sin(f1(5) - f0(5))/delta; 
-        }
-
-        return J;
-    }
-
-    MatrixXd jacobian_lidar_measurementL(VectorXd u, VectorXd ul, double dt){ 
-        Eigen::MatrixXd J(N_LIDAR,N_LIDAR);
-        Eigen::VectorXd f0(N_LIDAR), f1(N_LIDAR), ul_plus(N_LIDAR);
-
-        f0 = indirect_lidar_measurement(u, ul, dt);
-
-        double delta = 0.0000001;
-        for (size_t i = 0; i < N_LIDAR; i++){
-            ul_plus = ul;
-            ul_plus(i) = ul_plus(i) + delta;
-
-            f1 = indirect_lidar_measurement(u, ul_plus, dt);
-           
-            J.block(0,i,N_LIDAR,1) = (f1 - f0)/delta;       
-            J(3,i) = sin(f1(3) - f0(3))/delta;
-            J(4,i) = sin(f1(4) - f0(4))/delta;
-            J(5,i) = sin(f1(5) - f0(5))/delta; 
+    void correction_stage(const FilterStep& step){
+        switch(step.sensor){
+            case 'i':
+                correction_imu_stage(step.y.head<3>(), step.R.topLeftCorner<3,3>());
+                break;
+            case 'w':
+                correction_wheel_stage(step.y.head<2>(), step.R.topLeftCorner<2,2>());
+                break;
+            case 'l':
+                correction_lidar_stage(step.y, step.R);
         }
-
-        return J;
     }
-
+    
     void wheelOdometryAdaptiveCovariance(){
         // wheel odometry covariance adaptive inputs
         double omegaz_wheel_odom = wheelMeasure(1);
@@ -501,17 +393,10 @@ public:
     // callbacks
     //----------
     void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn){
-        double timeL = ros::Time::now().toSec();
-
-        // time
-        if (imuActivated){
-            imuTimeLast = imuTimeCurrent;
-            imuTimeCurrent = imuIn->header.stamp.toSec();
-        }else{
-            imuTimeCurrent = imuIn->header.stamp.toSec();
-            imuTimeLast = imuTimeCurrent + 0.01;
-            imuActivated = true;
-        }       
+        Measurement m;
+        m.sensor = 'i';
+        m.time = imuIn->header.stamp.toSec();
+        m.header = imuIn->header;
 
         // roll, pitch and yaw 
         double roll, pitch, yaw;
@@ -519,87 +404,56 @@ public:
         tf::Matrix3x3(tf::Quaternion(orientation.x, orientation.y, orientation.z, orientation.w)).getRPY(roll, pitch, yaw);
 
         // measure
-        imuMeasure.block(0,0,3,1) << imuIn->linear_acceleration.x, imuIn->linear_acceleration.y, imuIn->linear_acceleration.z;
-        imuMeasure.block(3,0,3,1) << imuIn->angular_velocity.x, imuIn->angular_velocity.y, imuIn->angular_velocity.z; 
-        imuMeasure.block(6,0,3,1) << roll, pitch, yaw;
+        m.z.block(0,0,3,1) << imuIn->linear_acceleration.x, imuIn->linear_acceleration.y, imuIn->linear_acceleration.z;
+        m.z.block(3,0,3,1) << imuIn->angular_velocity.x, imuIn->angular_velocity.y, imuIn->angular_velocity.z; 
+        m.z.block(6,0,3,1) << roll, pitch, yaw;
 
         // covariance
-        E_imu.block(0,0,3,3) << imuIn->linear_acceleration_covariance[0], imuIn->linear_acceleration_covariance[1], imuIn->linear_acceleration_covariance[2],
-                                imuIn->linear_acceleration_covariance[3], imuIn->linear_acceleration_covariance[4], imuIn->linear_acceleration_covariance[5],
-                                imuIn->linear_acceleration_covariance[6], imuIn->linear_acceleration_covariance[7], imuIn->linear_acceleration_covariance[8];
-        E_imu.block(3,3,3,3) << imuIn->angular_velocity_covariance[0], imuIn->angular_velocity_covariance[1], imuIn->angular_velocity_covariance[2],
-                                imuIn->angular_velocity_covariance[3], imuIn->angular_velocity_covariance[4], imuIn->angular_velocity_covariance[5],
-                                imuIn->angular_velocity_covariance[6], imuIn->angular_velocity_covariance[7], imuIn->angular_velocity_covariance[8];
-        E_imu.block(6,6,3,3) << imuIn->orientation_covariance[0], imuIn->orientation_covariance[1], imuIn->orientation_covariance[2],
-                                imuIn->orientation_covariance[3], imuIn->orientation_covariance[4], imuIn->orientation_covariance[5],
-                                imuIn->orientation_covariance[6], imuIn->orientation_covariance[7], imuIn->orientation_covariance[4]; //the yaw covariance was zero 
-
-        E_imu.block(3,3,3,3) = imuG*E_imu.block(3,3,3,3);
-        E_imu.block(6,6,3,3) = imuG*E_imu.block(6,6,3,3);
-
-        // time
-        imu_dt = imuTimeCurrent - imuTimeLast;
-        imu_dt = 0.02;
-
-        // header
-        double timediff = ros::Time::now().toSec() - timeL + imuTimeCurrent;
-        headerI = imuIn->header;
-        headerI.stamp = ros::Time().fromSec(timediff);
-
-        imuNew = true;
+        m.E.setZero();
+        m.E.block(0,0,3,3) << imuIn->linear_acceleration_covariance[0], imuIn->linear_acceleration_covariance[1], imuIn->linear_acceleration_covariance[2],
+                              imuIn->linear_acceleration_covariance[3], imuIn->linear_acceleration_covariance[4], imuIn->linear_acceleration_covariance[5],
+                              imuIn->linear_acceleration_covariance[6], imuIn->linear_acceleration_covariance[7], imuIn->linear_acceleration_covariance[8];
+        m.E.block(3,3,3,3) << imuIn->angular_velocity_covariance[0], imuIn->angular_velocity_covariance[1], imuIn->angular_velocity_covariance[2],
+                              imuIn->angular_velocity_covariance[3], imuIn->angular_velocity_covariance[4], imuIn->angular_velocity_covariance[5],
+                              imuIn->angular_velocity_covariance[6], imuIn->angular_velocity_covariance[7], imuIn->angular_velocity_covariance[8];
+        m.E.block(6,6,3,3) << imuIn->orientation_covariance[0], imuIn->orientation_covariance[1], imuIn->orientation_covariance[2],
+                              imuIn->orientation_covariance[3], imuIn->orientation_covariance[4], imuIn->orientation_covariance[5],
+                              imuIn->orientation_covariance[6], imuIn->orientation_covariance[7], imuIn->orientation_covariance[4]; //the yaw covariance was zero 
+
+        m.E.block(3,3,3,3) = imuG*m.E.block(3,3,3,3);
+        m.E.block(6,6,3,3) = imuG*m.E.block(6,6,3,3);
+
+        push_measurement(m);
     }
 
     void wheelOdometryHandler(const nav_msgs::Odometry::ConstPtr& wheelOdometry){
-        double timeL = ros::Time::now().toSec();
-
-        // time
-        if (wheelActivated){
-            wheelTimeLast = wheelTimeCurrent;
-            wheelTimeCurrent = wheelOdometry->header.stamp.toSec();
-        }else{
-            wheelTimeCurrent = wheelOdometry->header.stamp.toSec();
-            wheelTimeLast = wheelTimeCurrent + 0.05;
-            wheelActivated = true;
-        } 
+        Measurement m;
+        m.sensor = 'w';
+        m.time = wheelOdometry->header.stamp.toSec();
+        m.header = wheelOdometry->header;
 
-        // measure
-        wheelMeasure << 1.0*wheelOdometry->twist.twist.linear.x, wheelOdometry->twist.twist.angular.z;
-
-        // covariance
-        wheelOdometryAdaptiveCovariance();
-
-        // time
-        wheel_dt = wheelTimeCurrent - wheelTimeLast;
-        wheel_dt = 0.02;
+        // measure (the covariance depends on the imu and is computed when it is applied)
+        m.z.setZero();
+        m.z.head<2>() << 1.0*wheelOdometry->twist.twist.linear.x, wheelOdometry->twist.twist.angular.z;
+        m.E.setZero();
 
-        // header
-        double timediff = ros::Time::now().toSec() - timeL + wheelTimeCurrent;
-        headerW = wheelOdometry->header;
-        headerW.stamp = ros::Time().fromSec(timediff);
-
-        // new measure
-        wheelNew =  true;
+        push_measurement(m);
     }
 
     void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr& laserOdometry){
-        double timeL = ros::Time::now().toSec();
+        Measurement m;
+        m.sensor = 'l';
+        m.time = laserOdometry->header.stamp.toSec();
+        m.header = laserOdometry->header;
 
-        if (lidarActivated){
-            lidarTimeLast = lidarTimeCurrent;
-            lidarTimeCurrent = laserOdometry->header.stamp.toSec();
-        }else{
-            lidarTimeCurrent = laserOdometry->header.stamp.toSec();
-            lidarTimeLast = lidarTimeCurrent + 0.1;
-            lidarActivated = true;
-        }  
-        
         // roll, pitch and yaw 
         double roll, pitch, yaw;
         geometry_msgs::Quaternion orientation = laserOdometry->pose.pose.orientation;
         tf::Matrix3x3(tf::Quaternion(orientation.x, orientation.y, orientation.z, orientation.w)).getRPY(roll, pitch, yaw);
 
-        lidarMeasure.block(0,0,3,1) << laserOdometry->pose.pose.position.x, laserOdometry->pose.pose.position.y, laserOdometry->pose.pose.position.z;
-        lidarMeasure.block(3,0,3,1) << roll, pitch, yaw;    
+        m.z.setZero();
+        m.z.block(0,0,3,1) << laserOdometry->pose.pose.position.x, laserOdometry->pose.pose.position.y, laserOdometry->pose.pose.position.z;
+        m.z.block(3,0,3,1) << roll, pitch, yaw;    
 
         //old covariance calculation method
         //double corner = double(laserOdometry->twist.twist.linear.x);
@@ -607,26 +461,204 @@ public:
         //E_lidar = adaptive_covariance(corner, surf);
 
         // lidar pose convariance
+        m.E.setZero();
         int k = 0;
         for (int i = 0; i < 6; i++){
             for (int j = 0; j < 6; j++){
-                E_lidar(i,j) = lidarG*laserOdometry->pose.covariance[k];
+                m.E(i,j) = lidarG*laserOdometry->pose.covariance[k];
                 k++;
             }
         } 
-        //E_lidar = laserOdometry->pose.covariance;
 
+        push_measurement(m);
+    }
+
+    void push_measurement(const Measurement& m){
+        if (!enableFilter) return;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            measurementQueue.push(m);
+        }
+        measurementCond.notify_one();
+    }
+
+    //-------------
+    // measurements
+    //-------------
+    // the *_measurement functions update the sensor bookkeeping and resolve m into the
+    // measurement applied by correction_stage, they return false when nothing is corrected
+    bool imu_measurement(const Measurement& m, FilterStep& step){
         // time
+        if (imuActivated){
+            imuTimeLast = imuTimeCurrent;
+            imuTimeCurrent = m.time;
+            imu_dt = imuTimeCurrent - imuTimeLast;
+        }else{
+            imuTimeCurrent = m.time;
+            imuTimeLast = m.time;
+            imuActivated = true;
+        }
+
+        imuMeasure = m.z;
+        E_imu = m.E;
+        headerI = m.header;
+
+        if (!enableImu) return false;
+
+        step.y.head<3>() = imuMeasure.segment<3>(6);
+        step.R.topLeftCorner<3,3>() = E_imu.block<3,3>(6,6);
+        return true;
+    }
+
+    bool wheel_measurement(const Measurement& m, FilterStep& step){
+        // time
+        if (wheelActivated){
+            wheelTimeLast = wheelTimeCurrent;
+            wheelTimeCurrent = m.time;
+            wheel_dt = wheelTimeCurrent - wheelTimeLast;
+        }else{
+            wheelTimeCurrent = m.time;
+            wheelTimeLast = m.time;
+            wheelActivated = true;
+        }
+
+        wheelMeasure = m.z.head<2>();
+        headerW = m.header;
+
+        // covariance
+        wheelOdometryAdaptiveCovariance();
+
+        if (!enableWheel) return false;
+
+        step.y.head<2>() = wheelMeasure;
+        step.R.topLeftCorner<2,2>() = E_wheel;
+        return true;
+    }
+
+    bool lidar_measurement(const Measurement& m, FilterStep& step){
+        headerL = m.header;
+        lidarMeasure = m.z.head<6>();
+        E_lidar = m.E.topLeftCorner<6,6>();
+
+        // the first pose only serves as reference for the next velocity measurement
+        if (!lidarActivated){
+            lidarTimeCurrent = m.time;
+            lidarTimeLast = m.time;
+            lidarMeasureL = lidarMeasure;
+            E_lidarL = E_lidar;
+            lidarActivated = true;
+            return false;
+        }
+
+        // time
+        lidarTimeLast = lidarTimeCurrent;
+        lidarTimeCurrent = m.time;
         lidar_dt = lidarTimeCurrent - lidarTimeLast;
-        lidar_dt = 0.1;
 
-        // header
-        double timediff = ros::Time::now().toSec() - timeL + lidarTimeCurrent;
-        headerL = laserOdometry->header;
-        headerL.stamp = ros::Time().fromSec(timediff);
-        
-        //New measure
-        lidarNew = true;
+        bool valid = enableLidar && lidar_dt > 0;
+        if (valid){
+            // indirect measurement and error propagation
+            Matrix6d G = jacobian_lidar_measurement(lidarMeasure, lidarMeasureL, lidar_dt);
+            Matrix6d Gl = jacobian_lidar_measurementL(lidarMeasure, lidarMeasureL, lidar_dt);
+
+            step.y = indirect_lidar_measurement(lidarMeasure, lidarMeasureL, lidar_dt);
+            step.R = G*E_lidar*G.transpose() + Gl*E_lidarL*Gl.transpose();
+            // step.R =  G*E_lidar*G.transpose();
+
+            // data save 
+            //publish_indirect_lidar_measurement(step.y, step.R);
+        }
+
+        // last measurement
+        lidarMeasureL = lidarMeasure;
+        E_lidarL = E_lidar;
+        return valid;
+    }
+
+    // applies a step older than the filter state: restores the last step before it, applies
+    // it at its own stamp and replays the newer steps with their cached jacobians
+    void rollback_stage(FilterStep& step){
+        auto it = std::upper_bound(history.begin(), history.end(), step.time,
+                                   [](double t, const FilterStep& h){ return t < h.time; });
+        X = (it - 1)->X;
+        P = (it - 1)->P;
+        double t = (it - 1)->time;
+
+        step.dt = step.time - t;
+        if (step.dt > 0) prediction_stage(step.dt, step.F);
+        if (step.corrected) correction_stage(step);
+        step.X = X;
+        step.P = P;
+        it = history.insert(it, step);
+
+        // the step right after the inserted one now predicts over a shorter interval
+        bool split = true;
+        for (t = step.time, ++it; it != history.end(); t = it->time, ++it){
+            if (split){
+                it->dt = it->time - t;
+                if (it->dt > 0) prediction_stage(it->dt, it->F);
+                split = false;
+            }else if (it->dt > 0){
+                repropagation_stage(it->dt, it->F);
+            }
+            if (it->corrected) correction_stage(*it);
+            it->X = X;
+            it->P = P;
+        }
+    }
+
+    void process_measurement(const Measurement& m){
+        FilterStep step;
+        step.sensor = m.sensor;
+        step.time = m.time;
+        step.dt = 0;
+        step.F.setIdentity();
+        step.y.setZero();
+        step.R.setZero();
+
+        switch(m.sensor){
+            case 'i':
+                step.corrected = imu_measurement(m, step);
+                break;
+            case 'w':
+                step.corrected = wheel_measurement(m, step);
+                break;
+            case 'l':
+                step.corrected = lidar_measurement(m, step);
+        }
+
+        if (!filterInitialized){
+            filterTime = m.time;
+            filterInitialized = true;
+        }
+
+        if (m.time >= filterTime){
+            // predict exactly to the measurement stamp
+            if (m.time > filterTime){
+                step.dt = m.time - filterTime;
+                prediction_stage(step.dt, step.F);
+                filterTime = m.time;
+            }
+            if (step.corrected) correction_stage(step);
+            step.X = X;
+            step.P = P;
+            history.push_back(step);
+        }else if (!history.empty() && m.time >= history.front().time){
+            // delayed measurement (e.g. the Fast-LIO2 odometry) applied at its true stamp
+            rollback_stage(step);
+        }else{
+            // older than the history, applied at the current filter time
+            if (step.corrected) correction_stage(step);
+        }
+
+        while (!history.empty() && (history.front().time < filterTime - historyTime || history.size() > size_t(HISTORY_MAX_SIZE))){
+            history.pop_front();
+        }
+
+        // publish state
+        if (filterFreq == "p" || (step.corrected && filterFreq[0] == m.sensor)){
+            publish_odom(m.sensor);
+        }
     }
 
     //----------
@@ -644,6 +676,8 @@ public:
                     filteredOdometry.header = headerL;
             }
         
+        // the state may be newer than the measurement after a rollback
+        filteredOdometry.header.stamp = ros::Time().fromSec(filterTime);
         filteredOdometry.header.frame_id = "chassis_init";
         filteredOdometry.child_frame_id = "ekf_odom_frame";
 
@@ -691,101 +725,22 @@ public:
     // runs
     //----------
     void run(){
-        // rate
-        ros::Rate r(200);        
-
-        double t_last = ros::Time::now().toSec();
-        double t_now;
-        double dt_now;
-        bool pub_lidar, pub_wheel, pub_imu, pub_pred;
-        pub_lidar = false;
-        pub_wheel = false;
-        pub_imu = false;
-        pub_pred = false;
+        Measurement m;
 
         //ROS_INFO("Running...");  
         while (ros::ok())
         {
-            // Prediction
-            if (enableFilter){
-                // prediction stage
-                t_now = ros::Time::now().toSec();
-                dt_now = t_now-t_last;
-                t_last = t_now;
-
-                // prediction_stage(1/200.0);
-                prediction_stage(dt_now);
-                
-                // publish state
-                if (filterFreq == "p"){
-                    // publish_odom('p');
-                    pub_pred =  true;
-                }
+            {
+                // wakes up on arrival, the timeout only bounds the shutdown latency
+                std::unique_lock<std::mutex> lock(mtx);
+                if (!measurementCond.wait_for(lock, std::chrono::milliseconds(100), [this]{ return !measurementQueue.empty(); }))
+                    continue;
+
+                m = measurementQueue.top();
+                measurementQueue.pop();
             }
 
-            //Correction IMU
-            if (enableFilter && enableImu && imuActivated && imuNew){
-                // correction stage
-                correction_imu_stage(imu_dt);
-
-                // publish state
-                if (filterFreq == "i"){
-                    // publish_odom('i');
-                    pub_imu =  true;
-                }
-
-                // control variable
-                imuNew =  false;
-            }
-
-            // Correction wheel
-            if (enableFilter && enableWheel && wheelActivated && wheelNew){                
-                // correction stage
-                correction_wheel_stage(wheel_dt);
-
-                if (filterFreq == "w"){
-                    // publish_odom('w');
-                    pub_wheel = true;
-                }                
-
-                // control variable
-                wheelNew =  false;
-            }
-
-            //Corection LiDAR
-            if (enableFilter && enableLidar && lidarActivated && lidarNew){      
-                //ROS_INFO("Lidar correction"); //DEBUG
-                // correction stage
-                correction_lidar_stage(lidar_dt);
-
-                // publish state
-                if (filterFreq == "l"){
-                    // publish_odom('l');
-                    pub_lidar = true;
-                }
-
-                // controle variable
-                lidarNew =  false;
-            }
-
-            // publishing
-            if (pub_pred){
-                publish_odom('p');
-                pub_pred = false;
-            }else if (pub_lidar){
-                publish_odom('l');
-                pub_lidar =  false;
-            }else if (pub_wheel){
-                publish_odom('w');
-                pub_wheel = false;
-            }else if (pub_imu){
-                publish_odom('i');
-                pub_imu = false;
-            }
-
-            
-            ros::spinOnce();
-            r.sleep();        
+            process_measurement(m);
         }
     }
 };
@@ -810,6 +765,7 @@ int main(int argc, char** argv)
         nh_.param("/adaptive_filter/lidarG", lidarG, float(75));
         nh_.param("/adaptive_filter/wheelG", wheelG, float(0.5));
         nh_.param("/adaptive_filter/imuG", imuG, float(100));
+        nh_.param("/adaptive_filter/historyTime", historyTime, float(0.5));
 
         //wheel odometry covariance adaptive positive constants
         nh_.param("/adaptive_filter/gamma_vx", gamma_vx, float(0.05));       
@@ -831,12 +787,16 @@ int main(int argc, char** argv)
 
     if (enableFilter){
         ROS_INFO("\033[1;32m---->\033[0m Adaptive Filter Started.");
+        // callbacks only queue the measurements, the filter runs in this thread
+        ros::AsyncSpinner spinner(1);
+        spinner.start();
+
         // runs
         AF.run();
     }else{
         ROS_INFO("\033[1;32m---->\033[0m Adaptive Filter Stopped.");
+        ros::spin();
     }
     
-    ros::spin();
     return 0;
 }
@@ -5,7 +5,8 @@
 #include <thread>
 #include <fstream>
 #include <csignal>
-#include <ros/ros.h>
+#include <cassert>
+#include <omp.h>
 #include <so3_math.h>
 #include <Eigen/Eigen>
 #include <common_lib.h>
@@ -13,17 +14,9 @@
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <condition_variable>
-#include <nav_msgs/Odometry.h>
 #include <pcl/common/transforms.h>
-#include <pcl/kdtree/kdtree_flann.h>
-#include <tf/transform_broadcaster.h>
-#include <eigen_conversions/eigen_msg.h>
-#include <pcl_conversions/pcl_conversions.h>
-#include <sensor_msgs/Imu.h>
-#include <sensor_msgs/PointCloud2.h>
-#include <geometry_msgs/Vector3.h>
 #include "use-ikfom.hpp"
-#include "preprocess.h"
+#include <trajectory_buffer.h>
 
 /// *************Preconfiguration
 
@@ -31,6 +24,17 @@
 
 const bool time_list(PointType &x, PointType &y) {return (x.curvature < y.curvature);};
 
+/// IMU state at each sample of a scan, used to undistort the points
+struct KeyPose
+{
+  double offset_time;
+  V3D acc;
+  V3D gyr;
+  V3D vel;
+  V3D pos;
+  M3D rot;
+};
+
 /// *************IMU Process and undistortion
 class ImuProcess
 {
@@ -41,7 +45,6 @@ class ImuProcess
   ~ImuProcess();
   
   void Reset();
-  void Reset(double start_timestamp, const sensor_msgs::ImuConstPtr &lastimu);
   void set_extrinsic(const V3D &transl, const M3D &rot);
   void set_extrinsic(const V3D &transl);
   void set_extrinsic(const MD(4,4) &T);
@@ -51,6 +54,8 @@ class ImuProcess
   void set_acc_bias_cov(const V3D &b_a);
   Eigen::Matrix<double, 12, 12> Q;
   void Process(const MeasureGroup &meas,  esekfom::esekf<state_ikfom, 12, input_ikfom> &kf_state, PointCloudXYZI::Ptr pcl_un_);
+  void record_state(const state_ikfom &s, double time);
+  double acc_scale() const { return G_m_s2 / mean_acc.norm(); }   // of the raw accelerometer, fixed at init
 
   ofstream fout_imu;
   V3D cov_acc;
@@ -61,15 +66,23 @@ class ImuProcess
   V3D cov_bias_acc;
   double first_lidar_time;
   int lidar_type;
+  bool parallel_undistort = false;   // sort-free undistortion, every point looks up its own IMU interval
+  V3D  init_pos = Zero3d;            // pose of the first IMU frame, identity unless a prior map is used
+  M3D  init_rot = Eye3d;
+  shared_ptr<TrajectoryBuffer> trajectory;   // keeps the propagated states when set
 
  private:
   void IMU_init(const MeasureGroup &meas, esekfom::esekf<state_ikfom, 12, input_ikfom> &kf_state, int &N);
   void UndistortPcl(const MeasureGroup &meas, esekfom::esekf<state_ikfom, 12, input_ikfom> &kf_state, PointCloudXYZI &pcl_in_out);
+  void UndistortParallel(const state_ikfom &imu_state, const PointCloudXYZI &pcl_in, PointCloudXYZI &pcl_out);
 
   PointCloudXYZI::Ptr cur_pcl_un_;
-  sensor_msgs::ImuConstPtr last_imu_;
-  deque<sensor_msgs::ImuConstPtr> v_imu_;
-  vector<Pose6D> IMUpose;
+  ImuSample last_imu_;
+  vector<ImuSample> imu_samples_;   // cleared per scan, the capacity is kept
+  vector<KeyPose>   key_poses_;
+  vector<M3D>       interval_R_;    // per IMU interval constants of the parallel undistortion
+  vector<V3D>       interval_t_, interval_v_, interval_a_;
+  vector<double>    interval_time_;
   vector<M3D>    v_rot_pcl_;
   M3D Lidar_R_wrt_IMU;
   V3D Lidar_T_wrt_IMU;
@@ -98,7 +111,9 @@ ImuProcess::ImuProcess()
   angvel_last     = Zero3d;
   Lidar_T_wrt_IMU = Zero3d;
   Lidar_R_wrt_IMU = Eye3d;
-  last_imu_.reset(new sensor_msgs::Imu());
+  last_imu_ = ImuSample{0.0, Zero3d, Zero3d};
+  imu_samples_.reserve(64);
+  key_poses_.reserve(64);
 }
 
 ImuProcess::~ImuProcess() {}
@@ -112,9 +127,9 @@ void ImuProcess::Reset()
   imu_need_init_    = true;
   start_timestamp_  = -1;
   init_iter_num     = 1;
-  v_imu_.clear();
-  IMUpose.clear();
-  last_imu_.reset(new sensor_msgs::Imu());
+  imu_samples_.clear();
+  key_poses_.clear();
+  last_imu_ = ImuSample{0.0, Zero3d, Zero3d};
   cur_pcl_un_.reset(new PointCloudXYZI());
 }
 
@@ -168,19 +183,15 @@ void ImuProcess::IMU_init(const MeasureGroup &meas, esekfom::esekf<state_ikfom,
     Reset();
     N = 1;
     b_first_frame_ = false;
-    const auto &imu_acc = meas.imu.front()->linear_acceleration;
-    const auto &gyr_acc = meas.imu.front()->angular_velocity;
-    mean_acc << imu_acc.x, imu_acc.y, imu_acc.z;
-    mean_gyr << gyr_acc.x, gyr_acc.y, gyr_acc.z;
+    mean_acc = meas.imu.front().acc;
+    mean_gyr = meas.imu.front().gyr;
     first_lidar_time = meas.lidar_beg_time;
   }
 
   for (const auto &imu : meas.imu)
   {
-    const auto &imu_acc = imu->linear_acceleration;
-    const auto &gyr_acc = imu->angular_velocity;
-    cur_acc << imu_acc.x, imu_acc.y, imu_acc.z;
-    cur_gyr << gyr_acc.x, gyr_acc.y, gyr_acc.z;
+    cur_acc = imu.acc;
+    cur_gyr = imu.gyr;
 
     mean_acc      += (cur_acc - mean_acc) / N;
     mean_gyr      += (cur_gyr - mean_gyr) / N;
@@ -193,7 +204,9 @@ void ImuProcess::IMU_init(const MeasureGroup &meas, esekfom::esekf<state_ikfom,
     N ++;
   }
   state_ikfom init_state = kf_state.get_x();
-  init_state.grav = S2(- mean_acc / mean_acc.norm() * G_m_s2);
+  init_state.rot  = init_rot;
+  init_state.pos  = init_pos;
+  init_state.grav = S2(- init_rot * mean_acc / mean_acc.norm() * G_m_s2);
   
   //state_inout.rot = Eye3d; // Exp(mean_acc.cross(V3D(0, 0, -1 / scale_gravity)));
   init_state.bg  = mean_gyr;
@@ -213,13 +226,26 @@ void ImuProcess::IMU_init(const MeasureGroup &meas, esekfom::esekf<state_ikfom,
 
 }
 
+void ImuProcess::record_state(const state_ikfom &s, double time)
+{
+  if (!trajectory) return;
+  TrajectoryPoint point;
+  point.time = time;
+  point.rot  = s.rot;
+  point.pos  = s.pos;
+  point.vel  = s.vel;
+  point.gyr  = angvel_last;
+  trajectory->push(point);
+}
+
 void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf<state_ikfom, 12, input_ikfom> &kf_state, PointCloudXYZI &pcl_out)
 {
   /*** add the imu of the last frame-tail to the of current frame-head ***/
-  auto v_imu = meas.imu;
-  v_imu.push_front(last_imu_);
-  const double &imu_beg_time = v_imu.front()->header.stamp.toSec();
-  const double &imu_end_time = v_imu.back()->header.stamp.toSec();
+  imu_samples_.clear();
+  imu_samples_.push_back(last_imu_);
+  imu_samples_.insert(imu_samples_.end(), meas.imu.begin(), meas.imu.end());
+  const double imu_beg_time = imu_samples_.front().time;
+  const double imu_end_time = imu_samples_.back().time;
 
   double pcl_beg_time = meas.lidar_beg_time;
   double pcl_end_time = meas.lidar_end_time;
@@ -229,58 +255,67 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf<state_ikf
         pcl_end_time = meas.lidar_beg_time;
     }
 
-    /*** sort point clouds by offset time ***/
-  pcl_out = *(meas.lidar);
-  sort(pcl_out.points.begin(), pcl_out.points.end(), time_list);
+  const bool undistort_parallel = lidar_type != MARSIM && parallel_undistort;
+  if (undistort_parallel)
+  {
+    /*** each point is written once, undistorted, at its index in the scan ***/
+    pcl_out.header = meas.lidar->header;
+    pcl_out.is_dense = meas.lidar->is_dense;
+    pcl_out.resize(meas.lidar->size());
+  }
+  else
+  {
+    /*** sort point clouds by offset time, the backward pass undistorts them in place ***/
+    pcl_out = *(meas.lidar);
+    if (!parallel_undistort) sort(pcl_out.points.begin(), pcl_out.points.end(), time_list);
+  }
   // cout<<"[ IMU Process ]: Process lidar from "<<pcl_beg_time<<" to "<<pcl_end_time<<", " \
   //          <<meas.imu.size()<<" imu msgs from "<<imu_beg_time<<" to "<<imu_end_time<<endl;
 
   /*** Initialize IMU pose ***/
   state_ikfom imu_state = kf_state.get_x();
-  IMUpose.clear();
-  IMUpose.push_back(set_pose6d(0.0, acc_s_last, angvel_last, imu_state.vel, imu_state.pos, imu_state.rot.toRotationMatrix()));
+  key_poses_.clear();
+  key_poses_.push_back({0.0, acc_s_last, angvel_last, imu_state.vel, imu_state.pos, imu_state.rot.toRotationMatrix()});
 
   /*** forward propagation at each imu point ***/
   V3D angvel_avr, acc_avr, acc_imu, vel_imu, pos_imu;
   M3D R_imu;
 
   double dt = 0;
+  const double acc_scale = G_m_s2 / mean_acc.norm();
+
+  Q.block<3, 3>(0, 0).diagonal() = cov_gyr;
+  Q.block<3, 3>(3, 3).diagonal() = cov_acc;
+  Q.block<3, 3>(6, 6).diagonal() = cov_bias_gyr;
+  Q.block<3, 3>(9, 9).diagonal() = cov_bias_acc;
 
   input_ikfom in;
-  for (auto it_imu = v_imu.begin(); it_imu < (v_imu.end() - 1); it_imu++)
+  for (int k = 0; k + 1 < imu_samples_.size(); k++)
   {
-    auto &&head = *(it_imu);
-    auto &&tail = *(it_imu + 1);
+    const ImuSample &head = imu_samples_[k];
+    const ImuSample &tail = imu_samples_[k + 1];
     
-    if (tail->header.stamp.toSec() < last_lidar_end_time_)    continue;
+    if (tail.time < last_lidar_end_time_)    continue;
     
-    angvel_avr<<0.5 * (head->angular_velocity.x + tail->angular_velocity.x),
-                0.5 * (head->angular_velocity.y + tail->angular_velocity.y),
-                0.5 * (head->angular_velocity.z + tail->angular_velocity.z);
-    acc_avr   <<0.5 * (head->linear_acceleration.x + tail->linear_acceleration.x),
-                0.5 * (head->linear_acceleration.y + tail->linear_acceleration.y),
-                0.5 * (head->linear_acceleration.z + tail->linear_acceleration.z);
+    angvel_avr = 0.5 * (head.gyr + tail.gyr);
+    acc_avr    = 0.5 * (head.acc + tail.acc);
 
-    // fout_imu << setw(10) << head->header.stamp.toSec() - first_lidar_time << " " << angvel_avr.transpose() << " " << acc_avr.transpose() << endl;
+    // fout_imu << setw(10) << head.time - first_lidar_time << " " << angvel_avr.transpose() << " " << acc_avr.transpose() << endl;
 
-    acc_avr     = acc_avr * G_m_s2 / mean_acc.norm(); // - state_inout.ba;
+    acc_avr     = acc_avr * acc_scale; // - state_inout.ba;
 
-    if(head->header.stamp.toSec() < last_lidar_end_time_)
+    if(head.time < last_lidar_end_time_)
     {
-      dt = tail->header.stamp.toSec() - last_lidar_end_time_;
-      // dt = tail->header.stamp.toSec() - pcl_beg_time;
+      dt = tail.time - last_lidar_end_time_;
+      // dt = tail.time - pcl_beg_time;
     }
     else
     {
-      dt = tail->header.stamp.toSec() - head->header.stamp.toSec();
+      dt = tail.time - head.time;
     }
     
     in.acc = acc_avr;
     in.gyro = angvel_avr;
-    Q.block<3, 3>(0, 0).diagonal() = cov_gyr;
-    Q.block<3, 3>(3, 3).diagonal() = cov_acc;
-    Q.block<3, 3>(6, 6).diagonal() = cov_bias_gyr;
-    Q.block<3, 3>(9, 9).diagonal() = cov_bias_acc;
     kf_state.predict(dt, Q, in);
 
     /* save the poses at each IMU measurements */
@@ -291,8 +326,8 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf<state_ikf
     {
       acc_s_last[i] += imu_state.grav[i];
     }
-    double &&offs_t = tail->header.stamp.toSec() - pcl_beg_time;
-    IMUpose.push_back(set_pose6d(offs_t, acc_s_last, angvel_last, imu_state.vel, imu_state.pos, imu_state.rot.toRotationMatrix()));
+    key_poses_.push_back({tail.time - pcl_beg_time, acc_s_last, angvel_last, imu_state.vel, imu_state.pos, imu_state.rot.toRotationMatrix()});
+    record_state(imu_state, tail.time);
   }
 
   /*** calculated the pos and attitude prediction at the frame-end ***/
@@ -307,18 +342,21 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf<state_ikf
   /*** undistort each lidar point (backward propagation) ***/
   if (pcl_out.points.begin() == pcl_out.points.end()) return;
 
-  if(lidar_type != MARSIM){
+  if(undistort_parallel){
+      UndistortParallel(imu_state, *(meas.lidar), pcl_out);
+  }
+  else if(lidar_type != MARSIM){
       auto it_pcl = pcl_out.points.end() - 1;
-      for (auto it_kp = IMUpose.end() - 1; it_kp != IMUpose.begin(); it_kp--)
+      for (auto it_kp = key_poses_.end() - 1; it_kp != key_poses_.begin(); it_kp--)
       {
           auto head = it_kp - 1;
           auto tail = it_kp;
-          R_imu<<MAT_FROM_ARRAY(head->rot);
+          R_imu = head->rot;
           // cout<<"head imu acc: "<<acc_imu.transpose()<<endl;
-          vel_imu<<VEC_FROM_ARRAY(head->vel);
-          pos_imu<<VEC_FROM_ARRAY(head->pos);
-          acc_imu<<VEC_FROM_ARRAY(tail->acc);
-          angvel_avr<<VEC_FROM_ARRAY(tail->gyr);
+          vel_imu = head->vel;
+          pos_imu = head->pos;
+          acc_imu = tail->acc;
+          angvel_avr = tail->gyr;
 
           for(; it_pcl->curvature / double(1000) > head->offset_time; it_pcl --)
           {
@@ -345,13 +383,68 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf<state_ikf
   }
 }
 
+void ImuProcess::UndistortParallel(const state_ikfom &imu_state, const PointCloudXYZI &pcl_in, PointCloudXYZI &pcl_out)
+{
+  /*** per interval constants of P_compensate = R_LI^T * (R_e^T * (R_i * (R_LI * P + T_LI) + T_ei) - T_LI) ***/
+  int interval_num = key_poses_.size() - 1;
+  if (interval_num < 1)
+  {
+    pcl_out.points = pcl_in.points;
+    return;
+  }
+  const M3D R_LI(imu_state.offset_R_L_I.toRotationMatrix());
+  const M3D R_back(R_LI.transpose() * imu_state.rot.toRotationMatrix().transpose());
+  const V3D T_back(R_LI.transpose() * imu_state.offset_T_L_I);
+  interval_R_.resize(interval_num);
+  interval_t_.resize(interval_num);
+  interval_v_.resize(interval_num);
+  interval_a_.resize(interval_num);
+  interval_time_.resize(interval_num);
+  for (int k = 0; k < interval_num; k++)
+  {
+    const KeyPose &head = key_poses_[k];
+    const KeyPose &tail = key_poses_[k + 1];
+    interval_time_[k] = head.offset_time;
+    interval_R_[k] = R_back * head.rot;
+    interval_t_[k] = R_back * (head.pos - imu_state.pos) - T_back;
+    interval_v_[k] = R_back * head.vel;
+    interval_a_[k] = 0.5 * R_back * tail.acc;
+  }
+
+  int pcl_num = pcl_in.points.size();
+  #ifdef MP_EN
+    #pragma omp parallel for num_threads(MP_PROC_NUM)
+  #endif
+  for (int i = 0; i < pcl_num; i++)
+  {
+    PointType &point = pcl_out.points[i];
+    point = pcl_in.points[i];
+    double point_time = point.curvature / double(1000);
+    /* the last interval starting strictly before the point, the final interval also covers points past its end */
+    int k = int(lower_bound(interval_time_.begin(), interval_time_.end(), point_time) - interval_time_.begin()) - 1;
+    if (k < 0) continue;
+    double dt = point_time - interval_time_[k];
+
+    /* R_i = R_head * Exp(w * dt), second order small angle expansion; |w * dt| stays within one IMU period */
+    V3D q(R_LI * V3D(point.x, point.y, point.z) + imu_state.offset_T_L_I);
+    V3D theta(key_poses_[k + 1].gyr * dt);
+    V3D theta_q(theta.cross(q));
+    q += theta_q + 0.5 * theta.cross(theta_q);
+
+    V3D P_compensate(interval_R_[k] * q + interval_t_[k] + (interval_v_[k] + interval_a_[k] * dt) * dt);
+    point.x = P_compensate(0);
+    point.y = P_compensate(1);
+    point.z = P_compensate(2);
+  }
+}
+
 void ImuProcess::Process(const MeasureGroup &meas,  esekfom::esekf<state_ikfom, 12, input_ikfom> &kf_state, PointCloudXYZI::Ptr cur_pcl_un_)
 {
   double t1,t2,t3;
   t1 = omp_get_wtime(); //returns a value equal to the elapsed wall clock time in seconds since some time-in-the-past
 
   if(meas.imu.empty()) {return;};
-  ROS_ASSERT(meas.lidar != nullptr);
+  assert(meas.lidar != nullptr);
 
   if (imu_need_init_)
   {
@@ -370,8 +463,8 @@ void ImuProcess::Process(const MeasureGroup &meas,  esekfom::esekf<state_ikfom,
 
       cov_acc = cov_acc_scale;
       cov_gyr = cov_gyr_scale;
-      ROS_INFO("IMU Initial Done");
-      // ROS_INFO("IMU Initial Done: Gravity: %.4f %.4f %.4f %.4f; state.bias_g: %.4f %.4f %.4f; acc covarience: %.8f %.8f %.8f; gry covarience: %.8f %.8f %.8f",\
+      printf("IMU Initial Done\n");
+      // printf("IMU Initial Done: Gravity: %.4f %.4f %.4f %.4f; state.bias_g: %.4f %.4f %.4f; acc covarience: %.8f %.8f %.8f; gry covarience: %.8f %.8f %.8f",\
       //          imu_state.grav[0], imu_state.grav[1], imu_state.grav[2], mean_acc.norm(), cov_bias_gyr[0], cov_bias_gyr[1], cov_bias_gyr[2], cov_acc[0], cov_acc[1], cov_acc[2], cov_gyr[0], cov_gyr[1], cov_gyr[2]);
       fout_imu.open(DEBUG_FILE_DIR("imu.txt"),ios::out);
     }
@@ -34,6 +34,8 @@
 // POSSIBILITY OF SUCH DAMAGE.
 #include <omp.h>
 #include <mutex>
+#include <atomic>
+#include <map>
 #include <math.h>
 #include <thread>
 #include <fstream>
@@ -42,11 +44,12 @@
 #include <Python.h>
 #include <so3_math.h>
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <Eigen/Core>
-#include "IMU_Processing.hpp"
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/Path.h>
 #include <visualization_msgs/Marker.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
@@ -57,25 +60,25 @@
 #include <tf/transform_broadcaster.h>
 #include <geometry_msgs/Vector3.h>
 #include <livox_ros_driver/CustomMsg.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
 #include "preprocess.h"
-#include <ikd-Tree/ikd_Tree.h>
-
-#define INIT_TIME           (0.1)
-#define LASER_POINT_COV     (0.001)
-#define MAXN                (720000)
-#define PUBFRAME_PERIOD     (20)
-
-/*** Time Log Variables ***/
-double kdtree_incremental_time = 0.0, kdtree_search_time = 0.0, kdtree_delete_time = 0.0;
-double T1[MAXN], s_plot[MAXN], s_plot2[MAXN], s_plot3[MAXN], s_plot4[MAXN], s_plot5[MAXN], s_plot6[MAXN], s_plot7[MAXN], s_plot8[MAXN], s_plot9[MAXN], s_plot10[MAXN], s_plot11[MAXN];
-double match_time = 0, solve_time = 0, solve_const_H_time = 0;
-int    kdtree_size_st = 0, kdtree_size_end = 0, add_point_size = 0, kdtree_delete_counter = 0;
-bool   runtime_pos_log = false, pcd_save_en = false, time_sync_en = false, extrinsic_est_en = true, path_en = true;
+#include <lio_core.h>
+#include <bounded_queue.h>
+#include <spsc_queue.h>
+#include <telemetry.h>
+#include <imu_propagator.h>
+#include <ekf_fast_lio2/QueryPose.h>
+
+/*** Telemetry: per-stage latency histograms, exported periodically ***/
+bool   telemetry_en = false;
+double telemetry_period = 1.0;
+int    telemetry_file_kb = 10240;
+shared_ptr<TelemetryLog> telemetry_log;
+
+bool   runtime_pos_log = false, pcd_save_en = false, time_sync_en = false, path_en = true, highrate_odom_en = false;
 /**************************/
 
-float res_last[100000] = {0.0};
-float DET_RANGE = 300.0f;
-const float MOV_THRESHOLD = 1.5f;
 double time_diff_lidar_to_imu = 0.0;
 
 mutex mtx_buffer;
@@ -84,53 +87,72 @@ condition_variable sig_buffer;
 string root_dir = ROOT_DIR;
 string map_file_path, lid_topic, imu_topic;
 
-double res_mean_last = 0.05, total_residual = 0.0;
-double last_timestamp_lidar = 0, last_timestamp_imu = -1.0;
-double gyr_cov = 0.1, acc_cov = 0.1, b_gyr_cov = 0.0001, b_acc_cov = 0.0001;
-double filter_size_corner_min = 0, filter_size_surf_min = 0, filter_size_map_min = 0, fov_deg = 0;
-double cube_len = 0, HALF_FOV_COS = 0, FOV_DEG = 0, total_distance = 0, lidar_end_time = 0, first_lidar_time = 0.0;
-int    effct_feat_num = 0, time_log_counter = 0, scan_count = 0, publish_count = 0;
-int    iterCount = 0, feats_down_size = 0, NUM_MAX_ITERATIONS = 0, laserCloudValidNum = 0, pcd_save_interval = -1, pcd_index = 0;
-bool   point_selected_surf[100000] = {0};
-bool   lidar_pushed, flg_first_scan = true, flg_exit = false, flg_EKF_inited;
+double last_timestamp_lidar = 0;
+atomic<double> last_timestamp_imu(-1.0);
+double filter_size_corner_min = 0;
+double lidar_end_time = 0, first_lidar_time = 0.0;
+int    scan_count = 0;
+int    pcd_save_interval = -1, pcd_index = 0;
+bool   lidar_pushed, flg_exit = false;
 bool   scan_pub_en = false, dense_pub_en = false, scan_body_pub_en = false;
 int lidar_type;
 
-vector<vector<int>>  pointSearchInd_surf; 
-vector<BoxPointType> cub_needrm;
-vector<PointVector>  Nearest_Points; 
 vector<double>       extrinT(3, 0.0);
 vector<double>       extrinR(9, 0.0);
-deque<double>                     time_buffer;
-deque<PointCloudXYZI::Ptr>        lidar_buffer;
-deque<sensor_msgs::Imu::ConstPtr> imu_buffer;
 
-PointCloudXYZI::Ptr featsFromMap(new PointCloudXYZI());
-PointCloudXYZI::Ptr feats_undistort(new PointCloudXYZI());
-PointCloudXYZI::Ptr feats_down_body(new PointCloudXYZI());
-PointCloudXYZI::Ptr feats_down_world(new PointCloudXYZI());
-PointCloudXYZI::Ptr normvec(new PointCloudXYZI(100000, 1));
-PointCloudXYZI::Ptr laserCloudOri(new PointCloudXYZI(100000, 1));
-PointCloudXYZI::Ptr corr_normvect(new PointCloudXYZI(100000, 1));
-PointCloudXYZI::Ptr _featsArray;
+/*** saved map: written to map_file_path after mapping, or localized against ***/
+bool                 localization_en = false;
+vector<double>       init_pos(3, 0.0);
+vector<double>       init_rpy(3, 0.0);
 
-pcl::VoxelGrid<PointType> downSizeFilterSurf;
-pcl::VoxelGrid<PointType> downSizeFilterMap;
+/*** callback -> main loop, one producer per stream; mtx_buffer is only held to wake the main loop ***/
+struct LidarFrame
+{
+    double              time;
+    PointCloudXYZI::Ptr cloud;
+};
+SpscQueue<LidarFrame> lidar_buffer(256);
+SpscQueue<ImuSample>  imu_buffer(8192);
+
+/*** lidar callback -> preprocessing workers -> in-order delivery to lidar_buffer ***/
+struct ScanTask
+{
+    uint64_t                              seq;
+    double                                time;
+    bool                                  loop_back;   // discard the scans delivered before this one
+    sensor_msgs::PointCloud2::ConstPtr    msg;
+    livox_ros_driver::CustomMsg::ConstPtr livox_msg;
+};
+
+struct PreprocessedScan
+{
+    bool       loop_back;
+    LidarFrame frame;
+};
+
+int preprocess_thread_num = 2;
+BoundedQueue<ScanTask>         preprocess_queue(16);
+vector<shared_ptr<Preprocess>> preprocessors;       // one per worker, Preprocess keeps per-scan buffers
+atomic<uint64_t>               scan_seq(0);
+mutex                          mtx_reorder;
+map<uint64_t, PreprocessedScan> reorder_buffer;     // finished scans waiting for an older one
+atomic<uint64_t>               deliver_seq(0);     // scans pushed to lidar_buffer or dropped, read by the replay
+
+/*** offline replay: a bag is fed straight into the callbacks, paced by the mapping loop only ***/
+const int        REPLAY_SCANS_AHEAD = 8;
+string           replay_bag_file;
+atomic<uint64_t> scans_synced(0);
+atomic<bool>     replay_finished(false);
 
-KD_TREE<PointType> ikdtree;
+PointCloudXYZI::Ptr featsFromMap(new PointCloudXYZI());
 
-V3F XAxisPoint_body(LIDAR_SP_LEN, 0.0, 0.0);
-V3F XAxisPoint_world(LIDAR_SP_LEN, 0.0, 0.0);
 V3D euler_cur;
-V3D position_last(Zero3d);
-V3D Lidar_T_wrt_IMU(Zero3d);
-M3D Lidar_R_wrt_IMU(Eye3d);
 
-/*** EKF inputs and output ***/
+/*** LIO inputs and output ***/
 MeasureGroup Measures;
-esekfom::esekf<state_ikfom, 12, input_ikfom> kf;
+LioParams lio_params;
+shared_ptr<LioCore> lio;
 state_ikfom state_point;
-vect3 pos_lid;
 
 nav_msgs::Path path;
 nav_msgs::Odometry odomAftMapped;
@@ -138,7 +160,24 @@ geometry_msgs::Quaternion geoQuat;
 geometry_msgs::PoseStamped msg_body_pose;
 
 shared_ptr<Preprocess> p_pre(new Preprocess());
-shared_ptr<ImuProcess> p_imu(new ImuProcess());
+shared_ptr<TrajectoryBuffer> trajectory_buffer;
+
+/*** /Odometry_highrate: the latest posterior integrated forward at every IMU sample ***/
+ImuPropagator   imu_propagator(2000);
+ros::Publisher  pubOdomHighRate;
+
+/*** Pipeline stages: registration (main thread) -> map update (inside LioCore) -> output ***/
+struct ScanOutput
+{
+    PointCloudXYZI::Ptr  feats_undistort;
+    PointCloudXYZI::Ptr  feats_down_body;
+    PointCloudXYZI::Ptr  map_points;
+    state_ikfom          state;
+    geometry_msgs::Quaternion quat;
+    double               lidar_end_time;
+};
+
+BoundedQueue<ScanOutput>    output_queue(4);
 
 void SigHandle(int sig)
 {
@@ -163,18 +202,6 @@ inline void dump_lio_state_to_log(FILE *fp)
     fflush(fp);
 }
 
-void pointBodyToWorld_ikfom(PointType const * const pi, PointType * const po, state_ikfom &s)
-{
-    V3D p_body(pi->x, pi->y, pi->z);
-    V3D p_global(s.rot * (s.offset_R_L_I*p_body + s.offset_T_L_I) + s.pos);
-
-    po->x = p_global(0);
-    po->y = p_global(1);
-    po->z = p_global(2);
-    po->intensity = pi->intensity;
-}
-
-
 void pointBodyToWorld(PointType const * const pi, PointType * const po)
 {
     V3D p_body(pi->x, pi->y, pi->z);
@@ -197,10 +224,10 @@ void pointBodyToWorld(const Matrix<T, 3, 1> &pi, Matrix<T, 3, 1> &po)
     po[2] = p_global(2);
 }
 
-void RGBpointBodyToWorld(PointType const * const pi, PointType * const po)
+void RGBpointBodyToWorld(PointType const * const pi, PointType * const po, const state_ikfom &s)
 {
     V3D p_body(pi->x, pi->y, pi->z);
-    V3D p_global(state_point.rot * (state_point.offset_R_L_I*p_body + state_point.offset_T_L_I) + state_point.pos);
+    V3D p_global(s.rot * (s.offset_R_L_I*p_body + s.offset_T_L_I) + s.pos);
 
     po->x = p_global(0);
     po->y = p_global(1);
@@ -208,174 +235,254 @@ void RGBpointBodyToWorld(PointType const * const pi, PointType * const po)
     po->intensity = pi->intensity;
 }
 
-void RGBpointBodyLidarToIMU(PointType const * const pi, PointType * const po)
+void notify_buffer()
 {
-    V3D p_body_lidar(pi->x, pi->y, pi->z);
-    V3D p_body_imu(state_point.offset_R_L_I*p_body_lidar + state_point.offset_T_L_I);
-
-    po->x = p_body_imu(0);
-    po->y = p_body_imu(1);
-    po->z = p_body_imu(2);
-    po->intensity = pi->intensity;
+    // the empty critical section orders the push before the main loop's predicate check
+    { lock_guard<mutex> lock(mtx_buffer); }
+    sig_buffer.notify_all();
 }
 
-void points_cache_collect()
+void push_lidar(double time, const PointCloudXYZI::Ptr &cloud)
 {
-    PointVector points_history;
-    ikdtree.acquire_removed_points(points_history);
-    // for (int i = 0; i < points_history.size(); i++) _featsArray->push_back(points_history[i]);
+    if (!lidar_buffer.push(LidarFrame{time, cloud}))
+        ROS_WARN("lidar buffer full, drop scan at %lf", time);
 }
 
-BoxPointType LocalMap_Points;
-bool Localmap_Initialized = false;
-void lasermap_fov_segment()
+/* called by the worker that finished a scan, releases every scan that is next in order */
+void deliver_scan(const ScanTask &task, const PointCloudXYZI::Ptr &cloud)
 {
-    cub_needrm.clear();
-    kdtree_delete_counter = 0;
-    kdtree_delete_time = 0.0;    
-    pointBodyToWorld(XAxisPoint_body, XAxisPoint_world);
-    V3D pos_LiD = pos_lid;
-    if (!Localmap_Initialized){
-        for (int i = 0; i < 3; i++){
-            LocalMap_Points.vertex_min[i] = pos_LiD(i) - cube_len / 2.0;
-            LocalMap_Points.vertex_max[i] = pos_LiD(i) + cube_len / 2.0;
-        }
-        Localmap_Initialized = true;
-        return;
-    }
-    float dist_to_map_edge[3][2];
-    bool need_move = false;
-    for (int i = 0; i < 3; i++){
-        dist_to_map_edge[i][0] = fabs(pos_LiD(i) - LocalMap_Points.vertex_min[i]);
-        dist_to_map_edge[i][1] = fabs(pos_LiD(i) - LocalMap_Points.vertex_max[i]);
-        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE || dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE) need_move = true;
+    lock_guard<mutex> lock(mtx_reorder);
+    reorder_buffer[task.seq] = PreprocessedScan{task.loop_back, LidarFrame{task.time, cloud}};
+    // holding mtx_reorder makes this worker the single producer of lidar_buffer
+    auto it = reorder_buffer.begin();
+    while (it != reorder_buffer.end() && it->first == deliver_seq)
+    {
+        if (it->second.loop_back) lidar_buffer.reset();
+        push_lidar(it->second.frame.time, it->second.frame.cloud);
+        it = reorder_buffer.erase(it);
+        deliver_seq ++;
     }
-    if (!need_move) return;
-    BoxPointType New_LocalMap_Points, tmp_boxpoints;
-    New_LocalMap_Points = LocalMap_Points;
-    float mov_dist = max((cube_len - 2.0 * MOV_THRESHOLD * DET_RANGE) * 0.5 * 0.9, double(DET_RANGE * (MOV_THRESHOLD -1)));
-    for (int i = 0; i < 3; i++){
-        tmp_boxpoints = LocalMap_Points;
-        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE){
-            New_LocalMap_Points.vertex_max[i] -= mov_dist;
-            New_LocalMap_Points.vertex_min[i] -= mov_dist;
-            tmp_boxpoints.vertex_min[i] = LocalMap_Points.vertex_max[i] - mov_dist;
-            cub_needrm.push_back(tmp_boxpoints);
-        } else if (dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE){
-            New_LocalMap_Points.vertex_max[i] += mov_dist;
-            New_LocalMap_Points.vertex_min[i] += mov_dist;
-            tmp_boxpoints.vertex_max[i] = LocalMap_Points.vertex_min[i] + mov_dist;
-            cub_needrm.push_back(tmp_boxpoints);
+    // after deliver_seq: a dropped scan has to release the replay as well
+    notify_buffer();
+}
+
+void preprocess_loop(int id)
+{
+    Preprocess &pre = *preprocessors[id];
+    ScanTask task;
+    while (preprocess_queue.pop(task))
+    {
+        PointCloudXYZI::Ptr  ptr(new PointCloudXYZI());
+        {
+            TelemetryScope span(TS_PREPROCESS);
+            if (task.livox_msg) pre.process(task.livox_msg, ptr);
+            else pre.process(task.msg, ptr);
         }
+        deliver_scan(task, ptr);
+        preprocess_queue.task_done();
     }
-    LocalMap_Points = New_LocalMap_Points;
+}
 
-    points_cache_collect();
-    double delete_begin = omp_get_wtime();
-    if(cub_needrm.size() > 0) kdtree_delete_counter = ikdtree.Delete_Point_Boxes(cub_needrm);
-    kdtree_delete_time = omp_get_wtime() - delete_begin;
+/* hands a scan to the worker pool; blocks the lidar callback only while all workers are busy and the queue is full */
+void submit_scan(ScanTask &task)
+{
+    task.seq = scan_seq ++;
+    preprocess_queue.push(task);
 }
 
 void standard_pcl_cbk(const sensor_msgs::PointCloud2::ConstPtr &msg) 
 {
-    mtx_buffer.lock();
     scan_count ++;
-    double preprocess_start_time = omp_get_wtime();
+    ScanTask task;
+    task.loop_back = false;
     if (msg->header.stamp.toSec() < last_timestamp_lidar)
     {
         ROS_ERROR("lidar loop back, clear buffer");
-        lidar_buffer.clear();
+        task.loop_back = true;
     }
 
-    PointCloudXYZI::Ptr  ptr(new PointCloudXYZI());
-    p_pre->process(msg, ptr);
-    lidar_buffer.push_back(ptr);
-    time_buffer.push_back(msg->header.stamp.toSec());
     last_timestamp_lidar = msg->header.stamp.toSec();
-    s_plot11[scan_count] = omp_get_wtime() - preprocess_start_time;
-    mtx_buffer.unlock();
-    sig_buffer.notify_all();
+    task.time = last_timestamp_lidar;
+    task.msg = msg;
+    submit_scan(task);
 }
 
-double timediff_lidar_wrt_imu = 0.0;
+atomic<double> timediff_lidar_wrt_imu(0.0);   // written by the lidar callback, read by the imu callback
 bool   timediff_set_flg = false;
 void livox_pcl_cbk(const livox_ros_driver::CustomMsg::ConstPtr &msg) 
 {
-    mtx_buffer.lock();
-    double preprocess_start_time = omp_get_wtime();
     scan_count ++;
+    ScanTask task;
+    task.loop_back = false;
     if (msg->header.stamp.toSec() < last_timestamp_lidar)
     {
         ROS_ERROR("lidar loop back, clear buffer");
-        lidar_buffer.clear();
+        task.loop_back = true;
     }
     last_timestamp_lidar = msg->header.stamp.toSec();
     
     if (!time_sync_en && abs(last_timestamp_imu - last_timestamp_lidar) > 10.0 && !imu_buffer.empty() && !lidar_buffer.empty() )
     {
-        printf("IMU and LiDAR not Synced, IMU time: %lf, lidar header time: %lf \n",last_timestamp_imu, last_timestamp_lidar);
+        printf("IMU and LiDAR not Synced, IMU time: %lf, lidar header time: %lf \n",last_timestamp_imu.load(), last_timestamp_lidar);
     }
 
     if (time_sync_en && !timediff_set_flg && abs(last_timestamp_lidar - last_timestamp_imu) > 1 && !imu_buffer.empty())
     {
         timediff_set_flg = true;
         timediff_lidar_wrt_imu = last_timestamp_lidar + 0.1 - last_timestamp_imu;
-        printf("Self sync IMU and LiDAR, time diff is %.10lf \n", timediff_lidar_wrt_imu);
+        printf("Self sync IMU and LiDAR, time diff is %.10lf \n", timediff_lidar_wrt_imu.load());
     }
 
-    PointCloudXYZI::Ptr  ptr(new PointCloudXYZI());
-    p_pre->process(msg, ptr);
-    lidar_buffer.push_back(ptr);
-    time_buffer.push_back(last_timestamp_lidar);
-    
-    s_plot11[scan_count] = omp_get_wtime() - preprocess_start_time;
-    mtx_buffer.unlock();
-    sig_buffer.notify_all();
+    task.time = last_timestamp_lidar;
+    task.livox_msg = msg;
+    submit_scan(task);
+}
+
+void trajectory_to_odometry(const TrajectoryPoint &point, nav_msgs::Odometry &odom)
+{
+    odom.header.frame_id = "camera_init";
+    odom.child_frame_id = "body";
+    odom.header.stamp = ros::Time().fromSec(point.time);
+    odom.pose.pose.position.x = point.pos(0);
+    odom.pose.pose.position.y = point.pos(1);
+    odom.pose.pose.position.z = point.pos(2);
+    odom.pose.pose.orientation.x = point.rot.x();
+    odom.pose.pose.orientation.y = point.rot.y();
+    odom.pose.pose.orientation.z = point.rot.z();
+    odom.pose.pose.orientation.w = point.rot.w();
+    /* twist in the body frame */
+    V3D vel_body(point.rot.conjugate() * point.vel);
+    odom.twist.twist.linear.x = vel_body(0);
+    odom.twist.twist.linear.y = vel_body(1);
+    odom.twist.twist.linear.z = vel_body(2);
+    odom.twist.twist.angular.x = point.gyr(0);
+    odom.twist.twist.angular.y = point.gyr(1);
+    odom.twist.twist.angular.z = point.gyr(2);
 }
 
 void imu_cbk(const sensor_msgs::Imu::ConstPtr &msg_in) 
 {
-    publish_count ++;
     // cout<<"IMU got at: "<<msg_in->header.stamp.toSec()<<endl;
-    sensor_msgs::Imu::Ptr msg(new sensor_msgs::Imu(*msg_in));
-
-    msg->header.stamp = ros::Time().fromSec(msg_in->header.stamp.toSec() - time_diff_lidar_to_imu);
-    if (abs(timediff_lidar_wrt_imu) > 0.1 && time_sync_en)
+    ImuSample sample;
+    sample.time = msg_in->header.stamp.toSec() - time_diff_lidar_to_imu;
+    const double timediff = timediff_lidar_wrt_imu;
+    if (abs(timediff) > 0.1 && time_sync_en)
     {
-        msg->header.stamp = \
-        ros::Time().fromSec(timediff_lidar_wrt_imu + msg_in->header.stamp.toSec());
+        sample.time = timediff + msg_in->header.stamp.toSec();
     }
+    sample.acc << msg_in->linear_acceleration.x, msg_in->linear_acceleration.y, msg_in->linear_acceleration.z;
+    sample.gyr << msg_in->angular_velocity.x, msg_in->angular_velocity.y, msg_in->angular_velocity.z;
 
-    double timestamp = msg->header.stamp.toSec();
-
-    mtx_buffer.lock();
+    double timestamp = sample.time;
 
     if (timestamp < last_timestamp_imu)
     {
         ROS_WARN("imu loop back, clear buffer");
-        imu_buffer.clear();
+        imu_buffer.reset();
+        imu_propagator.clear();
     }
 
+    if (!imu_buffer.push(sample))
+    {
+        ROS_WARN("imu buffer full, drop imu at %lf", timestamp);
+        return;
+    }
+    // published after the push: every sample up to last_timestamp_imu is in the buffer
     last_timestamp_imu = timestamp;
+    notify_buffer();
 
-    imu_buffer.push_back(msg);
-    mtx_buffer.unlock();
-    sig_buffer.notify_all();
+    TrajectoryPoint point;
+    if (highrate_odom_en && imu_propagator.add(sample, point))
+    {
+        nav_msgs::Odometry odom;
+        trajectory_to_odometry(point, odom);
+        pubOdomHighRate.publish(odom);
+    }
+}
+
+/*
+ * Scans submitted and not yet taken off lidar_buffer: still preprocessing, or in the ring. Scans
+ * dropped on a full ring or skipped after a loop back leave the backlog like synced ones.
+ */
+uint64_t replay_backlog()
+{
+    return scan_seq - deliver_seq + lidar_buffer.size();
+}
+
+/*
+ * Feeds every lidar and imu message of the bag, in bag order, to the same callbacks as the
+ * live node. Only REPLAY_SCANS_AHEAD scans are let ahead of the mapping loop so nothing is
+ * dropped; the result only depends on the message content, not on the replay speed.
+ */
+void replay_loop()
+{
+    rosbag::Bag bag;
+    try
+    {
+        bag.open(replay_bag_file, rosbag::bagmode::Read);
+        rosbag::View view(bag, rosbag::TopicQuery(vector<string>{lid_topic, imu_topic}));
+        for (const rosbag::MessageInstance &m : view)
+        {
+            if (flg_exit) break;
+            if (m.getTopic() == imu_topic)
+            {
+                sensor_msgs::Imu::ConstPtr imu = m.instantiate<sensor_msgs::Imu>();
+                if (imu != nullptr) imu_cbk(imu);
+                continue;
+            }
+
+            {
+                unique_lock<mutex> lock(mtx_buffer);
+                sig_buffer.wait(lock, []{ return flg_exit || replay_backlog() < REPLAY_SCANS_AHEAD; });
+            }
+            if (p_pre->lidar_type == AVIA)
+            {
+                livox_ros_driver::CustomMsg::ConstPtr msg = m.instantiate<livox_ros_driver::CustomMsg>();
+                if (msg != nullptr) livox_pcl_cbk(msg);
+            }
+            else
+            {
+                sensor_msgs::PointCloud2::ConstPtr msg = m.instantiate<sensor_msgs::PointCloud2>();
+                if (msg != nullptr) standard_pcl_cbk(msg);
+            }
+        }
+        bag.close();
+    }
+    catch (rosbag::BagException &e)
+    {
+        ROS_ERROR("replay of %s failed: %s", replay_bag_file.c_str(), e.what());
+    }
+
+    /* every scan has reached lidar_buffer before the mapping loop is told the replay is over */
+    preprocess_queue.wait_idle();
+    replay_finished = true;
+    notify_buffer();
+}
+
+/* whether sync_packages may complete a package; changes no state, the main loop waits on it */
+bool package_ready()
+{
+    if (lidar_pushed) return last_timestamp_imu >= lidar_end_time;
+    return !lidar_buffer.empty() && !imu_buffer.empty();
 }
 
 double lidar_mean_scantime = 0.0;
 int    scan_num = 0;
 bool sync_packages(MeasureGroup &meas)
 {
-    if (lidar_buffer.empty() || imu_buffer.empty()) {
+    LidarFrame *frame = lidar_buffer.front();
+    if (frame == nullptr || imu_buffer.front() == nullptr) {
         return false;
     }
 
+    /* a loop back reset the buffer since the scan was pushed: the front is another scan now */
+    if (lidar_pushed && frame->cloud != meas.lidar) lidar_pushed = false;
+
     /*** push a lidar scan ***/
     if(!lidar_pushed)
     {
-        meas.lidar = lidar_buffer.front();
-        meas.lidar_beg_time = time_buffer.front();
+        meas.lidar = frame->cloud;
+        meas.lidar_beg_time = frame->time;
 
 
         if (meas.lidar->points.size() <= 1) // time too little
@@ -407,95 +514,98 @@ bool sync_packages(MeasureGroup &meas)
     }
 
     /*** push imu data, and pop from imu buffer ***/
-    double imu_time = imu_buffer.front()->header.stamp.toSec();
     meas.imu.clear();
-    while ((!imu_buffer.empty()) && (imu_time < lidar_end_time))
+    ImuSample *imu;
+    while ((imu = imu_buffer.front()) != nullptr)
     {
-        imu_time = imu_buffer.front()->header.stamp.toSec();
+        double imu_time = imu->time;
         if(imu_time > lidar_end_time) break;
-        meas.imu.push_back(imu_buffer.front());
-        imu_buffer.pop_front();
+        meas.imu.push_back(*imu);
+        imu_buffer.pop();
+        if(imu_time == lidar_end_time) break;
     }
 
-    lidar_buffer.pop_front();
-    time_buffer.pop_front();
+    lidar_buffer.pop();
+    scans_synced ++;
     lidar_pushed = false;
     return true;
 }
 
-int process_increments = 0;
-void map_incremental()
+/*
+ * One diagnostic status per stage with samples in the period, and one for the gauges. The
+ * registration turns WARN once its p99 exceeds the scan period, the node falls behind then.
+ */
+void publish_telemetry(const ros::Publisher &pubDiagnostics)
 {
-    PointVector PointToAdd;
-    PointVector PointNoNeedDownsample;
-    PointToAdd.reserve(feats_down_size);
-    PointNoNeedDownsample.reserve(feats_down_size);
-    for (int i = 0; i < feats_down_size; i++)
+    TelemetrySnapshot snap;
+    Telemetry::snapshot(snap);
+    double stamp = ros::Time::now().toSec();
+    if (telemetry_log) telemetry_log->write(snap, stamp);
+
+    diagnostic_msgs::DiagnosticArray diag;
+    diag.header.stamp = ros::Time().fromSec(stamp);
+    char value[32];
+    for (int i = 0; i < TS_NUM; i++)
     {
-        /* transform to world frame */
-        pointBodyToWorld(&(feats_down_body->points[i]), &(feats_down_world->points[i]));
-        /* decide if need add to map */
-        if (!Nearest_Points[i].empty() && flg_EKF_inited)
+        const StageSummary &s = snap.stages[i];
+        if (s.count == 0) continue;
+        diagnostic_msgs::DiagnosticStatus status;
+        status.name = string("fastlio_mapping: ") + s.name;
+        status.hardware_id = "fastlio_mapping";
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.message = "ok";
+        if (i == TS_REGISTRATION && s.p99 > 1.0 / p_pre->SCAN_RATE)
         {
-            const PointVector &points_near = Nearest_Points[i];
-            bool need_add = true;
-            BoxPointType Box_of_Point;
-            PointType downsample_result, mid_point; 
-            mid_point.x = floor(feats_down_world->points[i].x/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
-            mid_point.y = floor(feats_down_world->points[i].y/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
-            mid_point.z = floor(feats_down_world->points[i].z/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
-            float dist  = calc_dist(feats_down_world->points[i],mid_point);
-            if (fabs(points_near[0].x - mid_point.x) > 0.5 * filter_size_map_min && fabs(points_near[0].y - mid_point.y) > 0.5 * filter_size_map_min && fabs(points_near[0].z - mid_point.z) > 0.5 * filter_size_map_min){
-                PointNoNeedDownsample.push_back(feats_down_world->points[i]);
-                continue;
-            }
-            for (int readd_i = 0; readd_i < NUM_MATCH_POINTS; readd_i ++)
-            {
-                if (points_near.size() < NUM_MATCH_POINTS) break;
-                if (calc_dist(points_near[readd_i], mid_point) < dist)
-                {
-                    need_add = false;
-                    break;
-                }
-            }
-            if (need_add) PointToAdd.push_back(feats_down_world->points[i]);
+            status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+            status.message = "p99 above the scan period";
         }
-        else
+        const pair<const char *, double> fields[] = {{"rate_hz", s.count / snap.period}, {"p50_ms", s.p50 * 1e3},
+                                                     {"p99_ms", s.p99 * 1e3}, {"max_ms", s.max * 1e3}, {"mean_ms", s.mean * 1e3}};
+        for (const auto &f : fields)
         {
-            PointToAdd.push_back(feats_down_world->points[i]);
+            diagnostic_msgs::KeyValue kv;
+            kv.key = f.first;
+            snprintf(value, sizeof(value), "%.3f", f.second);
+            kv.value = value;
+            status.values.push_back(kv);
         }
+        diag.status.push_back(status);
     }
 
-    double st_time = omp_get_wtime();
-    add_point_size = ikdtree.Add_Points(PointToAdd, true);
-    ikdtree.Add_Points(PointNoNeedDownsample, false); 
-    add_point_size = PointToAdd.size() + PointNoNeedDownsample.size();
-    kdtree_incremental_time = omp_get_wtime() - st_time;
+    diagnostic_msgs::DiagnosticStatus gauges;
+    gauges.name = "fastlio_mapping: sizes";
+    gauges.hardware_id = "fastlio_mapping";
+    gauges.level = diagnostic_msgs::DiagnosticStatus::OK;
+    gauges.message = "ok";
+    for (int i = 0; i < TG_NUM; i++)
+    {
+        diagnostic_msgs::KeyValue kv;
+        kv.key = snap.gauge_names[i];
+        snprintf(value, sizeof(value), "%.0f", snap.gauges[i]);
+        kv.value = value;
+        gauges.values.push_back(kv);
+    }
+    diag.status.push_back(gauges);
+    pubDiagnostics.publish(diag);
 }
 
 PointCloudXYZI::Ptr pcl_wait_pub(new PointCloudXYZI(500000, 1));
 PointCloudXYZI::Ptr pcl_wait_save(new PointCloudXYZI());
-void publish_frame_world(const ros::Publisher & pubLaserCloudFull)
+void publish_frame_world(const ros::Publisher & pubLaserCloudFull, const ScanOutput &scan)
 {
     if(scan_pub_en)
     {
-        PointCloudXYZI::Ptr laserCloudFullRes(dense_pub_en ? feats_undistort : feats_down_body);
+        PointCloudXYZI::Ptr laserCloudFullRes(dense_pub_en ? scan.feats_undistort : scan.feats_down_body);
         int size = laserCloudFullRes->points.size();
         PointCloudXYZI::Ptr laserCloudWorld( \
                         new PointCloudXYZI(size, 1));
-
-        for (int i = 0; i < size; i++)
-        {
-            RGBpointBodyToWorld(&laserCloudFullRes->points[i], \
-                                &laserCloudWorld->points[i]);
-        }
+        transform_points(body_to_world_transform(scan.state), laserCloudFullRes->points.data(), laserCloudWorld->points.data(), size);
 
         sensor_msgs::PointCloud2 laserCloudmsg;
         pcl::toROSMsg(*laserCloudWorld, laserCloudmsg);
-        laserCloudmsg.header.stamp = ros::Time().fromSec(lidar_end_time);
+        laserCloudmsg.header.stamp = ros::Time().fromSec(scan.lidar_end_time);
         laserCloudmsg.header.frame_id = "camera_init";
         pubLaserCloudFull.publish(laserCloudmsg);
-        publish_count -= PUBFRAME_PERIOD;
     }
 
     /**************** save map ****************/
@@ -503,15 +613,10 @@ void publish_frame_world(const ros::Publisher & pubLaserCloudFull)
     /* 2. noted that pcd save will influence the real-time performences **/
     if (pcd_save_en)
     {
-        int size = feats_undistort->points.size();
+        int size = scan.feats_undistort->points.size();
         PointCloudXYZI::Ptr laserCloudWorld( \
                         new PointCloudXYZI(size, 1));
-
-        for (int i = 0; i < size; i++)
-        {
-            RGBpointBodyToWorld(&feats_undistort->points[i], \
-                                &laserCloudWorld->points[i]);
-        }
+        transform_points(body_to_world_transform(scan.state), scan.feats_undistort->points.data(), laserCloudWorld->points.data(), size);
         *pcl_wait_save += *laserCloudWorld;
 
         static int scan_wait_num = 0;
@@ -529,60 +634,38 @@ void publish_frame_world(const ros::Publisher & pubLaserCloudFull)
     }
 }
 
-void publish_frame_body(const ros::Publisher & pubLaserCloudFull_body)
+void publish_frame_body(const ros::Publisher & pubLaserCloudFull_body, const ScanOutput &scan)
 {
-    int size = feats_undistort->points.size();
+    int size = scan.feats_undistort->points.size();
     PointCloudXYZI::Ptr laserCloudIMUBody(new PointCloudXYZI(size, 1));
-
-    for (int i = 0; i < size; i++)
-    {
-        RGBpointBodyLidarToIMU(&feats_undistort->points[i], \
-                            &laserCloudIMUBody->points[i]);
-    }
+    transform_points(lidar_to_imu_transform(scan.state), scan.feats_undistort->points.data(), laserCloudIMUBody->points.data(), size);
 
     sensor_msgs::PointCloud2 laserCloudmsg;
     pcl::toROSMsg(*laserCloudIMUBody, laserCloudmsg);
-    laserCloudmsg.header.stamp = ros::Time().fromSec(lidar_end_time);
+    laserCloudmsg.header.stamp = ros::Time().fromSec(scan.lidar_end_time);
     laserCloudmsg.header.frame_id = "body";
     pubLaserCloudFull_body.publish(laserCloudmsg);
-    publish_count -= PUBFRAME_PERIOD;
 }
 
-void publish_effect_world(const ros::Publisher & pubLaserCloudEffect)
-{
-    PointCloudXYZI::Ptr laserCloudWorld( \
-                    new PointCloudXYZI(effct_feat_num, 1));
-    for (int i = 0; i < effct_feat_num; i++)
-    {
-        RGBpointBodyToWorld(&laserCloudOri->points[i], \
-                            &laserCloudWorld->points[i]);
-    }
-    sensor_msgs::PointCloud2 laserCloudFullRes3;
-    pcl::toROSMsg(*laserCloudWorld, laserCloudFullRes3);
-    laserCloudFullRes3.header.stamp = ros::Time().fromSec(lidar_end_time);
-    laserCloudFullRes3.header.frame_id = "camera_init";
-    pubLaserCloudEffect.publish(laserCloudFullRes3);
-}
-
-void publish_map(const ros::Publisher & pubLaserCloudMap)
+void publish_map(const ros::Publisher & pubLaserCloudMap, const ScanOutput &scan)
 {
     sensor_msgs::PointCloud2 laserCloudMap;
-    pcl::toROSMsg(*featsFromMap, laserCloudMap);
-    laserCloudMap.header.stamp = ros::Time().fromSec(lidar_end_time);
+    pcl::toROSMsg(scan.map_points ? *scan.map_points : *featsFromMap, laserCloudMap);
+    laserCloudMap.header.stamp = ros::Time().fromSec(scan.lidar_end_time);
     laserCloudMap.header.frame_id = "camera_init";
     pubLaserCloudMap.publish(laserCloudMap);
 }
 
 template<typename T>
-void set_posestamp(T & out)
+void set_posestamp(T & out, const state_ikfom &s, const geometry_msgs::Quaternion &q)
 {
-    out.pose.position.x = state_point.pos(0);
-    out.pose.position.y = state_point.pos(1);
-    out.pose.position.z = state_point.pos(2);
-    out.pose.orientation.x = geoQuat.x;
-    out.pose.orientation.y = geoQuat.y;
-    out.pose.orientation.z = geoQuat.z;
-    out.pose.orientation.w = geoQuat.w;
+    out.pose.position.x = s.pos(0);
+    out.pose.position.y = s.pos(1);
+    out.pose.position.z = s.pos(2);
+    out.pose.orientation.x = q.x;
+    out.pose.orientation.y = q.y;
+    out.pose.orientation.z = q.z;
+    out.pose.orientation.w = q.w;
     
 }
 
@@ -591,9 +674,9 @@ void publish_odometry(const ros::Publisher & pubOdomAftMapped)
     odomAftMapped.header.frame_id = "camera_init";
     odomAftMapped.child_frame_id = "body";
     odomAftMapped.header.stamp = ros::Time().fromSec(lidar_end_time);// ros::Time().fromSec(lidar_end_time);
-    set_posestamp(odomAftMapped.pose);
+    set_posestamp(odomAftMapped.pose, state_point, geoQuat);
     pubOdomAftMapped.publish(odomAftMapped);
-    auto P = kf.get_P();
+    auto P = lio->covariance();
     for (int i = 0; i < 6; i ++)
     {
         int k = i < 3 ? i + 3 : i - 3;
@@ -619,10 +702,18 @@ void publish_odometry(const ros::Publisher & pubOdomAftMapped)
     br.sendTransform( tf::StampedTransform( transform, odomAftMapped.header.stamp, "camera_init", "body" ) );
 }
 
-void publish_path(const ros::Publisher pubPath)
+bool query_pose_srv(ekf_fast_lio2::QueryPose::Request &req, ekf_fast_lio2::QueryPose::Response &res)
+{
+    TrajectoryPoint point;
+    res.success = trajectory_buffer->query(req.stamp, point);
+    if (res.success) trajectory_to_odometry(point, res.odometry);
+    return true;
+}
+
+void publish_path(const ros::Publisher pubPath, const ScanOutput &scan)
 {
-    set_posestamp(msg_body_pose);
-    msg_body_pose.header.stamp = ros::Time().fromSec(lidar_end_time);
+    set_posestamp(msg_body_pose, scan.state, scan.quat);
+    msg_body_pose.header.stamp = ros::Time().fromSec(scan.lidar_end_time);
     msg_body_pose.header.frame_id = "camera_init";
 
     /*** if path is too large, the rvis will crash ***/
@@ -635,122 +726,17 @@ void publish_path(const ros::Publisher pubPath)
     }
 }
 
-void h_share_model(state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data)
+void output_loop(ros::Publisher pubLaserCloudFull, ros::Publisher pubLaserCloudFull_body, ros::Publisher pubLaserCloudMap, ros::Publisher pubPath)
 {
-    double match_start = omp_get_wtime();
-    laserCloudOri->clear(); 
-    corr_normvect->clear(); 
-    total_residual = 0.0; 
-
-    /** closest surface search and residual computation **/
-    #ifdef MP_EN
-        omp_set_num_threads(MP_PROC_NUM);
-        #pragma omp parallel for
-    #endif
-    for (int i = 0; i < feats_down_size; i++)
-    {
-        PointType &point_body  = feats_down_body->points[i]; 
-        PointType &point_world = feats_down_world->points[i]; 
-
-        /* transform to world frame */
-        V3D p_body(point_body.x, point_body.y, point_body.z);
-        V3D p_global(s.rot * (s.offset_R_L_I*p_body + s.offset_T_L_I) + s.pos);
-        point_world.x = p_global(0);
-        point_world.y = p_global(1);
-        point_world.z = p_global(2);
-        point_world.intensity = point_body.intensity;
-
-        vector<float> pointSearchSqDis(NUM_MATCH_POINTS);
-
-        auto &points_near = Nearest_Points[i];
-
-        if (ekfom_data.converge)
-        {
-            /** Find the closest surfaces in the map **/
-            ikdtree.Nearest_Search(point_world, NUM_MATCH_POINTS, points_near, pointSearchSqDis);
-            point_selected_surf[i] = points_near.size() < NUM_MATCH_POINTS ? false : pointSearchSqDis[NUM_MATCH_POINTS - 1] > 5 ? false : true;
-        }
-
-        if (!point_selected_surf[i]) continue;
-
-        VF(4) pabcd;
-        point_selected_surf[i] = false;
-        if (esti_plane(pabcd, points_near, 0.1f))
-        {
-            float pd2 = pabcd(0) * point_world.x + pabcd(1) * point_world.y + pabcd(2) * point_world.z + pabcd(3);
-            float s = 1 - 0.9 * fabs(pd2) / sqrt(p_body.norm());
-
-            if (s > 0.9)
-            {
-                point_selected_surf[i] = true;
-                normvec->points[i].x = pabcd(0);
-                normvec->points[i].y = pabcd(1);
-                normvec->points[i].z = pabcd(2);
-                normvec->points[i].intensity = pd2;
-                res_last[i] = abs(pd2);
-            }
-        }
-    }
-    
-    effct_feat_num = 0;
-
-    for (int i = 0; i < feats_down_size; i++)
-    {
-        if (point_selected_surf[i])
-        {
-            laserCloudOri->points[effct_feat_num] = feats_down_body->points[i];
-            corr_normvect->points[effct_feat_num] = normvec->points[i];
-            total_residual += res_last[i];
-            effct_feat_num ++;
-        }
-    }
-
-    if (effct_feat_num < 1)
+    ScanOutput scan;
+    while (output_queue.pop(scan))
     {
-        ekfom_data.valid = false;
-        ROS_WARN("No Effective Points! \n");
-        return;
-    }
-
-    res_mean_last = total_residual / effct_feat_num;
-    match_time  += omp_get_wtime() - match_start;
-    double solve_start_  = omp_get_wtime();
-    
-    /*** Computation of Measuremnt Jacobian matrix H and measurents vector ***/
-    ekfom_data.h_x = MatrixXd::Zero(effct_feat_num, 12); //23
-    ekfom_data.h.resize(effct_feat_num);
-
-    for (int i = 0; i < effct_feat_num; i++)
-    {
-        const PointType &laser_p  = laserCloudOri->points[i];
-        V3D point_this_be(laser_p.x, laser_p.y, laser_p.z);
-        M3D point_be_crossmat;
-        point_be_crossmat << SKEW_SYM_MATRX(point_this_be);
-        V3D point_this = s.offset_R_L_I * point_this_be + s.offset_T_L_I;
-        M3D point_crossmat;
-        point_crossmat<<SKEW_SYM_MATRX(point_this);
-
-        /*** get the normal vector of closest surface/corner ***/
-        const PointType &norm_p = corr_normvect->points[i];
-        V3D norm_vec(norm_p.x, norm_p.y, norm_p.z);
-
-        /*** calculate the Measuremnt Jacobian matrix H ***/
-        V3D C(s.rot.conjugate() *norm_vec);
-        V3D A(point_crossmat * C);
-        if (extrinsic_est_en)
-        {
-            V3D B(point_be_crossmat * s.offset_R_L_I.conjugate() * C); //s.rot.conjugate()*norm_vec);
-            ekfom_data.h_x.block<1, 12>(i,0) << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), VEC_FROM_ARRAY(B), VEC_FROM_ARRAY(C);
-        }
-        else
-        {
-            ekfom_data.h_x.block<1, 12>(i,0) << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0;
-        }
-
-        /*** Measuremnt: distance to the closest surface/corner ***/
-        ekfom_data.h(i) = -norm_p.intensity;
+        if (path_en)                         publish_path(pubPath, scan);
+        if (scan_pub_en || pcd_save_en)      publish_frame_world(pubLaserCloudFull, scan);
+        if (scan_pub_en && scan_body_pub_en) publish_frame_body(pubLaserCloudFull_body, scan);
+        publish_map(pubLaserCloudMap, scan);
+        output_queue.task_done();
     }
-    solve_time += omp_get_wtime() - solve_start_;
 }
 
 int main(int argc, char** argv)
@@ -762,22 +748,26 @@ int main(int argc, char** argv)
     nh.param<bool>("publish/scan_publish_en",scan_pub_en, true);
     nh.param<bool>("publish/dense_publish_en",dense_pub_en, true);
     nh.param<bool>("publish/scan_bodyframe_pub_en",scan_body_pub_en, true);
-    nh.param<int>("max_iteration",NUM_MAX_ITERATIONS,4);
+    nh.param<int>("max_iteration",lio_params.max_iteration,4);
     nh.param<string>("map_file_path",map_file_path,"");
+    nh.param<float>("map_file/chunk_size",lio_params.map_chunk_size,20.f);
+    nh.param<bool>("localization/enable",localization_en,false);
+    nh.param<vector<double>>("localization/init_pos", init_pos, vector<double>(3, 0.0));
+    nh.param<vector<double>>("localization/init_rpy", init_rpy, vector<double>(3, 0.0));
     nh.param<string>("common/lid_topic",lid_topic,"/livox/lidar");
     nh.param<string>("common/imu_topic", imu_topic,"/livox/imu");
+    nh.param<string>("replay/bag_file", replay_bag_file, "");
     nh.param<bool>("common/time_sync_en", time_sync_en, false);
     nh.param<double>("common/time_offset_lidar_to_imu", time_diff_lidar_to_imu, 0.0);
     nh.param<double>("filter_size_corner",filter_size_corner_min,0.5);
-    nh.param<double>("filter_size_surf",filter_size_surf_min,0.5);
-    nh.param<double>("filter_size_map",filter_size_map_min,0.5);
-    nh.param<double>("cube_side_length",cube_len,200);
-    nh.param<float>("mapping/det_range",DET_RANGE,300.f);
-    nh.param<double>("mapping/fov_degree",fov_deg,180);
-    nh.param<double>("mapping/gyr_cov",gyr_cov,0.1);
-    nh.param<double>("mapping/acc_cov",acc_cov,0.1);
-    nh.param<double>("mapping/b_gyr_cov",b_gyr_cov,0.0001);
-    nh.param<double>("mapping/b_acc_cov",b_acc_cov,0.0001);
+    nh.param<double>("filter_size_surf",lio_params.filter_size_surf,0.5);
+    nh.param<double>("filter_size_map",lio_params.filter_size_map,0.5);
+    nh.param<double>("cube_side_length",lio_params.cube_len,200);
+    nh.param<float>("mapping/det_range",lio_params.det_range,300.f);
+    nh.param<double>("mapping/gyr_cov",lio_params.gyr_cov,0.1);
+    nh.param<double>("mapping/acc_cov",lio_params.acc_cov,0.1);
+    nh.param<double>("mapping/b_gyr_cov",lio_params.b_gyr_cov,0.0001);
+    nh.param<double>("mapping/b_acc_cov",lio_params.b_acc_cov,0.0001);
     nh.param<double>("preprocess/blind", p_pre->blind, 0.01);
     nh.param<int>("preprocess/lidar_type", lidar_type, AVIA);
     nh.param<int>("preprocess/scan_line", p_pre->N_SCANS, 16);
@@ -785,240 +775,242 @@ int main(int argc, char** argv)
     nh.param<int>("preprocess/scan_rate", p_pre->SCAN_RATE, 10);
     nh.param<int>("point_filter_num", p_pre->point_filter_num, 2);
     nh.param<bool>("feature_extract_enable", p_pre->feature_enabled, false);
+    nh.param<int>("preprocess/thread_num", preprocess_thread_num, 2);
     nh.param<bool>("runtime_pos_log_enable", runtime_pos_log, 0);
-    nh.param<bool>("mapping/extrinsic_est_en", extrinsic_est_en, true);
+    nh.param<bool>("telemetry/enable", telemetry_en, runtime_pos_log);
+    nh.param<double>("telemetry/period", telemetry_period, 1.0);
+    nh.param<int>("telemetry/file_size_kb", telemetry_file_kb, 10240);
+    nh.param<bool>("mapping/extrinsic_est_en", lio_params.extrinsic_est_en, true);
+    nh.param<bool>("mapping/reduced_update_en", lio_params.reduced_update_en, true);
+    nh.param<bool>("mapping/schur_update_en", lio_params.schur_update_en, false);
+    nh.param<bool>("mapping/parallel_undistort_en", lio_params.parallel_undistort_en, true);
+    nh.param<bool>("publish/highrate_odom_en", highrate_odom_en, false);
+    nh.param<int>("publish/trajectory_size", lio_params.trajectory_size, 4000);
+    if (lio_params.trajectory_size < 1)
+    {
+        ROS_WARN("publish/trajectory_size must be at least 1, %d given, using 1", lio_params.trajectory_size);
+        lio_params.trajectory_size = 1;
+    }
+    nh.param<int>("mapping/match_thread_num", lio_params.match_thread_num, 0);
+    nh.param<int>("mapping/map_type", lio_params.map_type, IKDTREE);
+    nh.param<double>("ivox/resolution", lio_params.ivox_resolution, 0.5);
+    nh.param<int>("ivox/nearby_type", lio_params.ivox_nearby_type, NEARBY18);
+    nh.param<int>("ivox/capacity", lio_params.ivox_capacity, 1000000);
+    nh.param<int>("ivox/max_points_per_voxel", lio_params.ivox_max_points, 50);
     nh.param<bool>("pcd_save/pcd_save_en", pcd_save_en, false);
     nh.param<int>("pcd_save/interval", pcd_save_interval, -1);
     nh.param<vector<double>>("mapping/extrinsic_T", extrinT, vector<double>());
     nh.param<vector<double>>("mapping/extrinsic_R", extrinR, vector<double>());
 
     p_pre->lidar_type = lidar_type;
+    preprocess_thread_num = max(preprocess_thread_num, 1);
+    for (int i = 0; i < preprocess_thread_num; i++)
+        preprocessors.push_back(make_shared<Preprocess>(*p_pre));
     cout<<"p_pre->lidar_type "<<p_pre->lidar_type<<endl;
     
     path.header.stamp    = ros::Time::now();
     path.header.frame_id ="camera_init";
 
     /*** variables definition ***/
-    int effect_feat_num = 0, frame_num = 0;
-    double deltaT, deltaR, aver_time_consu = 0, aver_time_icp = 0, aver_time_match = 0, aver_time_incre = 0, aver_time_solve = 0, aver_time_const_H_time = 0;
-    bool flg_EKF_converged, EKF_stop_flg = 0;
-    
-    FOV_DEG = (fov_deg + 10.0) > 179.9 ? 179.9 : (fov_deg + 10.0);
-    HALF_FOV_COS = cos((FOV_DEG) * 0.5 * PI_M / 180.0);
-
-    _featsArray.reset(new PointCloudXYZI());
-
-    //memset is a command to fill the large variable with a specific value 
-    memset(point_selected_surf, true, sizeof(point_selected_surf));
-    memset(res_last, -1000.0f, sizeof(res_last));
-    downSizeFilterSurf.setLeafSize(filter_size_surf_min, filter_size_surf_min, filter_size_surf_min);
-    downSizeFilterMap.setLeafSize(filter_size_map_min, filter_size_map_min, filter_size_map_min);
-    memset(point_selected_surf, true, sizeof(point_selected_surf));
-    memset(res_last, -1000.0f, sizeof(res_last));
-
-    Lidar_T_wrt_IMU<<VEC_FROM_ARRAY(extrinT);
-    Lidar_R_wrt_IMU<<MAT_FROM_ARRAY(extrinR);
-    p_imu->set_extrinsic(Lidar_T_wrt_IMU, Lidar_R_wrt_IMU);
-    p_imu->set_gyr_cov(V3D(gyr_cov, gyr_cov, gyr_cov));
-    p_imu->set_acc_cov(V3D(acc_cov, acc_cov, acc_cov));
-    p_imu->set_gyr_bias_cov(V3D(b_gyr_cov, b_gyr_cov, b_gyr_cov));
-    p_imu->set_acc_bias_cov(V3D(b_acc_cov, b_acc_cov, b_acc_cov));
-    p_imu->lidar_type = lidar_type;
-    double epsi[23] = {0.001};
-    fill(epsi, epsi+23, 0.001);
-    kf.init_dyn_share(get_f, df_dx, df_dw, h_share_model, NUM_MAX_ITERATIONS, epsi);
+    int frame_num = 0;
+    double aver_time_consu = 0, aver_time_icp = 0, aver_time_match = 0, aver_time_incre = 0, aver_time_solve = 0, aver_time_const_H_time = 0;
+
+    lio_params.lidar_type = lidar_type;
+    lio_params.extrinsic_T<<VEC_FROM_ARRAY(extrinT);
+    lio_params.extrinsic_R<<MAT_FROM_ARRAY(extrinR);
+    if (localization_en)
+    {
+        lio_params.localization_only = true;
+        lio_params.init_pos<<VEC_FROM_ARRAY(init_pos);
+        /* roll, pitch, yaw in degrees, applied as Rz(yaw) * Ry(pitch) * Rx(roll) */
+        lio_params.init_rot = (AngleAxisd(init_rpy[2] * PI_M / 180.0, V3D::UnitZ()) * AngleAxisd(init_rpy[1] * PI_M / 180.0, V3D::UnitY())
+                               * AngleAxisd(init_rpy[0] * PI_M / 180.0, V3D::UnitX())).toRotationMatrix();
+    }
+    else
+    {
+        lio_params.map_save_path = map_file_path;
+    }
+    lio.reset(new LioCore(lio_params));
+    trajectory_buffer = lio->trajectory();
+    if (localization_en && !lio->load_map(map_file_path))
+    {
+        ROS_ERROR("localization needs a saved map, cannot load map_file_path \"%s\"", map_file_path.c_str());
+        return 1;
+    }
+
+    Telemetry::enable(telemetry_en);
+    if (telemetry_en && telemetry_file_kb > 0)
+        telemetry_log.reset(new TelemetryLog(root_dir + "/Log/telemetry.csv", size_t(telemetry_file_kb) * 1024));
 
     /*** debug record ***/
     FILE *fp;
     string pos_log_dir = root_dir + "/Log/pos_log.txt";
     fp = fopen(pos_log_dir.c_str(),"w");
 
-    ofstream fout_pre, fout_out, fout_dbg;
+    ofstream fout_pre, fout_out;
     fout_pre.open(DEBUG_FILE_DIR("mat_pre.txt"),ios::out);
     fout_out.open(DEBUG_FILE_DIR("mat_out.txt"),ios::out);
-    fout_dbg.open(DEBUG_FILE_DIR("dbg.txt"),ios::out);
     if (fout_pre && fout_out)
         cout << "~~~~"<<ROOT_DIR<<" file opened" << endl;
     else
         cout << "~~~~"<<ROOT_DIR<<" doesn't exist" << endl;
 
-    /*** ROS subscribe initialization ***/
-    ros::Subscriber sub_pcl = p_pre->lidar_type == AVIA ? \
-        nh.subscribe(lid_topic, 200000, livox_pcl_cbk) : \
-        nh.subscribe(lid_topic, 200000, standard_pcl_cbk);
-    ros::Subscriber sub_imu = nh.subscribe(imu_topic, 200000, imu_cbk);
+    /*** ROS subscribe initialization, a replay reads the topics from the bag instead ***/
+    bool replay_en = !replay_bag_file.empty();
+    ros::Subscriber sub_pcl, sub_imu;
+    ros::NodeHandle nh_imu;
+    ros::CallbackQueue imu_callback_queue;
+    if (!replay_en)
+    {
+        sub_pcl = p_pre->lidar_type == AVIA ? \
+            nh.subscribe(lid_topic, 200000, livox_pcl_cbk) : \
+            nh.subscribe(lid_topic, 200000, standard_pcl_cbk);
+        /*** imu callbacks get their own queue and thread so they never wait behind a scan ***/
+        nh_imu.setCallbackQueue(&imu_callback_queue);
+        sub_imu = nh_imu.subscribe(imu_topic, 200000, imu_cbk, ros::TransportHints().tcpNoDelay());
+    }
     ros::Publisher pubLaserCloudFull = nh.advertise<sensor_msgs::PointCloud2>
             ("/cloud_registered", 100000);
     ros::Publisher pubLaserCloudFull_body = nh.advertise<sensor_msgs::PointCloud2>
             ("/cloud_registered_body", 100000);
-    ros::Publisher pubLaserCloudEffect = nh.advertise<sensor_msgs::PointCloud2>
-            ("/cloud_effected", 100000);
     ros::Publisher pubLaserCloudMap = nh.advertise<sensor_msgs::PointCloud2>
             ("/Laser_map", 100000);
     ros::Publisher pubOdomAftMapped = nh.advertise<nav_msgs::Odometry> 
             ("/Odometry", 100000);
     ros::Publisher pubPath          = nh.advertise<nav_msgs::Path> 
             ("/path", 100000);
+    pubOdomHighRate                 = nh.advertise<nav_msgs::Odometry> 
+            ("/Odometry_highrate", 100000);
+    ros::Publisher pubDiagnostics   = nh.advertise<diagnostic_msgs::DiagnosticArray>
+            ("/diagnostics", 10);
+    ros::ServiceServer srvQueryPose = nh.advertiseService("query_pose", query_pose_srv);
+    ros::Timer telemetry_timer;
+    if (telemetry_en)
+        telemetry_timer = nh.createTimer(ros::Duration(telemetry_period), [&pubDiagnostics](const ros::TimerEvent &){ publish_telemetry(pubDiagnostics); });
 //------------------------------------------------------------------------------------------------------
     signal(SIGINT, SigHandle);
-    ros::Rate rate(5000);
+    ros::AsyncSpinner spinner(2);
+    ros::AsyncSpinner imu_spinner(1, &imu_callback_queue);
+    spinner.start();
+    imu_spinner.start();
+    vector<thread> preprocess_threads;
+    for (int i = 0; i < preprocess_thread_num; i++)
+        preprocess_threads.emplace_back(preprocess_loop, i);
+    thread replay_thread;
+    double replay_start_time = omp_get_wtime();
+    if (replay_en)
+    {
+        ROS_INFO("replaying %s", replay_bag_file.c_str());
+        replay_thread = thread(replay_loop);
+    }
+    thread output_thread(output_loop, pubLaserCloudFull, pubLaserCloudFull_body, pubLaserCloudMap, pubPath);
     bool status = ros::ok();
     while (status)
     {
         if (flg_exit) break;
-        ros::spinOnce();
-        if(sync_packages(Measures)) 
+        bool replay_done;
+        {
+            /*** wait for a complete lidar + imu package instead of polling ***/
+            unique_lock<mutex> lock(mtx_buffer);
+            sig_buffer.wait_for(lock, chrono::milliseconds(100), []{ return flg_exit || replay_finished || package_ready(); });
+            replay_done = replay_finished;   // read before the sync: all data was queued by then
+        }
+        bool synced = sync_packages(Measures);
+        if (replay_done && !synced) break;
+        /* lets the replay feed the next scan, the sync attempt may also have skipped scans reset by a loop back */
+        if (replay_en) notify_buffer();
+        if(synced && !flg_exit) 
         {
-            if (flg_first_scan)
+            LioOutput lio_out;
+            LioStatus lio_status = lio->process(Measures, lio_out);
+            if (lio_status == LIO_FIRST_SCAN)
             {
-                first_lidar_time = Measures.lidar_beg_time;
-                p_imu->first_lidar_time = first_lidar_time;
-                flg_first_scan = false;
+                first_lidar_time = lio->first_lidar_time();
                 continue;
             }
-
-            double t0,t1,t2,t3,t4,t5,match_start, solve_start, svd_time;
-
-            match_time = 0;
-            kdtree_search_time = 0.0;
-            solve_time = 0;
-            solve_const_H_time = 0;
-            svd_time   = 0;
-            t0 = omp_get_wtime();
-
-            p_imu->Process(Measures, kf, feats_undistort);
-            state_point = kf.get_x();
-            pos_lid = state_point.pos + state_point.rot * state_point.offset_T_L_I;
-
-            if (feats_undistort->empty() || (feats_undistort == NULL))
+            state_point = lio_out.state;
+            if (lio_status == LIO_NO_POINTS)
             {
                 ROS_WARN("No point, skip this scan!\n");
                 continue;
             }
-
-            flg_EKF_inited = (Measures.lidar_beg_time - first_lidar_time) < INIT_TIME ? \
-                            false : true;
-            /*** Segment the map in lidar FOV ***/
-            lasermap_fov_segment();
-
-            /*** downsample the feature points in a scan ***/
-            downSizeFilterSurf.setInputCloud(feats_undistort);
-            downSizeFilterSurf.filter(*feats_down_body);
-            t1 = omp_get_wtime();
-            feats_down_size = feats_down_body->points.size();
-            /*** initialize the map kdtree ***/
-            if(ikdtree.Root_Node == nullptr)
+            if (lio_status == LIO_NO_MAP)
             {
-                if(feats_down_size > 5)
-                {
-                    ikdtree.set_downsample_param(filter_size_map_min);
-                    feats_down_world->resize(feats_down_size);
-                    for(int i = 0; i < feats_down_size; i++)
-                    {
-                        pointBodyToWorld(&(feats_down_body->points[i]), &(feats_down_world->points[i]));
-                    }
-                    ikdtree.Build(feats_down_world->points);
-                }
+                ROS_ERROR_THROTTLE(1.0, "localization: no point of %s around (%.1f, %.1f, %.1f), check localization/init_pos",
+                                   map_file_path.c_str(), state_point.pos(0), state_point.pos(1), state_point.pos(2));
                 continue;
             }
-            int featsFromMapNum = ikdtree.validnum();
-            kdtree_size_st = ikdtree.size();
-            
-            // cout<<"[ mapping ]: In num: "<<feats_undistort->points.size()<<" downsamp "<<feats_down_size<<" Map num: "<<featsFromMapNum<<"effect num:"<<effct_feat_num<<endl;
-
-            /*** ICP and iterated Kalman filter update ***/
-            if (feats_down_size < 5)
-            {
-                ROS_WARN("No point, skip this scan!\n");
-                continue;
-            }
-            
-            normvec->resize(feats_down_size);
-            feats_down_world->resize(feats_down_size);
-
-            V3D ext_euler = SO3ToEuler(state_point.offset_R_L_I);
-            fout_pre<<setw(20)<<Measures.lidar_beg_time - first_lidar_time<<" "<<euler_cur.transpose()<<" "<< state_point.pos.transpose()<<" "<<ext_euler.transpose() << " "<<state_point.offset_T_L_I.transpose()<< " " << state_point.vel.transpose() \
-            <<" "<<state_point.bg.transpose()<<" "<<state_point.ba.transpose()<<" "<<state_point.grav<< endl;
+            if (lio_status != LIO_UPDATED) continue;
+            const LioStats &stats = lio_out.stats;
+            if (stats.effective_points < 1) ROS_WARN("No Effective Points! \n");
 
-            if(0) // If you need to see map point, change to "if(1)"
-            {
-                PointVector ().swap(ikdtree.PCL_Storage);
-                ikdtree.flatten(ikdtree.Root_Node, ikdtree.PCL_Storage, NOT_RECORD);
-                featsFromMap->clear();
-                featsFromMap->points = ikdtree.PCL_Storage;
-            }
+            V3D ext_euler = SO3ToEuler(lio_out.prior.offset_R_L_I);
+            fout_pre<<setw(20)<<Measures.lidar_beg_time - first_lidar_time<<" "<<euler_cur.transpose()<<" "<< lio_out.prior.pos.transpose()<<" "<<ext_euler.transpose() << " "<<lio_out.prior.offset_T_L_I.transpose()<< " " << lio_out.prior.vel.transpose() \
+            <<" "<<lio_out.prior.bg.transpose()<<" "<<lio_out.prior.ba.transpose()<<" "<<lio_out.prior.grav<< endl;
 
-            pointSearchInd_surf.resize(feats_down_size);
-            Nearest_Points.resize(feats_down_size);
-            int  rematch_num = 0;
-            bool nearest_search_en = true; //
-
-            t2 = omp_get_wtime();
-            
-            /*** iterated state estimation ***/
-            double t_update_start = omp_get_wtime();
-            double solve_H_time = 0;
-            kf.update_iterated_dyn_share_modified(LASER_POINT_COV, solve_H_time);
-            state_point = kf.get_x();
             euler_cur = SO3ToEuler(state_point.rot);
-            pos_lid = state_point.pos + state_point.rot * state_point.offset_T_L_I;
             geoQuat.x = state_point.rot.coeffs()[0];
             geoQuat.y = state_point.rot.coeffs()[1];
             geoQuat.z = state_point.rot.coeffs()[2];
             geoQuat.w = state_point.rot.coeffs()[3];
 
-            double t_update_end = omp_get_wtime();
-
             /******* Publish odometry *******/
             publish_odometry(pubOdomAftMapped);
-
-            /*** add the feature points to map kdtree ***/
-            t3 = omp_get_wtime();
-            map_incremental();
-            t5 = omp_get_wtime();
-            
-            /******* Publish points *******/
-            if (path_en)                         publish_path(pubPath);
-            if (scan_pub_en || pcd_save_en)      publish_frame_world(pubLaserCloudFull);
-            if (scan_pub_en && scan_body_pub_en) publish_frame_body(pubLaserCloudFull_body);
-            // publish_effect_world(pubLaserCloudEffect);
-            publish_map(pubLaserCloudMap);
+            if (highrate_odom_en) imu_propagator.reset(state_point, lidar_end_time, lio->acc_scale());
+
+            /*** hand the scan over to the output stage ***/
+            ScanOutput scan_output;
+            scan_output.feats_undistort = lio_out.feats_undistort;
+            scan_output.feats_down_body = lio_out.feats_down_body;
+            scan_output.map_points      = lio_out.map_points;
+            scan_output.state           = state_point;
+            scan_output.quat            = geoQuat;
+            scan_output.lidar_end_time  = lidar_end_time;
+            output_queue.push(scan_output);
 
             /*** Debug variables ***/
             if (runtime_pos_log)
             {
                 frame_num ++;
-                kdtree_size_end = ikdtree.size();
-                aver_time_consu = aver_time_consu * (frame_num - 1) / frame_num + (t5 - t0) / frame_num;
-                aver_time_icp = aver_time_icp * (frame_num - 1)/frame_num + (t_update_end - t_update_start) / frame_num;
-                aver_time_match = aver_time_match * (frame_num - 1)/frame_num + (match_time)/frame_num;
-                aver_time_incre = aver_time_incre * (frame_num - 1)/frame_num + (kdtree_incremental_time)/frame_num;
-                aver_time_solve = aver_time_solve * (frame_num - 1)/frame_num + (solve_time + solve_H_time)/frame_num;
-                aver_time_const_H_time = aver_time_const_H_time * (frame_num - 1)/frame_num + solve_time / frame_num;
-                T1[time_log_counter] = Measures.lidar_beg_time;
-                s_plot[time_log_counter] = t5 - t0;
-                s_plot2[time_log_counter] = feats_undistort->points.size();
-                s_plot3[time_log_counter] = kdtree_incremental_time;
-                s_plot4[time_log_counter] = kdtree_search_time;
-                s_plot5[time_log_counter] = kdtree_delete_counter;
-                s_plot6[time_log_counter] = kdtree_delete_time;
-                s_plot7[time_log_counter] = kdtree_size_st;
-                s_plot8[time_log_counter] = kdtree_size_end;
-                s_plot9[time_log_counter] = aver_time_consu;
-                s_plot10[time_log_counter] = add_point_size;
-                time_log_counter ++;
-                printf("[ mapping ]: time: IMU + Map + Input Downsample: %0.6f ave match: %0.6f ave solve: %0.6f  ave ICP: %0.6f  map incre: %0.6f ave total: %0.6f icp: %0.6f construct H: %0.6f \n",t1-t0,aver_time_match,aver_time_solve,t3-t1,t5-t3,aver_time_consu,aver_time_icp, aver_time_const_H_time);
+                aver_time_consu = aver_time_consu * (frame_num - 1) / frame_num + (stats.total_time) / frame_num;
+                aver_time_icp = aver_time_icp * (frame_num - 1)/frame_num + (stats.update_time) / frame_num;
+                aver_time_match = aver_time_match * (frame_num - 1)/frame_num + (stats.match_time)/frame_num;
+                aver_time_incre = aver_time_incre * (frame_num - 1)/frame_num + (stats.map_incre_time_last)/frame_num;
+                aver_time_solve = aver_time_solve * (frame_num - 1)/frame_num + (stats.solve_time + stats.solve_H_time)/frame_num;
+                aver_time_const_H_time = aver_time_const_H_time * (frame_num - 1)/frame_num + stats.solve_time / frame_num;
+                printf("[ mapping ]: time: IMU + Map + Input Downsample: %0.6f ave match: %0.6f ave solve: %0.6f  ave ICP: %0.6f  map incre (last scan): %0.6f ave total: %0.6f icp: %0.6f construct H: %0.6f \n",stats.preprocess_time,aver_time_match,aver_time_solve,stats.icp_time,stats.map_incre_time_last,aver_time_consu,aver_time_icp, aver_time_const_H_time);
                 ext_euler = SO3ToEuler(state_point.offset_R_L_I);
                 fout_out << setw(20) << Measures.lidar_beg_time - first_lidar_time << " " << euler_cur.transpose() << " " << state_point.pos.transpose()<< " " << ext_euler.transpose() << " "<<state_point.offset_T_L_I.transpose()<<" "<< state_point.vel.transpose() \
-                <<" "<<state_point.bg.transpose()<<" "<<state_point.ba.transpose()<<" "<<state_point.grav<<" "<<feats_undistort->points.size()<<endl;
+                <<" "<<state_point.bg.transpose()<<" "<<state_point.ba.transpose()<<" "<<state_point.grav<<" "<<scan_output.feats_undistort->points.size()<<endl;
                 dump_lio_state_to_log(fp);
             }
         }
 
         status = ros::ok();
-        rate.sleep();
     }
 
+    /*** drain the pipeline before saving ***/
+    if (replay_thread.joinable())
+    {
+        flg_exit = true;
+        sig_buffer.notify_all();
+        replay_thread.join();
+        double replay_time = omp_get_wtime() - replay_start_time;
+        ROS_INFO("replay: %lu scans in %.2f s (%.1f scans/s)", (unsigned long)scans_synced.load(), replay_time, scans_synced / replay_time);
+    }
+    preprocess_queue.close();
+    for (auto &t : preprocess_threads) t.join();
+    lio->stop();
+    if (!localization_en && !map_file_path.empty() && !lio->save_map())
+        ROS_ERROR("saving the map to %s failed", map_file_path.c_str());
+    output_queue.close();
+    output_thread.join();
+    telemetry_timer.stop();
+    imu_spinner.stop();
+    spinner.stop();
+    /* the samples since the last period */
+    if (telemetry_en) publish_telemetry(pubDiagnostics);
+
     /**************** save map ****************/
     /* 1. make sure you have enough memories
     /* 2. pcd save will largely influence the real-time performences **/
@@ -1034,23 +1026,5 @@ int main(int argc, char** argv)
     fout_out.close();
     fout_pre.close();
 
-    if (runtime_pos_log)
-    {
-        vector<double> t, s_vec, s_vec2, s_vec3, s_vec4, s_vec5, s_vec6, s_vec7;    
-        FILE *fp2;
-        string log_dir = root_dir + "/Log/fast_lio_time_log.csv";
-        fp2 = fopen(log_dir.c_str(),"w");
-        fprintf(fp2,"time_stamp, total time, scan point size, incremental time, search time, delete size, delete time, tree size st, tree size end, add point size, preprocess time\n");
-        for (int i = 0;i<time_log_counter; i++){
-            fprintf(fp2,"%0.8f,%0.8f,%d,%0.8f,%0.8f,%d,%0.8f,%d,%d,%d,%0.8f\n",T1[i],s_plot[i],int(s_plot2[i]),s_plot3[i],s_plot4[i],int(s_plot5[i]),s_plot6[i],int(s_plot7[i]),int(s_plot8[i]), int(s_plot10[i]), s_plot11[i]);
-            t.push_back(T1[i]);
-            s_vec.push_back(s_plot9[i]);
-            s_vec2.push_back(s_plot3[i] + s_plot6[i]);
-            s_vec3.push_back(s_plot4[i]);
-            s_vec5.push_back(s_plot[i]);
-        }
-        fclose(fp2);
-    }
-
     return 0;
 }
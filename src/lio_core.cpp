@@ -0,0 +1,604 @@
+#include <omp.h>
+#include <math.h>
+#include <lio_core.h>
+#include <telemetry.h>
+#include "IMU_Processing.hpp"
+
+const float MOV_THRESHOLD = 1.5f;
+const int   MAX_SCAN_POINTS = 100000;
+
+LioCore::LioCore(const LioParams &params_in)
+    : params(params_in),
+      p_imu(new ImuProcess()),
+      feats_undistort(new PointCloudXYZI()),
+      feats_down_body(new PointCloudXYZI()),
+      feats_down_world(new PointCloudXYZI()),
+      normvec(new PointCloudXYZI(MAX_SCAN_POINTS, 1)),
+      laserCloudOri(new PointCloudXYZI(MAX_SCAN_POINTS, 1)),
+      corr_normvect(new PointCloudXYZI(MAX_SCAN_POINTS, 1)),
+      res_last(MAX_SCAN_POINTS, -1000.0f),
+      point_selected_surf(new bool[MAX_SCAN_POINTS]),
+      plane_valid(new bool[MAX_SCAN_POINTS]),
+      plane_coeffs(MAX_SCAN_POINTS),
+      map_update_queue(1)
+{
+    if (params.match_thread_num <= 0) params.match_thread_num = omp_get_num_procs();
+    fill(point_selected_surf.get(), point_selected_surf.get() + MAX_SCAN_POINTS, true);
+    fill(plane_valid.get(), plane_valid.get() + MAX_SCAN_POINTS, false);
+
+    ivox.set_param(params.ivox_resolution, params.ivox_nearby_type, params.ivox_capacity, params.ivox_max_points);
+    downSizeFilterSurf.setLeafSize(params.filter_size_surf, params.filter_size_surf, params.filter_size_surf);
+
+    p_imu->set_extrinsic(params.extrinsic_T, params.extrinsic_R);
+    p_imu->set_gyr_cov(V3D(params.gyr_cov, params.gyr_cov, params.gyr_cov));
+    p_imu->set_acc_cov(V3D(params.acc_cov, params.acc_cov, params.acc_cov));
+    p_imu->set_gyr_bias_cov(V3D(params.b_gyr_cov, params.b_gyr_cov, params.b_gyr_cov));
+    p_imu->set_acc_bias_cov(V3D(params.b_acc_cov, params.b_acc_cov, params.b_acc_cov));
+    p_imu->lidar_type = params.lidar_type;
+    p_imu->parallel_undistort = params.parallel_undistort_en;
+    p_imu->init_pos = params.init_pos;
+    p_imu->init_rot = params.init_rot;
+    trajectory_buffer.reset(new TrajectoryBuffer(max(params.trajectory_size, 1)));
+    p_imu->trajectory = trajectory_buffer;
+
+    double epsi[23] = {0.001};
+    fill(epsi, epsi+23, 0.001);
+    kf.init_dyn_share(get_f, df_dx, df_dw,
+                      [this](state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data) { h_share_model(s, ekfom_data); },
+                      params.max_iteration, epsi);
+    kf.set_schur_update(params.schur_update_en);
+    if (!params.map_save_path.empty()) map_writer.reset(new MapFileWriter(params.map_save_path, params.map_chunk_size));
+
+    map_update_thread = std::thread(&LioCore::map_update_loop, this);
+}
+
+LioCore::~LioCore()
+{
+    stop();
+}
+
+void LioCore::stop()
+{
+    map_update_queue.close();
+    if (map_update_thread.joinable()) map_update_thread.join();
+}
+
+double LioCore::acc_scale() const
+{
+    return p_imu->acc_scale();
+}
+
+bool LioCore::load_map(const std::string &path)
+{
+    if (params.map_type != IKDTREE)
+    {
+        printf("map file: only an ikd-Tree map can be loaded\n");
+        return false;
+    }
+    prior_map.reset(new MapFile());
+    if (!prior_map->open(path))
+    {
+        prior_map.reset();
+        return false;
+    }
+    const MapFileHeader &h = prior_map->header();
+    if (fabs(h.downsample_size - params.filter_size_map) > 1e-6)
+        printf("map file: saved with filter_size_map %.3f, used instead of %.3f\n", h.downsample_size, params.filter_size_map);
+    params.filter_size_map = h.downsample_size;
+    ikdtree.set_downsample_param(params.filter_size_map);
+    chunk_loaded.assign(prior_map->chunk_num(), false);
+    printf("map file: %lu points in %u chunks, bounds [%.1f %.1f %.1f] - [%.1f %.1f %.1f]\n", (unsigned long)h.point_num, h.chunk_num,
+           h.bounds_min[0], h.bounds_min[1], h.bounds_min[2], h.bounds_max[0], h.bounds_max[1], h.bounds_max[2]);
+    return true;
+}
+
+/* the parts of the chunks in the local map that are not there yet */
+void LioCore::load_map_chunks()
+{
+    PointVector points;
+    int loaded = 0;
+    for (int i = 0; i < prior_map->chunk_num(); i++)
+    {
+        const MapChunk &c = prior_map->chunk(i);
+        if (chunk_loaded[i] || !box_intersects(c.vertex_min, c.vertex_max, LocalMap_Points)) continue;
+        prior_map->read_chunk(i, LocalMap_Points, points);
+        chunk_loaded[i] = box_contains(LocalMap_Points, c.vertex_min, c.vertex_max);
+        loaded ++;
+    }
+    if (points.empty()) return;
+    /* a chunk cut by the local map may be partly in the tree already, the voxel downsampling merges it */
+    if (ikdtree.Root_Node == nullptr) ikdtree.Build(points);
+    else ikdtree.Add_Points(points, true);
+    Telemetry::set_gauge(TG_MAP_SIZE, ikdtree.size());
+    printf("map file: %d chunks, %lu points read into the local map\n", loaded, (unsigned long)points.size());
+}
+
+bool LioCore::save_map()
+{
+    if (!map_writer) return false;
+    PointVector points;
+    if (params.map_type == IVOX) ivox.flatten(points);
+    else ikdtree.flatten(ikdtree.Root_Node, points, NOT_RECORD);
+    map_writer->append(points);
+    bool ok = map_writer->finish(params.filter_size_map);
+    map_writer.reset();
+    return ok;
+}
+
+LioStatus LioCore::process(const MeasureGroup &meas, LioOutput &out, int tag)
+{
+    out.lidar_end_time = meas.lidar_end_time;
+    out.stats = LioStats();
+    out.map_points.reset();
+    if (flg_first_scan)
+    {
+        first_lidar_time_ = meas.lidar_beg_time;
+        p_imu->first_lidar_time = first_lidar_time_;
+        flg_first_scan = false;
+        return out.status = LIO_FIRST_SCAN;
+    }
+
+    LioStats &stats = out.stats;
+    match_time = 0;
+    solve_time = 0;
+    double t0 = omp_get_wtime();
+
+    /* the undistorted cloud of the previous scan is refilled once the caller has released it */
+    if (feats_undistort.use_count() > 1) feats_undistort.reset(new PointCloudXYZI());
+    p_imu->Process(meas, kf, feats_undistort);
+    double t_undistort = omp_get_wtime();
+    Telemetry::record(TS_UNDISTORT, t_undistort - t0);
+    state_point = kf.get_x();
+    out.prior = state_point;
+    out.state = state_point;
+    pos_lid = state_point.pos + state_point.rot * state_point.offset_T_L_I;
+
+    if (feats_undistort->empty() || (feats_undistort == NULL))
+    {
+        return out.status = LIO_NO_POINTS;
+    }
+
+    bool flg_EKF_inited = (meas.lidar_beg_time - first_lidar_time_) < INIT_TIME ? \
+                    false : true;
+
+    /*** downsample the feature points in a scan ***/
+    downSizeFilterSurf.setInputCloud(feats_undistort);
+    downSizeFilterSurf.filter(*feats_down_body);
+    feats_down_size = feats_down_body->points.size();
+    double t_downsample = omp_get_wtime();
+    Telemetry::record(TS_DOWNSAMPLE, t_downsample - t_undistort);
+    Telemetry::set_gauge(TG_SCAN_POINTS, feats_undistort->size());
+    Telemetry::set_gauge(TG_DOWNSAMPLED_POINTS, feats_down_size);
+
+    /*** the map update of the previous scan runs up to here, the map is not touched before ***/
+    map_update_queue.wait_idle();
+    stats.map_incre_time_last = kdtree_incremental_time;
+    Telemetry::record(TS_MAP_WAIT, omp_get_wtime() - t_downsample);
+
+    /*** Segment the map in lidar FOV ***/
+    lasermap_fov_segment(stats);
+    double t1 = omp_get_wtime();
+    stats.preprocess_time = t1 - t0;
+    /*** initialize the map kdtree ***/
+    if(params.map_type == IVOX ? ivox.empty() : ikdtree.Root_Node == nullptr)
+    {
+        /* a map built from the scan would be tracked in place of the loaded one, without a warning */
+        if (params.localization_only) return out.status = LIO_NO_MAP;
+        if(feats_down_size > 5)
+        {
+            feats_down_world->resize(feats_down_size);
+            transform_points(body_to_world_transform(state_point), feats_down_body->points.data(), feats_down_world->points.data(), feats_down_size);
+            if (params.map_type == IVOX)
+            {
+                ivox.set_downsample_param(params.filter_size_map);
+                ivox.Build(feats_down_world->points);
+            }
+            else
+            {
+                ikdtree.set_downsample_param(params.filter_size_map);
+                ikdtree.Build(feats_down_world->points);
+            }
+        }
+        return out.status = LIO_MAP_INIT;
+    }
+    stats.map_size_st = params.map_type == IVOX ? ivox.size() : ikdtree.size();
+
+    /*** ICP and iterated Kalman filter update ***/
+    if (feats_down_size < 5)
+    {
+        return out.status = LIO_NO_POINTS;
+    }
+
+    normvec->resize(feats_down_size);
+    feats_down_world->resize(feats_down_size);
+
+    if (params.map_points_en)
+    {
+        out.map_points.reset(new PointCloudXYZI());
+        if (params.map_type == IVOX)
+        {
+            ivox.flatten(out.map_points->points);
+        }
+        else
+        {
+            PointVector ().swap(ikdtree.PCL_Storage);
+            ikdtree.flatten(ikdtree.Root_Node, ikdtree.PCL_Storage, NOT_RECORD);
+            out.map_points->points = ikdtree.PCL_Storage;
+        }
+    }
+
+    Nearest_Points.resize(feats_down_size);
+
+    /*** iterated state estimation ***/
+    double t_update_start = omp_get_wtime();
+    double solve_H_time = 0;
+    kf.update_iterated_dyn_share_modified(LASER_POINT_COV, solve_H_time);
+    state_point = kf.get_x();
+    pos_lid = state_point.pos + state_point.rot * state_point.offset_T_L_I;
+    double t_update_end = omp_get_wtime();
+    p_imu->record_state(state_point, meas.lidar_end_time);
+
+    /*** hand the scan over to the map update stage ***/
+    double t3 = omp_get_wtime();
+    MapUpdateTask map_task;
+    map_task.feats_down_body  = feats_down_body;
+    map_task.feats_down_world = feats_down_world;
+    map_task.nearest_points.swap(Nearest_Points);
+    map_task.state      = state_point;
+    map_task.ekf_inited = flg_EKF_inited;
+    map_task.tag        = tag;
+    if (!params.localization_only) map_update_queue.push(map_task);
+
+    out.state           = state_point;
+    out.feats_undistort = feats_undistort;
+    out.feats_down_body = feats_down_body;
+
+    /* the map stage and the caller own these clouds now, the next scan works on fresh ones */
+    feats_down_body.reset(new PointCloudXYZI());
+    feats_down_world.reset(new PointCloudXYZI());
+    double t5 = omp_get_wtime();
+
+    stats.match_time       = match_time;
+    stats.solve_time       = solve_time;
+    stats.solve_H_time     = solve_H_time;
+    stats.update_time      = t_update_end - t_update_start;
+    stats.icp_time         = t3 - t1;
+    stats.total_time       = t5 - t0;
+    stats.effective_points = effct_feat_num;
+    stats.res_mean         = res_mean_last;
+
+    Telemetry::record(TS_MATCH, match_time);
+    Telemetry::record(TS_BUILD_H, solve_time);
+    Telemetry::record(TS_SOLVE, solve_H_time);
+    Telemetry::record(TS_UPDATE, stats.update_time);
+    Telemetry::record(TS_REGISTRATION, stats.total_time);
+    Telemetry::set_gauge(TG_EFFECTIVE_POINTS, effct_feat_num);
+    return out.status = LIO_UPDATED;
+}
+
+void LioCore::lasermap_fov_segment(LioStats &stats)
+{
+    cub_needrm.clear();
+    stats.kdtree_delete_counter = 0;
+    stats.kdtree_delete_time = 0.0;
+    if (params.map_type == IVOX) return; // the voxel map evicts stale voxels itself on insertion
+    V3D pos_LiD = pos_lid;
+    const double cube_len = params.cube_len;
+    const float DET_RANGE = params.det_range;
+    if (!Localmap_Initialized){
+        for (int i = 0; i < 3; i++){
+            LocalMap_Points.vertex_min[i] = pos_LiD(i) - cube_len / 2.0;
+            LocalMap_Points.vertex_max[i] = pos_LiD(i) + cube_len / 2.0;
+        }
+        Localmap_Initialized = true;
+        if (prior_map) load_map_chunks();
+        return;
+    }
+    float dist_to_map_edge[3][2];
+    bool need_move = false;
+    for (int i = 0; i < 3; i++){
+        dist_to_map_edge[i][0] = fabs(pos_LiD(i) - LocalMap_Points.vertex_min[i]);
+        dist_to_map_edge[i][1] = fabs(pos_LiD(i) - LocalMap_Points.vertex_max[i]);
+        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE || dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE) need_move = true;
+    }
+    if (!need_move) return;
+    BoxPointType New_LocalMap_Points, tmp_boxpoints;
+    New_LocalMap_Points = LocalMap_Points;
+    float mov_dist = max((cube_len - 2.0 * MOV_THRESHOLD * DET_RANGE) * 0.5 * 0.9, double(DET_RANGE * (MOV_THRESHOLD -1)));
+    for (int i = 0; i < 3; i++){
+        tmp_boxpoints = LocalMap_Points;
+        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE){
+            New_LocalMap_Points.vertex_max[i] -= mov_dist;
+            New_LocalMap_Points.vertex_min[i] -= mov_dist;
+            tmp_boxpoints.vertex_min[i] = LocalMap_Points.vertex_max[i] - mov_dist;
+            cub_needrm.push_back(tmp_boxpoints);
+        } else if (dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE){
+            New_LocalMap_Points.vertex_max[i] += mov_dist;
+            New_LocalMap_Points.vertex_min[i] += mov_dist;
+            tmp_boxpoints.vertex_max[i] = LocalMap_Points.vertex_min[i] + mov_dist;
+            cub_needrm.push_back(tmp_boxpoints);
+        }
+    }
+    LocalMap_Points = New_LocalMap_Points;
+
+    PointVector points_history;
+    ikdtree.acquire_removed_points(points_history);
+    double delete_begin = omp_get_wtime();
+    /* the map leaving the local map goes to disk, the tree only records deletions on a rebuild */
+    if (map_writer)
+    {
+        for (const BoxPointType &box : cub_needrm)
+        {
+            points_history.clear();
+            ikdtree.Box_Search(box, points_history);
+            map_writer->append(points_history);
+        }
+    }
+    if(cub_needrm.size() > 0) stats.kdtree_delete_counter = ikdtree.Delete_Point_Boxes(cub_needrm);
+    stats.kdtree_delete_time = omp_get_wtime() - delete_begin;
+    if (prior_map)
+    {
+        for (int i = 0; i < prior_map->chunk_num(); i++)
+        {
+            const MapChunk &c = prior_map->chunk(i);
+            for (const BoxPointType &box : cub_needrm)
+                if (box_intersects(c.vertex_min, c.vertex_max, box)) chunk_loaded[i] = false;
+        }
+        load_map_chunks();
+    }
+    Telemetry::record(TS_MAP_SEGMENT, stats.kdtree_delete_time);
+    Telemetry::set_gauge(TG_DELETED_POINTS, stats.kdtree_delete_counter);
+}
+
+void LioCore::map_incremental(MapUpdateTask &task)
+{
+    const double filter_size_map_min = params.filter_size_map;
+    const PointCloudXYZI &down_body = *task.feats_down_body;
+    PointCloudXYZI &down_world = *task.feats_down_world;
+    int down_size = down_body.points.size();
+    down_world.resize(down_size);
+    PointVector PointToAdd;
+    PointVector PointNoNeedDownsample;
+    PointToAdd.reserve(down_size);
+    PointNoNeedDownsample.reserve(down_size);
+    /* transform to world frame */
+    transform_points(body_to_world_transform(task.state), down_body.points.data(), down_world.points.data(), down_size);
+    for (int i = 0; i < down_size; i++)
+    {
+        /* decide if need add to map */
+        if (i < task.nearest_points.size() && !task.nearest_points[i].empty() && task.ekf_inited)
+        {
+            const PointVector &points_near = task.nearest_points[i];
+            bool need_add = true;
+            PointType mid_point;
+            mid_point.x = floor(down_world.points[i].x/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
+            mid_point.y = floor(down_world.points[i].y/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
+            mid_point.z = floor(down_world.points[i].z/filter_size_map_min)*filter_size_map_min + 0.5 * filter_size_map_min;
+            float dist  = calc_dist(down_world.points[i],mid_point);
+            if (fabs(points_near[0].x - mid_point.x) > 0.5 * filter_size_map_min && fabs(points_near[0].y - mid_point.y) > 0.5 * filter_size_map_min && fabs(points_near[0].z - mid_point.z) > 0.5 * filter_size_map_min){
+                PointNoNeedDownsample.push_back(down_world.points[i]);
+                continue;
+            }
+            for (int readd_i = 0; readd_i < NUM_MATCH_POINTS; readd_i ++)
+            {
+                if (points_near.size() < NUM_MATCH_POINTS) break;
+                if (calc_dist(points_near[readd_i], mid_point) < dist)
+                {
+                    need_add = false;
+                    break;
+                }
+            }
+            if (need_add) PointToAdd.push_back(down_world.points[i]);
+        }
+        else
+        {
+            PointToAdd.push_back(down_world.points[i]);
+        }
+    }
+
+    double st_time = omp_get_wtime();
+    MapUpdateStats stats;
+    if (params.map_type == IVOX)
+    {
+        ivox.Add_Points(PointToAdd, true);
+        ivox.Add_Points(PointNoNeedDownsample, false);
+        stats.evicted_num = ivox.acquire_evicted_num();
+    }
+    else
+    {
+        ikdtree.Add_Points(PointToAdd, true);
+        ikdtree.Add_Points(PointNoNeedDownsample, false);
+    }
+    kdtree_incremental_time = omp_get_wtime() - st_time;
+    Telemetry::record(TS_MAP_INCREMENTAL, kdtree_incremental_time);
+    if (Telemetry::enabled()) Telemetry::set_gauge(TG_MAP_SIZE, params.map_type == IVOX ? ivox.size() : ikdtree.size());
+
+    if (map_update_cbk)
+    {
+        stats.incremental_time = kdtree_incremental_time;
+        stats.map_size = params.map_type == IVOX ? ivox.size() : ikdtree.size();
+        stats.add_point_size = PointToAdd.size() + PointNoNeedDownsample.size();
+        map_update_cbk(task.tag, stats);
+    }
+}
+
+void LioCore::map_update_loop()
+{
+    MapUpdateTask task;
+    while (map_update_queue.pop(task))
+    {
+        map_incremental(task);
+        map_update_queue.task_done();
+    }
+}
+
+/* one row of the measurement Jacobian and the measurement for the i-th effective feature */
+inline void LioCore::calc_h_row(const state_ikfom &s, int i, Matrix<double, 1, 12> &h_row, double &h_i) const
+{
+    const PointType &laser_p  = laserCloudOri->points[i];
+    V3D point_this_be(laser_p.x, laser_p.y, laser_p.z);
+    M3D point_be_crossmat;
+    point_be_crossmat << SKEW_SYM_MATRX(point_this_be);
+    V3D point_this = s.offset_R_L_I * point_this_be + s.offset_T_L_I;
+    M3D point_crossmat;
+    point_crossmat<<SKEW_SYM_MATRX(point_this);
+
+    /*** get the normal vector of closest surface/corner ***/
+    const PointType &norm_p = corr_normvect->points[i];
+    V3D norm_vec(norm_p.x, norm_p.y, norm_p.z);
+
+    /*** calculate the Measuremnt Jacobian matrix H ***/
+    V3D C(s.rot.conjugate() *norm_vec);
+    V3D A(point_crossmat * C);
+    if (params.extrinsic_est_en)
+    {
+        V3D B(point_be_crossmat * s.offset_R_L_I.conjugate() * C); //s.rot.conjugate()*norm_vec);
+        h_row << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), VEC_FROM_ARRAY(B), VEC_FROM_ARRAY(C);
+    }
+    else
+    {
+        h_row << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0;
+    }
+
+    /*** Measuremnt: distance to the closest surface/corner ***/
+    h_i = -norm_p.intensity;
+}
+
+void LioCore::h_share_model(state_ikfom &s, esekfom::dyn_share_datastruct<double> &ekfom_data)
+{
+    double match_start = omp_get_wtime();
+    laserCloudOri->clear();
+    corr_normvect->clear();
+    double total_residual = 0.0;
+
+    /* transform to world frame */
+    transform_points(body_to_world_transform(s), feats_down_body->points.data(), feats_down_world->points.data(), feats_down_size);
+
+    if (ekfom_data.converge)
+    {
+        /** Find the closest surfaces in the map for the whole scan at once **/
+        if (params.map_type == IVOX)
+            ivox.Nearest_Search_Batch(feats_down_world->points, NUM_MATCH_POINTS, Nearest_Points, Nearest_Dists, INFINITY, params.match_thread_num);
+        else
+            ikdtree.Nearest_Search_Batch(feats_down_world->points, NUM_MATCH_POINTS, Nearest_Points, Nearest_Dists, INFINITY, params.match_thread_num);
+        for (int i = 0; i < feats_down_size; i++)
+        {
+            point_selected_surf[i] = Nearest_Points[i].size() < NUM_MATCH_POINTS ? false : Nearest_Dists[i][NUM_MATCH_POINTS - 1] > 5 ? false : true;
+        }
+
+        /** closest surface fitting, the planes only depend on the neighbours and are kept until the next search **/
+        esti_plane_batch(plane_coeffs.data(), plane_valid.get(), Nearest_Points, point_selected_surf.get(), feats_down_size, 0.1f);
+    }
+
+    /** residual computation **/
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for
+    #endif
+    for (int i = 0; i < feats_down_size; i++)
+    {
+        PointType &point_body  = feats_down_body->points[i];
+        PointType &point_world = feats_down_world->points[i];
+        V3D p_body(point_body.x, point_body.y, point_body.z);
+
+        if (!point_selected_surf[i]) continue;
+
+        const VF(4) &pabcd = plane_coeffs[i];
+        point_selected_surf[i] = false;
+        if (plane_valid[i])
+        {
+            float pd2 = pabcd(0) * point_world.x + pabcd(1) * point_world.y + pabcd(2) * point_world.z + pabcd(3);
+            float s = 1 - 0.9 * fabs(pd2) / sqrt(p_body.norm());
+
+            if (s > 0.9)
+            {
+                point_selected_surf[i] = true;
+                normvec->points[i].x = pabcd(0);
+                normvec->points[i].y = pabcd(1);
+                normvec->points[i].z = pabcd(2);
+                normvec->points[i].intensity = pd2;
+                res_last[i] = abs(pd2);
+            }
+        }
+    }
+
+    effct_feat_num = 0;
+
+    for (int i = 0; i < feats_down_size; i++)
+    {
+        if (point_selected_surf[i])
+        {
+            laserCloudOri->points[effct_feat_num] = feats_down_body->points[i];
+            corr_normvect->points[effct_feat_num] = normvec->points[i];
+            total_residual += res_last[i];
+            effct_feat_num ++;
+        }
+    }
+
+    if (effct_feat_num < 1)
+    {
+        /* reported through LioStats::effective_points */
+        ekfom_data.valid = false;
+        return;
+    }
+
+    res_mean_last = total_residual / effct_feat_num;
+    match_time  += omp_get_wtime() - match_start;
+    double solve_start_  = omp_get_wtime();
+
+    /*** Computation of Measuremnt Jacobian matrix H and measurents vector ***/
+    if (params.reduced_update_en)
+    {
+        /*** accumulate H^T H and H^T h directly, one partial sum per thread ***/
+        ekfom_data.reduced = true;
+        ekfom_data.HTH.setZero();
+        ekfom_data.HTh.setZero();
+        ekfom_data.h_x.resize(0, 12);
+        ekfom_data.h.resize(0);
+        Matrix<double, 12, 12> HTH_parts[MP_PROC_NUM];
+        Matrix<double, 12, 1>  HTh_parts[MP_PROC_NUM];
+        for (int k = 0; k < MP_PROC_NUM; k++)
+        {
+            HTH_parts[k].setZero();
+            HTh_parts[k].setZero();
+        }
+        #ifdef MP_EN
+            omp_set_num_threads(MP_PROC_NUM);
+            #pragma omp parallel
+        #endif
+        {
+            Matrix<double, 12, 12> &HTH_part = HTH_parts[omp_get_thread_num()];
+            Matrix<double, 12, 1> &HTh_part = HTh_parts[omp_get_thread_num()];
+            Matrix<double, 1, 12> h_row;
+            double h_i;
+            #ifdef MP_EN
+                #pragma omp for schedule(static)
+            #endif
+            for (int i = 0; i < effct_feat_num; i++)
+            {
+                calc_h_row(s, i, h_row, h_i);
+                HTH_part.noalias() += h_row.transpose() * h_row;
+                HTh_part.noalias() += h_row.transpose() * h_i;
+            }
+        }
+        /* summed in thread order so the result does not depend on which thread finishes first */
+        for (int k = 0; k < MP_PROC_NUM; k++)
+        {
+            ekfom_data.HTH += HTH_parts[k];
+            ekfom_data.HTh += HTh_parts[k];
+        }
+    }
+    else
+    {
+        ekfom_data.h_x = MatrixXd::Zero(effct_feat_num, 12); //23
+        ekfom_data.h.resize(effct_feat_num);
+
+        for (int i = 0; i < effct_feat_num; i++)
+        {
+            Matrix<double, 1, 12> h_row;
+            calc_h_row(s, i, h_row, ekfom_data.h(i));
+            ekfom_data.h_x.block<1, 12>(i,0) = h_row;
+        }
+    }
+    solve_time += omp_get_wtime() - solve_start_;
+}
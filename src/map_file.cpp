@@ -0,0 +1,284 @@
+#include <map_file.h>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const size_t MAP_FILE_PAGE = 4096;
+
+static inline size_t page_floor(size_t x) { return x / MAP_FILE_PAGE * MAP_FILE_PAGE; }
+static inline size_t page_ceil(size_t x)  { return (x + MAP_FILE_PAGE - 1) / MAP_FILE_PAGE * MAP_FILE_PAGE; }
+
+/* cell of a grid anchored at the origin, 21 bits per axis */
+static inline uint64_t grid_key(const MapPoint &p, float edge)
+{
+    const int64_t bias = int64_t(1) << 20;
+    uint64_t x = uint64_t(int64_t(floor(p.x / edge)) + bias) & 0x1FFFFF;
+    uint64_t y = uint64_t(int64_t(floor(p.y / edge)) + bias) & 0x1FFFFF;
+    uint64_t z = uint64_t(int64_t(floor(p.z / edge)) + bias) & 0x1FFFFF;
+    return (x << 42) | (y << 21) | z;
+}
+
+/* squared distance to the centre of its voxel, the ikd-Tree keeps the closest point of a voxel */
+static inline float voxel_center_dist(const MapPoint &p, float edge)
+{
+    float dx = p.x - (floor(p.x / edge) + 0.5f) * edge;
+    float dy = p.y - (floor(p.y / edge) + 0.5f) * edge;
+    float dz = p.z - (floor(p.z / edge) + 0.5f) * edge;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+MapFile::~MapFile()
+{
+    if (data != nullptr) munmap(data, size);
+}
+
+bool MapFile::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        printf("map file: cannot open %s\n", path.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(MapFileHeader))
+    {
+        printf("map file: %s is too short\n", path.c_str());
+        ::close(fd);
+        return false;
+    }
+    size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+    {
+        printf("map file: cannot map %s\n", path.c_str());
+        return false;
+    }
+    data = static_cast<uint8_t *>(addr);
+    /* the chunks are read in no particular order, as the local map moves */
+    madvise(data, size, MADV_RANDOM);
+
+    header_ = reinterpret_cast<const MapFileHeader *>(data);
+    chunks_ = reinterpret_cast<const MapChunk *>(data + sizeof(MapFileHeader));
+    bool valid = memcmp(header_->magic, MAP_FILE_MAGIC, sizeof(MAP_FILE_MAGIC)) == 0 && header_->version == MAP_FILE_VERSION &&
+                 sizeof(MapFileHeader) + uint64_t(header_->chunk_num) * sizeof(MapChunk) <= size;
+    for (uint32_t i = 0; valid && i < header_->chunk_num; i++)
+        valid = chunks_[i].offset % sizeof(MapPoint) == 0 && chunks_[i].offset <= size &&
+                chunks_[i].count <= (size - chunks_[i].offset) / sizeof(MapPoint);   // no overflow on a corrupt count
+    if (!valid)
+    {
+        printf("map file: %s is not a version %u map file\n", path.c_str(), MAP_FILE_VERSION);
+        munmap(data, size);
+        data = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void MapFile::read_chunk(int i, const BoxPointType &box, PointVector &out) const
+{
+    const MapChunk &c = chunks_[i];
+    const MapPoint *points = reinterpret_cast<const MapPoint *>(data + c.offset);
+    PointType p;
+    p.normal_x = p.normal_y = p.normal_z = 0.0f;
+    p.curvature = 0.0f;
+    for (uint64_t j = 0; j < c.count; j++)
+    {
+        const MapPoint &q = points[j];
+        if (q.x < box.vertex_min[0] || q.x > box.vertex_max[0] || q.y < box.vertex_min[1] || q.y > box.vertex_max[1] ||
+            q.z < box.vertex_min[2] || q.z > box.vertex_max[2]) continue;
+        p.x = q.x;
+        p.y = q.y;
+        p.z = q.z;
+        p.intensity = q.intensity;
+        out.push_back(p);
+    }
+    /* the pages are clean, dropping them keeps the resident size independent of the map size */
+    size_t begin = page_ceil(c.offset), end = page_floor(c.offset + c.count * sizeof(MapPoint));
+    if (end > begin) madvise(data + begin, end - begin, MADV_DONTNEED);
+}
+
+MapFileWriter::MapFileWriter(const std::string &path, float chunk_size)
+    : path(path), spill_path(path + ".spill"), chunk_size(chunk_size)
+{
+    spill = fopen(spill_path.c_str(), "wb");
+    if (spill == nullptr) printf("map file: cannot open %s, the map will not be saved\n", spill_path.c_str());
+}
+
+MapFileWriter::~MapFileWriter()
+{
+    if (spill != nullptr)
+    {
+        fclose(spill);
+        remove(spill_path.c_str());
+    }
+}
+
+void MapFileWriter::append(const PointVector &points)
+{
+    if (spill == nullptr) return;
+    MapPoint buf[256];
+    size_t n = 0;
+    for (const PointType &p : points)
+    {
+        buf[n++] = MapPoint{p.x, p.y, p.z, p.intensity};
+        if (n == 256)
+        {
+            fwrite(buf, sizeof(MapPoint), n, spill);
+            n = 0;
+        }
+    }
+    if (n > 0) fwrite(buf, sizeof(MapPoint), n, spill);
+    spill_num += points.size();
+}
+
+bool MapFileWriter::finish(float downsample_size)
+{
+    if (spill == nullptr) return false;
+    fclose(spill);
+    spill = nullptr;
+
+    /*** the spilled points, mapped instead of read ***/
+    const MapPoint *in = nullptr;
+    int spill_fd = ::open(spill_path.c_str(), O_RDONLY);
+    size_t spill_bytes = spill_num * sizeof(MapPoint);
+    if (spill_fd >= 0 && spill_bytes > 0)
+    {
+        void *addr = mmap(nullptr, spill_bytes, PROT_READ, MAP_PRIVATE, spill_fd, 0);
+        in = addr == MAP_FAILED ? nullptr : static_cast<const MapPoint *>(addr);
+    }
+    if (spill_fd >= 0) ::close(spill_fd);
+    if (spill_bytes > 0 && in == nullptr)
+    {
+        printf("map file: cannot read back %s\n", spill_path.c_str());
+        remove(spill_path.c_str());
+        return false;
+    }
+
+    /*** 1. the chunks and their sizes ***/
+    std::unordered_map<uint64_t, uint64_t> chunk_index;
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 0; i < spill_num; i++)
+    {
+        uint64_t key = grid_key(in[i], chunk_size);
+        if (chunk_index.emplace(key, 0).second) keys.push_back(key);
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<MapChunk> chunks(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) chunk_index[keys[i]] = i;
+    std::vector<uint64_t> cursor(keys.size(), 0);
+    for (uint64_t i = 0; i < spill_num; i++) cursor[chunk_index[grid_key(in[i], chunk_size)]] ++;
+
+    size_t points_begin = page_ceil(sizeof(MapFileHeader) + chunks.size() * sizeof(MapChunk));
+    uint64_t offset = points_begin;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        chunks[i].offset = offset;
+        offset += cursor[i] * sizeof(MapPoint);
+        cursor[i] = chunks[i].offset;
+    }
+
+    /*** 2. the points in chunk order, written through a mapping of the output ***/
+    size_t file_bytes = offset;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint8_t *out = nullptr;
+    if (fd >= 0 && ftruncate(fd, file_bytes) == 0)
+    {
+        void *addr = mmap(nullptr, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        out = addr == MAP_FAILED ? nullptr : static_cast<uint8_t *>(addr);
+    }
+    if (out == nullptr)
+    {
+        printf("map file: cannot write %s\n", path.c_str());
+        if (fd >= 0) ::close(fd);
+        if (in != nullptr) munmap(const_cast<MapPoint *>(in), spill_bytes);
+        remove(spill_path.c_str());
+        return false;
+    }
+    for (uint64_t i = 0; i < spill_num; i++)
+    {
+        uint64_t &c = cursor[chunk_index[grid_key(in[i], chunk_size)]];
+        memcpy(out + c, &in[i], sizeof(MapPoint));
+        c += sizeof(MapPoint);
+    }
+    if (in != nullptr) munmap(const_cast<MapPoint *>(in), spill_bytes);
+    remove(spill_path.c_str());
+    std::unordered_map<uint64_t, uint64_t>().swap(chunk_index);
+
+    /*** 3. one point per voxel, chunk by chunk, compacted towards the front ***/
+    MapFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_FILE_MAGIC, sizeof(MAP_FILE_MAGIC));
+    header.version = MAP_FILE_VERSION;
+    header.chunk_num = chunks.size();
+    header.downsample_size = downsample_size;
+    header.chunk_size = chunk_size;
+    for (int k = 0; k < 3; k++)
+    {
+        header.bounds_min[k] = chunks.empty() ? 0.0f : INFINITY;
+        header.bounds_max[k] = chunks.empty() ? 0.0f : -INFINITY;
+    }
+    std::unordered_map<uint64_t, uint64_t> voxel;
+    uint64_t write_offset = points_begin;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        MapChunk &c = chunks[i];
+        MapPoint *src = reinterpret_cast<MapPoint *>(out + c.offset);
+        uint64_t n = (cursor[i] - c.offset) / sizeof(MapPoint);
+        MapPoint *dst = reinterpret_cast<MapPoint *>(out + write_offset);
+        uint64_t kept = 0;
+        voxel.clear();
+        for (uint64_t j = 0; j < n; j++)
+        {
+            MapPoint p = src[j];
+            if (downsample_size > 0.0f)
+            {
+                auto it = voxel.emplace(grid_key(p, downsample_size), kept);
+                if (!it.second)
+                {
+                    MapPoint &q = dst[it.first->second];
+                    if (voxel_center_dist(p, downsample_size) < voxel_center_dist(q, downsample_size)) q = p;
+                    continue;
+                }
+            }
+            dst[kept++] = p;
+        }
+        c.offset = write_offset;
+        c.count = kept;
+        for (int k = 0; k < 3; k++)
+        {
+            c.vertex_min[k] = INFINITY;
+            c.vertex_max[k] = -INFINITY;
+        }
+        for (uint64_t j = 0; j < kept; j++)
+        {
+            const float v[3] = {dst[j].x, dst[j].y, dst[j].z};
+            for (int k = 0; k < 3; k++)
+            {
+                c.vertex_min[k] = std::min(c.vertex_min[k], v[k]);
+                c.vertex_max[k] = std::max(c.vertex_max[k], v[k]);
+            }
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            header.bounds_min[k] = std::min(header.bounds_min[k], c.vertex_min[k]);
+            header.bounds_max[k] = std::max(header.bounds_max[k], c.vertex_max[k]);
+        }
+        header.point_num += kept;
+        write_offset += kept * sizeof(MapPoint);
+    }
+
+    memcpy(out, &header, sizeof(header));
+    if (!chunks.empty()) memcpy(out + sizeof(header), chunks.data(), chunks.size() * sizeof(MapChunk));
+    bool ok = msync(out, file_bytes, MS_SYNC) == 0;
+    munmap(out, file_bytes);
+    ok = ftruncate(fd, write_offset) == 0 && ok;
+    ::close(fd);
+    printf("map file: %lu points in %u chunks saved to %s\n", (unsigned long)header.point_num, header.chunk_num, path.c_str());
+    return ok;
+}
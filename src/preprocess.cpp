@@ -44,6 +44,7 @@ void Preprocess::set(bool feat_en, int lid_type, double bld, int pfilt_num)
 void Preprocess::process(const livox_ros_driver::CustomMsg::ConstPtr &msg, PointCloudXYZI::Ptr &pcl_out)
 {  
   avia_handler(msg);
+  // copied, not swapped: pl_surf keeps its capacity for the next scan, pcl_out is handed on with the scan
   *pcl_out = pl_surf;
 }
 
@@ -89,6 +90,124 @@ void Preprocess::process(const sensor_msgs::PointCloud2::ConstPtr &msg, PointClo
   *pcl_out = pl_surf;
 }
 
+static inline double read_field(const uint8_t *data, int offset, uint8_t datatype)
+{
+  const uint8_t *ptr = data + offset;
+  switch (datatype)
+  {
+    case sensor_msgs::PointField::INT8:    { int8_t v;   memcpy(&v, ptr, 1); return v; }
+    case sensor_msgs::PointField::UINT8:   { uint8_t v;  memcpy(&v, ptr, 1); return v; }
+    case sensor_msgs::PointField::INT16:   { int16_t v;  memcpy(&v, ptr, 2); return v; }
+    case sensor_msgs::PointField::UINT16:  { uint16_t v; memcpy(&v, ptr, 2); return v; }
+    case sensor_msgs::PointField::INT32:   { int32_t v;  memcpy(&v, ptr, 4); return v; }
+    case sensor_msgs::PointField::UINT32:  { uint32_t v; memcpy(&v, ptr, 4); return v; }
+    case sensor_msgs::PointField::FLOAT32: { float v;    memcpy(&v, ptr, 4); return v; }
+    case sensor_msgs::PointField::FLOAT64: { double v;   memcpy(&v, ptr, 8); return v; }
+    default: return 0.0;
+  }
+}
+
+static inline bool host_is_bigendian()
+{
+  const uint16_t one = 1;
+  uint8_t first;
+  memcpy(&first, &one, 1);
+  return first == 0;
+}
+
+static inline uint32_t field_size(uint8_t datatype)
+{
+  switch (datatype)
+  {
+    case sensor_msgs::PointField::INT8:
+    case sensor_msgs::PointField::UINT8:   return 1;
+    case sensor_msgs::PointField::INT16:
+    case sensor_msgs::PointField::UINT16:  return 2;
+    case sensor_msgs::PointField::INT32:
+    case sensor_msgs::PointField::UINT32:
+    case sensor_msgs::PointField::FLOAT32: return 4;
+    case sensor_msgs::PointField::FLOAT64: return 8;
+    default: return 0;
+  }
+}
+
+bool Preprocess::resolve_layout(const sensor_msgs::PointCloud2 &msg, const char *time_field)
+{
+  // read_point reads the fields in host byte order
+  if (bool(msg.is_bigendian) != host_is_bigendian())
+  {
+    field_layout.valid = false;
+    ROS_WARN("PointCloud2 in %s-endian byte order is not supported on this host, scan dropped", msg.is_bigendian ? "big" : "little");
+    return false;
+  }
+  // The layout of a topic does not change between messages, only resolve it again if the point format does
+  if (!field_layout.valid || field_layout.point_step != msg.point_step || field_layout.field_num != msg.fields.size())
+  {
+    field_layout = PointFieldLayout();
+    field_layout.point_step = msg.point_step;
+    field_layout.field_num = msg.fields.size();
+    for (const sensor_msgs::PointField &field : msg.fields)
+    {
+      if (field.name == "x")              { field_layout.x = field.offset; field_layout.type_xyz = field.datatype; }
+      else if (field.name == "y")         field_layout.y = field.offset;
+      else if (field.name == "z")         field_layout.z = field.offset;
+      else if (field.name == "intensity") { field_layout.intensity = field.offset; field_layout.type_intensity = field.datatype; }
+      else if (field.name == time_field)  { field_layout.time = field.offset; field_layout.type_time = field.datatype; }
+      else if (field.name == "ring")      { field_layout.ring = field.offset; field_layout.type_ring = field.datatype; }
+    }
+    if (field_layout.x < 0 || field_layout.y < 0 || field_layout.z < 0)
+    {
+      ROS_WARN("PointCloud2 without x/y/z fields, scan dropped");
+      return false;
+    }
+    // read_point reads the fields straight from the point, each has to lie inside point_step
+    const PointFieldLayout &l = field_layout;
+    auto fits = [&msg](int offset, uint8_t datatype) {
+      return offset < 0 || (field_size(datatype) > 0 && uint64_t(offset) + field_size(datatype) <= msg.point_step);
+    };
+    if (!fits(l.x, l.type_xyz) || !fits(l.y, l.type_xyz) || !fits(l.z, l.type_xyz) || !fits(l.intensity, l.type_intensity) ||
+        !fits(l.time, l.type_time) || !fits(l.ring, l.type_ring))
+    {
+      ROS_WARN("PointCloud2 field beyond point_step %u or of unknown type, scan dropped", msg.point_step);
+      return false;
+    }
+    field_layout.valid = true;
+  }
+
+  // The buffer itself is checked for every message, read_point indexes it without bounds checks
+  if (uint64_t(msg.row_step) < uint64_t(msg.width) * msg.point_step || msg.data.size() < uint64_t(msg.height) * msg.row_step)
+  {
+    ROS_WARN("PointCloud2 of %ux%u points with point_step %u and row_step %u does not fit its %lu bytes, scan dropped",
+             msg.width, msg.height, msg.point_step, msg.row_step, (unsigned long)msg.data.size());
+    return false;
+  }
+  return true;
+}
+
+void Preprocess::read_point(const sensor_msgs::PointCloud2 &msg, int index, RawPoint &pt) const
+{
+  const PointFieldLayout &l = field_layout;
+  const uint8_t *data = (msg.height <= 1) ? &msg.data[index * msg.point_step] : \
+      &msg.data[(index / msg.width) * msg.row_step + (index % msg.width) * msg.point_step];
+  if (l.type_xyz == sensor_msgs::PointField::FLOAT32)
+  {
+    memcpy(&pt.x, data + l.x, sizeof(float));
+    memcpy(&pt.y, data + l.y, sizeof(float));
+    memcpy(&pt.z, data + l.z, sizeof(float));
+  }
+  else
+  {
+    pt.x = read_field(data, l.x, l.type_xyz);
+    pt.y = read_field(data, l.y, l.type_xyz);
+    pt.z = read_field(data, l.z, l.type_xyz);
+  }
+  pt.intensity = l.intensity >= 0 ? read_field(data, l.intensity, l.type_intensity) : 0.0f;
+  pt.time = l.time >= 0 ? read_field(data, l.time, l.type_time) : 0.0;
+  // -1 for a ring no line index can have, the handlers skip it
+  const double ring = l.ring >= 0 ? read_field(data, l.ring, l.type_ring) : 0.0;
+  pt.ring = (ring >= 0.0 && ring < 65536.0) ? int(ring) : -1;
+}
+
 void Preprocess::avia_handler(const livox_ros_driver::CustomMsg::ConstPtr &msg)
 {
   pl_surf.clear();
@@ -130,8 +249,8 @@ void Preprocess::avia_handler(const livox_ros_driver::CustomMsg::ConstPtr &msg)
         }
       }
     }
-    static int count = 0;
-    static double time = 0.0;
+    static thread_local int count = 0;
+    static thread_local double time = 0.0;
     count ++;
     double t0 = omp_get_wtime();
     for(int j=0; j<N_SCANS; j++)
@@ -191,9 +310,9 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
   pl_surf.clear();
   pl_corn.clear();
   pl_full.clear();
-  pcl::PointCloud<ouster_ros::Point> pl_orig;
-  pcl::fromROSMsg(*msg, pl_orig);
-  int plsize = pl_orig.size();
+  if (!resolve_layout(*msg, "t")) return;
+  int plsize = msg->width * msg->height;
+  RawPoint raw;
   pl_corn.reserve(plsize);
   pl_surf.reserve(plsize);
   if (feature_enabled)
@@ -206,14 +325,15 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
 
     for (uint i = 0; i < plsize; i++)
     {
-      double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y + pl_orig.points[i].z * pl_orig.points[i].z;
+      read_point(*msg, i, raw);
+      double range = raw.x * raw.x + raw.y * raw.y + raw.z * raw.z;
       if (range < (blind * blind)) continue;
       Eigen::Vector3d pt_vec;
       PointType added_pt;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
+      added_pt.x = raw.x;
+      added_pt.y = raw.y;
+      added_pt.z = raw.z;
+      added_pt.intensity = raw.intensity;
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
@@ -223,10 +343,10 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
       if (yaw_angle <= -180.0)
         yaw_angle += 360.0;
 
-      added_pt.curvature = pl_orig.points[i].t * time_unit_scale;
-      if(pl_orig.points[i].ring < N_SCANS)
+      added_pt.curvature = raw.time * time_unit_scale;
+      if(raw.ring >= 0 && raw.ring < N_SCANS)
       {
-        pl_buff[pl_orig.points[i].ring].push_back(added_pt);
+        pl_buff[raw.ring].push_back(added_pt);
       }
     }
 
@@ -255,24 +375,25 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     double time_stamp = msg->header.stamp.toSec();
     // cout << "===================================" << endl;
     // printf("Pt size = %d, N_SCANS = %d\r\n", plsize, N_SCANS);
-    for (int i = 0; i < pl_orig.points.size(); i++)
+    for (int i = 0; i < plsize; i++)
     {
       if (i % point_filter_num != 0) continue;
 
-      double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y + pl_orig.points[i].z * pl_orig.points[i].z;
+      read_point(*msg, i, raw);
+      double range = raw.x * raw.x + raw.y * raw.y + raw.z * raw.z;
       
       if (range < (blind * blind)) continue;
       
       Eigen::Vector3d pt_vec;
       PointType added_pt;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
+      added_pt.x = raw.x;
+      added_pt.y = raw.y;
+      added_pt.z = raw.z;
+      added_pt.intensity = raw.intensity;
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
-      added_pt.curvature = pl_orig.points[i].t * time_unit_scale; // curvature unit: ms
+      added_pt.curvature = raw.time * time_unit_scale; // curvature unit: ms
 
       pl_surf.points.push_back(added_pt);
     }
@@ -287,10 +408,10 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     pl_corn.clear();
     pl_full.clear();
 
-    pcl::PointCloud<velodyne_ros::Point> pl_orig;
-    pcl::fromROSMsg(*msg, pl_orig);
-    int plsize = pl_orig.points.size();
+    if (!resolve_layout(*msg, "time")) return;
+    int plsize = msg->width * msg->height;
     if (plsize == 0) return;
+    RawPoint raw;
     pl_surf.reserve(plsize);
 
     /*** These variables only works when no point timestamps given ***/
@@ -301,21 +422,24 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     std::vector<float> time_last(N_SCANS, 0.0);  // last offset time
     /*****************************************************************/
 
-    if (pl_orig.points[plsize - 1].time > 0)
+    read_point(*msg, plsize - 1, raw);
+    if (float(raw.time) > 0)
     {
       given_offset_time = true;
     }
     else
     {
       given_offset_time = false;
-      double yaw_first = atan2(pl_orig.points[0].y, pl_orig.points[0].x) * 57.29578;
+      read_point(*msg, 0, raw);
+      double yaw_first = atan2(raw.y, raw.x) * 57.29578;
       double yaw_end  = yaw_first;
-      int layer_first = pl_orig.points[0].ring;
+      int layer_first = raw.ring;
       for (uint i = plsize - 1; i > 0; i--)
       {
-        if (pl_orig.points[i].ring == layer_first)
+        read_point(*msg, i, raw);
+        if (raw.ring == layer_first)
         {
-          yaw_end = atan2(pl_orig.points[i].y, pl_orig.points[i].x) * 57.29578;
+          yaw_end = atan2(raw.y, raw.x) * 57.29578;
           break;
         }
       }
@@ -331,17 +455,18 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
       
       for (int i = 0; i < plsize; i++)
       {
+        read_point(*msg, i, raw);
         PointType added_pt;
         added_pt.normal_x = 0;
         added_pt.normal_y = 0;
         added_pt.normal_z = 0;
-        int layer  = pl_orig.points[i].ring;
-        if (layer >= N_SCANS) continue;
-        added_pt.x = pl_orig.points[i].x;
-        added_pt.y = pl_orig.points[i].y;
-        added_pt.z = pl_orig.points[i].z;
-        added_pt.intensity = pl_orig.points[i].intensity;
-        added_pt.curvature = pl_orig.points[i].time * time_unit_scale; // units: ms
+        int layer  = raw.ring;
+        if (layer < 0 || layer >= N_SCANS) continue;
+        added_pt.x = raw.x;
+        added_pt.y = raw.y;
+        added_pt.z = raw.z;
+        added_pt.intensity = raw.intensity;
+        added_pt.curvature = float(raw.time) * time_unit_scale; // units: ms
 
         if (!given_offset_time)
         {
@@ -400,21 +525,23 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
     {
       for (int i = 0; i < plsize; i++)
       {
+        read_point(*msg, i, raw);
         PointType added_pt;
         // cout<<"!!!!!!"<<i<<" "<<plsize<<endl;
         
         added_pt.normal_x = 0;
         added_pt.normal_y = 0;
         added_pt.normal_z = 0;
-        added_pt.x = pl_orig.points[i].x;
-        added_pt.y = pl_orig.points[i].y;
-        added_pt.z = pl_orig.points[i].z;
-        added_pt.intensity = pl_orig.points[i].intensity;
-        added_pt.curvature = pl_orig.points[i].time * time_unit_scale;  // curvature unit: ms // cout<<added_pt.curvature<<endl;
+        added_pt.x = raw.x;
+        added_pt.y = raw.y;
+        added_pt.z = raw.z;
+        added_pt.intensity = raw.intensity;
+        added_pt.curvature = float(raw.time) * time_unit_scale;  // curvature unit: ms // cout<<added_pt.curvature<<endl;
 
         if (!given_offset_time)
         {
-          int layer = pl_orig.points[i].ring;
+          int layer = raw.ring;
+          if (layer < 0 || layer >= N_SCANS) continue;
           double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
 
           if (is_first[layer])
@@ -458,20 +585,20 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
 void Preprocess::sim_handler(const sensor_msgs::PointCloud2::ConstPtr &msg) {
     pl_surf.clear();
     pl_full.clear();
-    pcl::PointCloud<pcl::PointXYZI> pl_orig;
-    pcl::fromROSMsg(*msg, pl_orig);
-    int plsize = pl_orig.size();
+    if (!resolve_layout(*msg, "time")) return;
+    int plsize = msg->width * msg->height;
+    RawPoint raw;
     pl_surf.reserve(plsize);
-    for (int i = 0; i < pl_orig.points.size(); i++) {
-        double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y +
-                       pl_orig.points[i].z * pl_orig.points[i].z;
+    for (int i = 0; i < plsize; i++) {
+        read_point(*msg, i, raw);
+        double range = raw.x * raw.x + raw.y * raw.y + raw.z * raw.z;
         if (range < blind * blind) continue;
         Eigen::Vector3d pt_vec;
         PointType added_pt;
-        added_pt.x = pl_orig.points[i].x;
-        added_pt.y = pl_orig.points[i].y;
-        added_pt.z = pl_orig.points[i].z;
-        added_pt.intensity = pl_orig.points[i].intensity;
+        added_pt.x = raw.x;
+        added_pt.y = raw.y;
+        added_pt.z = raw.z;
+        added_pt.intensity = raw.intensity;
         added_pt.normal_x = 0;
         added_pt.normal_y = 0;
         added_pt.normal_z = 0;
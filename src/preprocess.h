@@ -6,15 +6,12 @@
 #include <pcl_conversions/pcl_conversions.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <livox_ros_driver/CustomMsg.h>
+#include <common_lib.h>
 
 using namespace std;
 
 #define IS_VALID(a)  ((abs(a)>1e8) ? true : false)
 
-typedef pcl::PointXYZINormal PointType;
-typedef pcl::PointCloud<PointType> PointCloudXYZI;
-
-enum LID_TYPE{AVIA = 1, VELO16, OUST64, MARSIM}; //{1, 2, 3}
 enum TIME_UNIT{SEC = 0, MS = 1, US = 2, NS = 3};
 enum Feature{Nor, Poss_Plane, Real_Plane, Edge_Jump, Edge_Plane, Wire, ZeroPoint};
 enum Surround{Prev, Next};
@@ -83,6 +80,25 @@ POINT_CLOUD_REGISTER_POINT_STRUCT(ouster_ros::Point,
     (std::uint32_t, range, range)
 )
 
+// Byte offsets of the fields the handlers read from a PointCloud2 buffer, -1 when absent
+struct PointFieldLayout
+{
+  int x, y, z, intensity, time, ring;
+  uint8_t type_xyz, type_intensity, type_time, type_ring;
+  uint32_t point_step;
+  size_t field_num;
+  bool valid;
+  PointFieldLayout() : x(-1), y(-1), z(-1), intensity(-1), time(-1), ring(-1), point_step(0), field_num(0), valid(false) {}
+};
+
+// One point as read from the raw buffer
+struct RawPoint
+{
+  float x, y, z, intensity;
+  double time;
+  int ring;
+};
+
 class Preprocess
 {
   public:
@@ -111,6 +127,8 @@ class Preprocess
   void oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg);
   void velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg);
   void sim_handler(const sensor_msgs::PointCloud2::ConstPtr &msg);
+  bool resolve_layout(const sensor_msgs::PointCloud2 &msg, const char *time_field);
+  void read_point(const sensor_msgs::PointCloud2 &msg, int index, RawPoint &pt) const;
   void give_feature(PointCloudXYZI &pl, vector<orgtype> &types);
   void pub_func(PointCloudXYZI &pl, const ros::Time &ct);
   int  plane_judge(const PointCloudXYZI &pl, vector<orgtype> &types, uint i, uint &i_nex, Eigen::Vector3d &curr_direct);
@@ -126,5 +144,6 @@ class Preprocess
   double edgea, edgeb;
   double smallp_intersect, smallp_ratio;
   double vx, vy, vz;
+  PointFieldLayout field_layout;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include <telemetry.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+/*
+ * Log-linear buckets over nanoseconds: exact below 16 ns, then 8 buckets per power of two,
+ * i.e. a resolution of 12.5 %. Samples beyond 2^40 ns (18 min) go to the last bucket.
+ */
+static const int SUB_BITS = 3;
+static const int SUB_BUCKETS = 1 << SUB_BITS;
+static const int MAX_EXPONENT = 40;
+static const int BUCKET_NUM = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+static inline int bucket_index(uint64_t ns)
+{
+    if (ns < 2 * SUB_BUCKETS) return int(ns);
+    int e = 63 - __builtin_clzll(ns);
+    if (e > MAX_EXPONENT) return BUCKET_NUM - 1;
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + int((ns >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* middle of the bucket, unit: ns */
+static inline double bucket_value(int i)
+{
+    if (i < 2 * SUB_BUCKETS) return i;
+    int e = i / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t width = uint64_t(1) << (e - SUB_BITS);
+    return double((SUB_BUCKETS + i % SUB_BUCKETS) * width) + 0.5 * width;
+}
+
+struct StageHistogram
+{
+    std::atomic<uint32_t> buckets[BUCKET_NUM];
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<uint64_t> max_ns;   // since the last snapshot, which resets it
+};
+
+/* written by one thread only; cumulative, the snapshot takes differences */
+struct ThreadSlot
+{
+    StageHistogram stage[TS_NUM];
+    bool in_use;
+
+    ThreadSlot() : in_use(false)
+    {
+        for (StageHistogram &h : stage)
+        {
+            for (std::atomic<uint32_t> &b : h.buckets) b.store(0, std::memory_order_relaxed);
+            h.sum_ns.store(0, std::memory_order_relaxed);
+            h.max_ns.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+static std::mutex registry_mtx;
+static std::vector<std::unique_ptr<ThreadSlot>> slots;   // never freed, the slot of a finished thread is reused
+
+/*** snapshot state, guarded by registry_mtx ***/
+static uint64_t last_buckets[TS_NUM][BUCKET_NUM];
+static uint64_t last_sum_ns[TS_NUM];
+static std::chrono::steady_clock::time_point last_snapshot = std::chrono::steady_clock::now();
+
+struct SlotHandle
+{
+    ThreadSlot *slot = nullptr;
+
+    ~SlotHandle()
+    {
+        if (slot == nullptr) return;
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        slot->in_use = false;
+    }
+};
+static thread_local SlotHandle slot_handle;
+
+static ThreadSlot &thread_slot()
+{
+    if (slot_handle.slot != nullptr) return *slot_handle.slot;
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    for (std::unique_ptr<ThreadSlot> &s : slots)
+    {
+        if (!s->in_use)
+        {
+            slot_handle.slot = s.get();
+            break;
+        }
+    }
+    if (slot_handle.slot == nullptr)
+    {
+        slots.emplace_back(new ThreadSlot());
+        slot_handle.slot = slots.back().get();
+    }
+    slot_handle.slot->in_use = true;
+    return *slot_handle.slot;
+}
+
+std::atomic<bool>   Telemetry::enabled_(false);
+std::atomic<double> Telemetry::gauges_[TG_NUM];
+
+static const char *STAGE_NAMES[TS_NUM] = {"preprocess", "undistort", "downsample", "map_wait", "map_segment", "match",
+                                          "build_h", "solve", "update", "registration", "map_incremental"};
+static const char *GAUGE_NAMES[TG_NUM] = {"scan_points", "downsampled_points", "effective_points", "map_size", "deleted_points"};
+
+const char *Telemetry::stage_name(TelemetryStage stage)
+{
+    return STAGE_NAMES[stage];
+}
+
+const char *Telemetry::gauge_name(TelemetryGauge gauge)
+{
+    return GAUGE_NAMES[gauge];
+}
+
+void Telemetry::record_ns(TelemetryStage stage, uint64_t ns)
+{
+    StageHistogram &h = thread_slot().stage[stage];
+    std::atomic<uint32_t> &b = h.buckets[bucket_index(ns)];
+    /* the slot has a single writer, a load and a store is enough and avoids a locked instruction */
+    b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.sum_ns.store(h.sum_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    uint64_t max_ns = h.max_ns.load(std::memory_order_relaxed);
+    while (ns > max_ns && !h.max_ns.compare_exchange_weak(max_ns, ns, std::memory_order_relaxed));
+}
+
+void Telemetry::snapshot(TelemetrySnapshot &out)
+{
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    out.period = std::chrono::duration<double>(now - last_snapshot).count();
+    last_snapshot = now;
+
+    std::vector<uint64_t> interval(BUCKET_NUM);
+    for (int s = 0; s < TS_NUM; s++)
+    {
+        StageSummary &summary = out.stages[s];
+        summary.name = STAGE_NAMES[s];
+        uint64_t sum_ns = 0, max_ns = 0, count = 0;
+        for (int i = 0; i < BUCKET_NUM; i++)
+        {
+            uint64_t total = 0;
+            for (std::unique_ptr<ThreadSlot> &slot : slots) total += slot->stage[s].buckets[i].load(std::memory_order_relaxed);
+            interval[i] = total - last_buckets[s][i];
+            last_buckets[s][i] = total;
+            count += interval[i];
+        }
+        for (std::unique_ptr<ThreadSlot> &slot : slots)
+        {
+            sum_ns += slot->stage[s].sum_ns.load(std::memory_order_relaxed);
+            max_ns = std::max(max_ns, slot->stage[s].max_ns.exchange(0, std::memory_order_relaxed));
+        }
+        uint64_t interval_sum_ns = sum_ns - last_sum_ns[s];
+        last_sum_ns[s] = sum_ns;
+
+        summary.count = count;
+        summary.p50 = summary.p99 = summary.max = summary.mean = 0.0;
+        if (count == 0) continue;
+        uint64_t rank50 = (count + 1) / 2, rank99 = count - count / 100, seen = 0;
+        for (int i = 0; i < BUCKET_NUM; i++)
+        {
+            if (interval[i] == 0) continue;
+            if (seen < rank50 && seen + interval[i] >= rank50) summary.p50 = bucket_value(i);
+            seen += interval[i];
+            if (seen >= rank99)
+            {
+                summary.p99 = bucket_value(i);
+                break;
+            }
+        }
+        /* a bucket middle can lie above the largest sample */
+        summary.p50 = std::min(summary.p50, double(max_ns)) * 1e-9;
+        summary.p99 = std::min(summary.p99, double(max_ns)) * 1e-9;
+        summary.max = max_ns * 1e-9;
+        summary.mean = interval_sum_ns * 1e-9 / count;
+    }
+
+    for (int g = 0; g < TG_NUM; g++)
+    {
+        out.gauge_names[g] = GAUGE_NAMES[g];
+        out.gauges[g] = gauges_[g].load(std::memory_order_relaxed);
+    }
+}
+
+TelemetryLog::TelemetryLog(const std::string &path, size_t max_bytes) : path(path), max_bytes(max_bytes)
+{
+    open();
+}
+
+TelemetryLog::~TelemetryLog()
+{
+    if (fp != nullptr) fclose(fp);
+}
+
+void TelemetryLog::open()
+{
+    fp = fopen(path.c_str(), "w");
+    if (fp == nullptr)
+    {
+        printf("telemetry: cannot open %s\n", path.c_str());
+        return;
+    }
+    fprintf(fp, "stamp,name,count,p50_ms,p99_ms,max_ms,mean_ms,value\n");
+}
+
+void TelemetryLog::write(const TelemetrySnapshot &snap, double stamp)
+{
+    if (fp == nullptr) return;
+    for (const StageSummary &s : snap.stages)
+    {
+        if (s.count == 0) continue;
+        fprintf(fp, "%0.6f,%s,%lu,%0.4f,%0.4f,%0.4f,%0.4f,\n", stamp, s.name, (unsigned long)s.count,
+                s.p50 * 1e3, s.p99 * 1e3, s.max * 1e3, s.mean * 1e3);
+    }
+    for (int g = 0; g < TG_NUM; g++)
+        fprintf(fp, "%0.6f,%s,,,,,,%0.0f\n", stamp, snap.gauge_names[g], snap.gauges[g]);
+    fflush(fp);
+
+    if (size_t(ftell(fp)) < max_bytes) return;
+    fclose(fp);
+    std::string previous = path + ".1";
+    rename(path.c_str(), previous.c_str());
+    open();
+}
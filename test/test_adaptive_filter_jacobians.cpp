@@ -0,0 +1,106 @@
+#include <random>
+#include <gtest/gtest.h>
+#include <adaptive_filter_models.h>
+
+/*
+ * The analytic Jacobians of the adaptive filter against central differences of the models they
+ * linearize: F of the prediction model, G and Gl of the indirect lidar measurement with respect
+ * to the current and the previous lidar pose. States are drawn away from the pitch singularity
+ * and with attitude changes well inside (-pi, pi), where the models are smooth.
+ */
+
+const double STEP = 1e-6;
+const double TOLERANCE = 1e-6;
+
+template <int Rows, int Cols, typename Model>
+Eigen::Matrix<double, Rows, Cols> numeric_jacobian(Model model, const Eigen::Matrix<double, Cols, 1> &x)
+{
+    Eigen::Matrix<double, Rows, Cols> J;
+    for (int i = 0; i < Cols; i++)
+    {
+        Eigen::Matrix<double, Cols, 1> xp = x, xm = x;
+        xp(i) += STEP;
+        xm(i) -= STEP;
+        J.col(i) = (model(xp) - model(xm)) / (2.0 * STEP);
+    }
+    return J;
+}
+
+/* pose {x, y, z, roll, pitch, yaw}, |pitch| below 60 degrees */
+static Vector6d random_pose(std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> u(-1.0, 1.0);
+    Vector6d pose;
+    pose << 20.0 * u(rng), 20.0 * u(rng), 5.0 * u(rng), M_PI * u(rng), M_PI / 3.0 * u(rng), M_PI * u(rng);
+    return pose;
+}
+
+/* the pose a lidar period later, a few decimetres and degrees away */
+static Vector6d next_pose(const Vector6d &pose, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> u(-1.0, 1.0);
+    Vector6d next = pose;
+    for (int i = 0; i < 3; i++) next(i) += 0.5 * u(rng);
+    for (int i = 3; i < 6; i++) next(i) += 0.1 * u(rng);
+    return next;
+}
+
+static void expect_near(const Eigen::MatrixXd &analytic, const Eigen::MatrixXd &numeric)
+{
+    double scale = std::max(1.0, numeric.cwiseAbs().maxCoeff());
+    EXPECT_LT((analytic - numeric).cwiseAbs().maxCoeff(), TOLERANCE * scale)
+        << "analytic:\n" << analytic << "\nnumeric:\n" << numeric;
+}
+
+TEST(AdaptiveFilterJacobians, PredictionF)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> u(-1.0, 1.0);
+    for (int trial = 0; trial < 20; trial++)
+    {
+        SCOPED_TRACE(trial);
+        Vector12d x;
+        x.head<6>() = random_pose(rng);
+        for (int i = 6; i < 12; i++) x(i) = 2.0 * u(rng);
+        double dt = 0.01 + 0.1 * std::abs(u(rng));
+        Matrix12d F = jacobian_state(x, dt);
+        Matrix12d F_num = numeric_jacobian<12, 12>([dt](const Vector12d &s) { return f_prediction_model(s, dt); }, x);
+        expect_near(F, F_num);
+    }
+}
+
+TEST(AdaptiveFilterJacobians, LidarMeasurementG)
+{
+    std::mt19937 rng(2);
+    for (int trial = 0; trial < 20; trial++)
+    {
+        SCOPED_TRACE(trial);
+        Vector6d ul = random_pose(rng);
+        Vector6d u = next_pose(ul, rng);
+        double dt = 0.1;
+        Matrix6d G = jacobian_lidar_measurement(u, ul, dt);
+        Matrix6d G_num = numeric_jacobian<6, 6>([&ul, dt](const Vector6d &s) { return indirect_lidar_measurement(s, ul, dt); }, u);
+        expect_near(G, G_num);
+    }
+}
+
+TEST(AdaptiveFilterJacobians, LidarMeasurementGl)
+{
+    std::mt19937 rng(3);
+    for (int trial = 0; trial < 20; trial++)
+    {
+        SCOPED_TRACE(trial);
+        Vector6d ul = random_pose(rng);
+        Vector6d u = next_pose(ul, rng);
+        double dt = 0.1;
+        Matrix6d Gl = jacobian_lidar_measurementL(u, ul, dt);
+        Matrix6d Gl_num = numeric_jacobian<6, 6>([&u, dt](const Vector6d &s) { return indirect_lidar_measurement(u, s, dt); }, ul);
+        expect_near(Gl, Gl_num);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,189 @@
+#include <omp.h>
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+#include <so3_math.h>
+#include <use-ikfom.hpp>
+
+/*
+ * update_iterated_dyn_share_modified with the Schur complement gain (schur_update) against the
+ * inversion of the full 23x23 covariance, on a point-to-plane measurement like the one of
+ * LioCore: same prior, same measurements, the posterior state and covariance have to agree.
+ */
+
+typedef esekfom::esekf<state_ikfom, 12, input_ikfom> Filter;
+typedef Filter::cov Cov;
+typedef Eigen::Matrix<double, 23, 1> Vec23;
+
+const double POINT_COV = 0.001;
+
+/*** the scene of the measurement model: lidar points and the planes they lie on ***/
+struct PlanePoint
+{
+    Eigen::Vector3d point;    // lidar frame
+    Eigen::Vector3d normal;   // world frame
+    double          d;        // normal . p + d = 0
+};
+static std::vector<PlanePoint> scene;
+static bool reduced_model = false;
+
+static void plane_model(state_ikfom &s, esekfom::dyn_share_datastruct<double> &data)
+{
+    const int num = scene.size();
+    Eigen::MatrixXd h_x(num, 12);
+    Eigen::VectorXd h(num);
+    for (int i = 0; i < num; i++)
+    {
+        const PlanePoint &pp = scene[i];
+        Eigen::Vector3d p_imu = s.offset_R_L_I * pp.point + s.offset_T_L_I;
+        Eigen::Vector3d p_world = s.rot * p_imu + s.pos;
+        Eigen::Vector3d C = s.rot.conjugate() * pp.normal;
+        Eigen::Vector3d A = skew_sym_mat<double>(p_imu) * C;
+        Eigen::Vector3d B = skew_sym_mat<double>(pp.point) * (s.offset_R_L_I.conjugate() * C);
+        h_x.row(i) << pp.normal.transpose(), A.transpose(), B.transpose(), C.transpose();
+        h(i) = -(pp.normal.dot(p_world) + pp.d);
+    }
+    data.reduced = reduced_model;
+    if (reduced_model)
+    {
+        data.HTH = h_x.transpose() * h_x;
+        data.HTh = h_x.transpose() * h;
+        data.h_x.resize(0, 12);
+        data.h.resize(0);
+    }
+    else
+    {
+        data.h_x = h_x;
+        data.h = h;
+    }
+}
+
+static Eigen::Vector3d random_unit(std::mt19937 &rng)
+{
+    std::normal_distribution<double> n(0.0, 1.0);
+    return Eigen::Vector3d(n(rng), n(rng), n(rng)).normalized();
+}
+
+/* a state near the origin, the extrinsic a few degrees and centimetres off the identity */
+static state_ikfom random_state(std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> u(-1.0, 1.0);
+    state_ikfom s;
+    s.pos = vect3(Eigen::Vector3d(u(rng), u(rng), u(rng)) * 5.0);
+    s.rot = SO3(Eigen::AngleAxisd(M_PI * u(rng), random_unit(rng)));
+    s.offset_R_L_I = SO3(Eigen::AngleAxisd(0.05 * u(rng), random_unit(rng)));
+    s.offset_T_L_I = vect3(Eigen::Vector3d(u(rng), u(rng), u(rng)) * 0.1);
+    s.vel = vect3(Eigen::Vector3d(u(rng), u(rng), u(rng)));
+    s.bg = vect3(Eigen::Vector3d(u(rng), u(rng), u(rng)) * 0.01);
+    s.ba = vect3(Eigen::Vector3d(u(rng), u(rng), u(rng)) * 0.1);
+    s.grav = S2(Eigen::Vector3d(0.1 * u(rng), 0.1 * u(rng), -9.81));
+    return s;
+}
+
+/* points on random planes around the true pose, seen from it */
+static void make_scene(const state_ikfom &truth, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> u(-1.0, 1.0);
+    std::normal_distribution<double> noise(0.0, 0.01);
+    scene.clear();
+    for (int i = 0; i < 400; i++)
+    {
+        PlanePoint pp;
+        pp.normal = random_unit(rng);
+        Eigen::Vector3d q = truth.pos + Eigen::Vector3d(u(rng), u(rng), u(rng)) * 20.0;
+        pp.d = -pp.normal.dot(q);
+        Eigen::Vector3d p_imu = truth.rot.conjugate() * (q + pp.normal * noise(rng) - truth.pos);
+        pp.point = truth.offset_R_L_I.conjugate() * (p_imu - truth.offset_T_L_I);
+        scene.push_back(pp);
+    }
+}
+
+/* positive definite, correlated, with the magnitudes of a covariance after a few scans */
+static Cov random_covariance(std::mt19937 &rng)
+{
+    std::normal_distribution<double> n(0.0, 1.0);
+    Cov L = Cov::Zero();
+    for (int i = 0; i < 23; i++)
+        for (int j = 0; j <= i; j++) L(i, j) = n(rng) * (i == j ? 1.0 : 0.3);
+    Cov P = L * L.transpose() * 1e-3;
+    P.diagonal().array() += 1e-4;
+    return P;
+}
+
+static void run_update(bool schur, const state_ikfom &x0, const Cov &P0, state_ikfom &x, Cov &P)
+{
+    double epsi[23];
+    std::fill(epsi, epsi + 23, 0.001);
+    Filter kf;
+    kf.init_dyn_share(get_f, df_dx, df_dw, plane_model, 4, epsi);
+    kf.set_schur_update(schur);
+    state_ikfom x_init = x0;
+    Cov P_init = P0;
+    kf.change_x(x_init);
+    kf.change_P(P_init);
+    double solve_time = 0.0;
+    kf.update_iterated_dyn_share_modified(POINT_COV, solve_time);
+    x = kf.get_x();
+    P = kf.get_P();
+}
+
+/* pose and extrinsic are only observed through their composition, the pose of the lidar */
+static double lidar_pose_error(const state_ikfom &s, const state_ikfom &truth)
+{
+    Eigen::Vector3d t = s.rot * s.offset_T_L_I + s.pos;
+    Eigen::Vector3d t_truth = truth.rot * truth.offset_T_L_I + truth.pos;
+    Eigen::Quaterniond q = s.rot * s.offset_R_L_I;
+    Eigen::Quaterniond q_truth = truth.rot * truth.offset_R_L_I;
+    return (t - t_truth).norm() + q.angularDistance(q_truth);
+}
+
+static void compare_paths(bool reduced)
+{
+    reduced_model = reduced;
+    std::mt19937 rng(7);
+    std::normal_distribution<double> n(0.0, 1.0);
+    for (int trial = 0; trial < 5; trial++)
+    {
+        SCOPED_TRACE(trial);
+        state_ikfom truth = random_state(rng);
+        make_scene(truth, rng);
+        Cov P0 = random_covariance(rng);
+        /* the prior off the truth by a sample of its own covariance */
+        Vec23 dx;
+        for (int i = 0; i < 23; i++) dx(i) = n(rng);
+        dx = P0.llt().matrixL() * dx;
+        state_ikfom x0 = truth;
+        x0.boxplus(dx);
+
+        state_ikfom x_inv, x_schur;
+        Cov P_inv, P_schur;
+        run_update(false, x0, P0, x_inv, P_inv);
+        run_update(true, x0, P0, x_schur, P_schur);
+
+        Vec23 diff;
+        x_schur.boxminus(diff, x_inv);
+        EXPECT_LT(diff.norm(), 1e-8);
+        EXPECT_LT((P_schur - P_inv).norm(), 1e-8 * P_inv.norm());
+        EXPECT_LT((P_schur - P_schur.transpose()).norm(), 1e-12 * P_schur.norm());
+        EXPECT_GT(P_schur.ldlt().vectorD().minCoeff(), 0.0);
+
+        /* the update has to move the lidar pose, the observable part of the state, towards the truth */
+        EXPECT_LT(lidar_pose_error(x_schur, truth), lidar_pose_error(x0, truth));
+    }
+}
+
+TEST(EsekfUpdate, SchurMatchesFullInverse)
+{
+    compare_paths(false);
+}
+
+TEST(EsekfUpdate, SchurMatchesFullInverseReduced)
+{
+    compare_paths(true);
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}